@@ -0,0 +1,91 @@
+#pragma once
+
+#include "defs.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// This is written to assume either Windows or POSIX
+namespace dust
+{
+    // Read-only memory mapping of a whole file.
+    //
+    // This lets parsers (eg. image decoders) read a file directly from
+    // the page cache without first copying it into a buffer.
+    struct MappedFile
+    {
+        MappedFile() {}
+        MappedFile(const char * path) { open(path); }
+        MappedFile(MappedFile const &) = delete;
+
+        ~MappedFile() { close(); }
+
+        // map the file at path (UTF-8), closing any previous mapping
+        // returns false on failure, including empty files
+        bool open(const char * path)
+        {
+            close();
+#ifdef _WIN32
+            HANDLE f = CreateFileW(to_u16(path).c_str(), GENERIC_READ,
+                FILE_SHARE_READ, 0, OPEN_EXISTING,
+                FILE_FLAG_SEQUENTIAL_SCAN, 0);
+            if(f == INVALID_HANDLE_VALUE) return false;
+
+            LARGE_INTEGER sz;
+            if(GetFileSizeEx(f, &sz) && sz.QuadPart
+            && size_t(sz.QuadPart) == uint64_t(sz.QuadPart))
+            {
+                // the view keeps the mapping alive, so we can close
+                // both handles once it exists
+                HANDLE m = CreateFileMappingW(f, 0, PAGE_READONLY, 0, 0, 0);
+                if(m)
+                {
+                    mapData = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+                    if(mapData) mapSize = size_t(sz.QuadPart);
+                    CloseHandle(m);
+                }
+            }
+            CloseHandle(f);
+#else
+            int fd = ::open(path, O_RDONLY);
+            if(fd < 0) return false;
+
+            struct stat st;
+            if(!fstat(fd, &st) && st.st_size > 0)
+            {
+                void * p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(p != MAP_FAILED)
+                {
+                    mapData = p;
+                    mapSize = st.st_size;
+                }
+            }
+            ::close(fd);
+#endif
+            return mapData != 0;
+        }
+
+        void close()
+        {
+            if(!mapData) return;
+#ifdef _WIN32
+            UnmapViewOfFile(mapData);
+#else
+            munmap(mapData, mapSize);
+#endif
+            mapData = 0;
+            mapSize = 0;
+        }
+
+        const void * data() const { return mapData; }
+        size_t size() const { return mapSize; }
+
+    private:
+        void    *mapData = 0;
+        size_t  mapSize = 0;
+    };
+};
@@ -3,6 +3,8 @@
 
 #include "window.h"
 
+#include "dust/thread/threadpool.h"
+
 namespace dust
 {
     struct AudioCallback
@@ -15,8 +17,16 @@ namespace dust
     // Also provides IWC and exits when all attached windows are closed.
     struct Application : WindowDelegate
     {
-        Application() : nOpenWindow(0), audioCallback(0) { platformInit(); }
-        virtual ~Application() { platformClose(); }
+        Application() : nOpenWindow(0), audioCallback(0)
+        {
+            platformInit();
+            setRenderThreadPool(&renderPool);
+        }
+        virtual ~Application()
+        {
+            setRenderThreadPool(0);
+            platformClose();
+        }
 
         // by default, we count windows and exit when last one is closed
         void win_created() { ++nOpenWindow; }
@@ -68,6 +78,9 @@ namespace dust
 
         AudioCallback   *audioCallback;
 
+        // used for parallel rendering, see setRenderThreadPool()
+        ThreadPool      renderPool;
+
         // FIXME: these are not supported on Windows yet
         void platformAudioInit();
         void platformAudioClose();
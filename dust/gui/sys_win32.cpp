@@ -916,7 +916,8 @@ struct Win32Window : Window, Win32Callback, WinDropHandler
         DeleteObject(ii.hbmColor);
 
         // Windows scales like garbage, so do it manually
-        tmp.validate(icon.getSizeX() / 2, icon.getSizeY() / 2);
+        // CreateBitmap() below needs pitch == width
+        tmp.validate(icon.getSizeX() / 2, icon.getSizeY() / 2, 1);
         for(int y = 0; y < tmp.getSizeY(); ++y)
         {
             for(int x = 0; x < tmp.getSizeX(); ++x)
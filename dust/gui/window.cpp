@@ -24,6 +24,10 @@ namespace dust
         dragButton = 0;
 
         dpiScalePercentage = 100;
+
+        // leave some room for growing, so that interactive resizing
+        // doesn't need to reallocate the backing store every frame
+        backingSurface.setSlack(25);
     }
 
     Window::~Window()
@@ -362,6 +366,7 @@ namespace dust
                 r.clip(wr);
 
                 RenderContext rc(backingSurface, r);
+                MaskDataBorrow borrow(rasterScratch, rc);
 
                 // always initialize to opaque black
                 rc.clear(theme.winColor);
@@ -291,6 +291,9 @@ namespace dust
 
         Surface         backingSurface;
 
+        // kept across frames, see MaskDataBorrow
+        RasterScratch   rasterScratch;
+
         std::vector<Rect>   redrawRects;
         // this is used to double-buffer redrawRects
         std::vector<Rect>   paintQueue;
@@ -4,6 +4,8 @@
 
 #include "font.h"
 
+#include <cstring>
+
 using namespace dust;
 
 float FontInstance::getTextWidth(const char * txt, unsigned len,
@@ -13,7 +15,9 @@ float FontInstance::getTextWidth(const char * txt, unsigned len,
 
     float width = 0;
 
-    const Glyph * g = 0;
+    // the last char, we only need the glyph for the bearings
+    unsigned ch = 0;
+    bool haveChar = false;
 
     // we use this to check if last char is incomplete
     bool charDone = true;
@@ -24,26 +28,28 @@ float FontInstance::getTextWidth(const char * txt, unsigned len,
         if(charDone)
         {
             // add glyph advance to the width
-            g = getGlyphForChar(decoder.ch);
-            width += g->advanceW;
+            ch = decoder.ch;
+            haveChar = true;
+            width += getCharAdvanceW(ch);
 
             // if this is first char of a line then pad with lsb
-            if(adjustLeft) { width -= g->lsb; adjustLeft = false; }
+            if(adjustLeft) { width -= getCharLSB(ch); adjustLeft = false; }
         }
     }
 
     if(!charDone)
     {
         // add glyph advance to the width
-        g = getGlyphForChar(utf8::invalid);
-        width += g->advanceW;
+        ch = utf8::invalid;
+        haveChar = true;
+        width += getCharAdvanceW(ch);
 
         // if this is first char of a line then pad with lsb
-        if(adjustLeft) { width -= g->lsb; adjustLeft = false; }
+        if(adjustLeft) { width -= getCharLSB(ch); adjustLeft = false; }
     }
 
     // do rsb adjustment if desired; only if we have a glyph
-    if(g && adjustRight) { width -= g->rsb; }
+    if(haveChar && adjustRight) { width -= getGlyphMetrics(ch)->rsb; }
 
     return width;
 }
@@ -52,7 +58,7 @@ float FontInstance::splitLines(std::vector<unsigned> & outBreaks,
     const char * txt, unsigned len, float widthPx0, float widthPx)
 {
     utf8::Decoder   decoder;
-    const Glyph * g = 0;
+    float advanceW = 0;
     
     outBreaks.clear();
     outBreaks.push_back(0); // assume we split right away
@@ -85,8 +91,8 @@ float FontInstance::splitLines(std::vector<unsigned> & outBreaks,
             }
             
             // add glyph advance to the width
-            g = getGlyphForChar(decoder.ch);
-            current += g->advanceW;
+            advanceW = getCharAdvanceW(decoder.ch);
+            current += advanceW;
             
             // if we have a space, advance current linebreak
             if(decoder.ch == ' ')
@@ -108,7 +114,7 @@ float FontInstance::splitLines(std::vector<unsigned> & outBreaks,
                 if(!outBreaks.back() || current > widthPx)
                 {
                     outBreaks.back() = charStart;
-                    current = g->advanceW;
+                    current = advanceW;
                 }
                 
                 outBreaks.push_back(outBreaks.back());
@@ -120,9 +126,9 @@ float FontInstance::splitLines(std::vector<unsigned> & outBreaks,
     if(!charDone)
     {
         // add glyph advance to the width
-        g = getGlyphForChar(utf8::invalid);
+        advanceW = getCharAdvanceW(utf8::invalid);
         
-        current += g->advanceW;
+        current += advanceW;
 
         // see above
         if(current > remaining)
@@ -130,7 +136,7 @@ float FontInstance::splitLines(std::vector<unsigned> & outBreaks,
             if(!outBreaks.back() || current > widthPx)
             {
                 outBreaks.back() = charStart;
-                current = g->advanceW;
+                current = advanceW;
             }
             
             outBreaks.push_back(outBreaks.back());
@@ -143,3 +149,93 @@ float FontInstance::splitLines(std::vector<unsigned> & outBreaks,
 
     return widthPx - remaining;
 }
+
+void FontInstance::prewarm(const CharRange * ranges, unsigned nRanges)
+{
+    for(unsigned i = 0; i < nRanges; ++i)
+    {
+        for(unsigned ch = ranges[i].first; ch <= ranges[i].last; ++ch)
+        {
+            getGlyphForChar(ch);
+        }
+    }
+}
+
+TextRun & TextRun::operator=(const TextRun & r)
+{
+    if(this == &r) return *this;
+
+    clearLayout();
+
+    text = r.text;
+    items = r.items;
+    width = r.width;
+    adjustedWidth = r.adjustedWidth;
+    if(r.instance) instance = r.instance->retain();
+
+    return *this;
+}
+
+void TextRun::setText(const char * txt, unsigned len)
+{
+    if(len == ~0u) len = strlen(txt);
+
+    if(text.size() == len && !text.compare(0, len, txt, len)) return;
+
+    text.assign(txt, len);
+    clearLayout();
+}
+
+void TextRun::clearLayout()
+{
+    items.clear();
+    width = 0;
+    adjustedWidth = 0;
+
+    if(instance) instance = instance->release();
+}
+
+bool TextRun::update(Font & font)
+{
+    FontInstance * fi = font.getInstance();
+    if(!fi) return false;
+    if(fi == instance) return true;
+
+    clearLayout();
+    instance = fi->retain();
+
+    utf8::Decoder   decoder;
+
+    // we use this to check if last char is incomplete
+    bool charDone = true;
+    for(unsigned i = 0; i < text.size(); ++i)
+    {
+        charDone = decoder.next(text[i]);
+        if(charDone)
+        {
+            items.push_back(Item{ decoder.ch,
+                fi->getGlyphMetrics(decoder.ch) });
+        }
+    }
+
+    if(!charDone)
+    {
+        items.push_back(Item{ utf8::invalid,
+            fi->getGlyphMetrics(utf8::invalid) });
+    }
+
+    // same order of operations as getTextWidth(), so that
+    // the results are exactly the same
+    for(unsigned i = 0; i < items.size(); ++i)
+    {
+        const Glyph * g = items[i].glyph;
+
+        width += g->advanceW;
+
+        adjustedWidth += g->advanceW;
+        if(!i) adjustedWidth -= g->lsb;
+    }
+    if(items.size()) adjustedWidth -= items.back().glyph->rsb;
+
+    return true;
+}
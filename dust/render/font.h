@@ -15,6 +15,13 @@ namespace dust
     // One should getOversampleX() and getOversampleY() on the font
     // to figure out how to stride through the bitmap data.
     //
+    // The bitmaps are packed into atlas pages owned by the font instance
+    // so rows are pitch bytes apart. Glyphs themselves stay valid for
+    // the lifetime of the font instance, but the bitmap can be evicted
+    // when the atlas is full, so it's only valid until the next call to
+    // getGlyphForChar() which brings it back if necessary (the glyphs
+    // from getGlyphMetrics() might not have a bitmap at all).
+    //
     // NOTE: lsb is (typically negative) offset from origin
     // where as rsb is (typically positive) offset to advanceW
     //
@@ -26,12 +33,19 @@ namespace dust
         int         originY;    // bitmap origin relative to glyph
 
         unsigned    bbW, bbH;   // bitmap pixel size
+        unsigned    pitch;      // bytes from one row of bitmap to next
 
         // these are in non-oversampled scale:
         float       advanceW;   // advance width in pixels
         float       lsb, rsb;   // left-side/right-side bearing
 
-        Alpha       bitmap[];   // alpha mask for the glyph: bbW x bbH
+        Alpha       *bitmap;    // alpha mask for the glyph: bbW x bbH
+    };
+
+    // range of unicode codepoints, both ends inclusive
+    struct CharRange
+    {
+        unsigned first, last;
     };
 
     struct FontCreateParameters
@@ -47,13 +61,16 @@ namespace dust
         const FontCreateParameters  parameters;
 
         FontInstance(const FontCreateParameters & param)
-        : parameters(param), __refCount(1) {}
+        : parameters(param), __refCount(1) { clearLowAdvanceW(); }
 
         // increment reference count and return a pointer to object
         FontInstance * retain() { ++__refCount; return this; }
         // decrement reference count and return null-pointer
         FontInstance * release() { if(!--__refCount) delete this; return 0; }
 
+        // current reference count, including the one held by FontCache
+        unsigned getRefCount() const { return __refCount; }
+
         //////////////////////
         /// Core Interface ///
         //////////////////////
@@ -75,10 +92,15 @@ namespace dust
         float getVertOffset() { return .5f * (metrics.ascent - metrics.descent); }
 
         // return the advance width for the character (ie. rsb - lsb)
-        float getCharAdvanceW(unsigned ch) { return getGlyphForChar(ch)->advanceW; }
+        float getCharAdvanceW(unsigned ch)
+        {
+            if(ch < nLowChars && lowAdvanceW[ch] >= 0)
+                return lowAdvanceW[ch];
+            return getGlyphMetrics(ch)->advanceW;
+        }
 
         // return the left-side bearing for a character
-        float getCharLSB(unsigned ch) { return getGlyphForChar(ch)->lsb; }
+        float getCharLSB(unsigned ch) { return getGlyphMetrics(ch)->lsb; }
 
         // get the extents of an utf-8 string, by default the advance width
         //
@@ -112,6 +134,25 @@ namespace dust
         // returns a glyph for a character, see notes on Glyph
         virtual const Glyph * getGlyphForChar(unsigned ch) = 0;
 
+        // like getGlyphForChar() but for measuring text: the bitmap can
+        // be null, which saves rendering glyphs that are never drawn
+        virtual const Glyph * getGlyphMetrics(unsigned ch)
+        { return getGlyphForChar(ch); }
+
+        // create the glyphs for ranges of characters ahead of time
+        //
+        // Implementations can do this in the background (the STB fonts
+        // rasterize in parallel on the render thread pool, when there
+        // is one) in which case the glyphs are picked up by a later
+        // getGlyphForChar() once they are ready. Characters that are
+        // requested before that are just created as usual.
+        //
+        // The default fonts warm up ASCII and Latin-1 when loaded.
+        virtual void prewarm(const CharRange * ranges, unsigned nRanges);
+
+        void prewarm(const std::vector<CharRange> & ranges)
+        { prewarm(ranges.data(), ranges.size()); }
+
         // get the oversampling factors - these are per-font
         unsigned getOversampleX() const { return oversampleX; }
         unsigned getOversampleY() const { return oversampleY; }
@@ -132,6 +173,17 @@ namespace dust
             float lineheight;   // cached from the above
         } metrics;
 
+        // advance widths of the most common characters, so that
+        // getCharAdvanceW() can skip the virtual call; these are filled
+        // in by the implementation as glyphs are created
+        static const unsigned nLowChars = 0x800;
+        float       lowAdvanceW[nLowChars]; // negative if not known yet
+
+        void clearLowAdvanceW()
+        {
+            for(unsigned i = 0; i < nLowChars; ++i) lowAdvanceW[i] = -1;
+        }
+
         unsigned    oversampleX;    // bitmap oversampling in X direction
         unsigned    oversampleY;    // bitmap oversampling in Y direction
 
@@ -147,6 +199,38 @@ namespace dust
         unsigned __refCount;
     };
 
+    // Process-wide cache of font instances, shared by all Font handles.
+    //
+    // Instances are keyed by (font data, size, DPI) and kept around when
+    // no Font uses them anymore, so that eg. moving a window back to the
+    // previous monitor or toggling zoom finds the glyphs already there.
+    //
+    // When the glyph memory of all the instances exceeds the budget, the
+    // least recently loaded instances that are no longer used are freed.
+    // This is checked whenever a font is loaded or the budget is set.
+    //
+    // Like fonts in general, this should only be used from one thread.
+    struct FontCache
+    {
+        struct Stats
+        {
+            uint64_t    hits;       // loadFont() found an instance
+            uint64_t    misses;     // loadFont() created an instance
+            uint64_t    evictions;  // unused instances freed
+            size_t      bytesGlyphs;    // glyph memory of all instances
+            size_t      bytesBudget;
+            unsigned    instances;      // including the unused ones
+        };
+
+        // set the glyph memory budget and free unused instances to fit
+        static void setBudget(size_t bytes);
+
+        // free all the instances that are not currently used
+        static void clear();
+
+        static Stats getStats();
+    };
+
     // never call this directly, it's just a rebuild time optimisation
     // this keeps font.default.h from having to include anything
     const uint8_t * __getDefaultFontData(bool monospace);
@@ -209,6 +293,9 @@ namespace dust
         { release(); instance = f.instance->retain(); return *this; }
 		FontInstance * operator->() const { return instance; }
 
+        // the current instance, this changes when the font is resized
+        FontInstance * getInstance() const { return instance; }
+
     private:
         FontInstance * instance;
 
@@ -216,4 +303,68 @@ namespace dust
 
     };
 
+    // Text that is decoded, looked up and measured once, then drawn
+    // with RenderContext::drawText() as many times as necessary.
+    //
+    // This is for labels and other UI text that is drawn every frame
+    // but rarely changes: drawing a prepared run skips the UTF-8 decoding
+    // and centering doesn't need to measure the text again.
+    //
+    // The layout is for a particular font instance and it is redone
+    // automatically by update() when the font has a different instance,
+    // eg. because it was resized or another font was assigned to it.
+    // The run keeps a reference to the instance it was laid out for.
+    struct TextRun
+    {
+        struct Item
+        {
+            unsigned    ch;
+            const Glyph *glyph;     // for metrics, possibly no bitmap
+        };
+
+        TextRun() {}
+        TextRun(const std::string & txt) : text(txt) {}
+        TextRun(const TextRun & r) { *this = r; }
+
+        ~TextRun() { clearLayout(); }
+
+        TextRun & operator=(const TextRun & r);
+
+        // set the utf-8 text, invalidates the layout if it changed
+        void setText(const char * txt, unsigned len = ~0);
+        void setText(const std::string & txt)
+        { setText(txt.c_str(), txt.size()); }
+
+        const std::string & getText() const { return text; }
+
+        // lay out the text for the current instance of font, unless
+        // that's already been done; returns false if the font is invalid
+        bool update(Font & font);
+
+        // true if laid out for the current instance of font
+        bool valid(const Font & font) const
+        { return instance && instance == font.getInstance(); }
+
+        // these are valid after update()
+
+        // total advance width, like FontInstance::getTextWidth()
+        float getWidth() const { return width; }
+
+        // width adjusted by lsb/rsb of the first/last char for centering
+        float getAdjustedWidth() const { return adjustedWidth; }
+
+        const std::vector<Item> & getItems() const { return items; }
+
+    private:
+        std::string         text;
+        std::vector<Item>   items;
+
+        FontInstance    *instance = 0;
+
+        float   width = 0;
+        float   adjustedWidth = 0;
+
+        void clearLayout();
+    };
+
 }; // namespace
@@ -3,9 +3,13 @@
 #include "dust/core/hash.h"
 #include "dust/render/rect.h"
 #include "dust/render/render_path.h"
+#include "dust/thread/threadpool.h"
 
 #include "font.h"
 
+#include <memory>
+#include <atomic>
+
 #define STB_TRUETYPE_IMPLEMENTATION
 #define STBTT_STATIC    // don't need this outside this module
 #include "dust/libs/stb_truetype_min.h"
@@ -16,6 +20,17 @@ using namespace dust;
 //// GLYPH CACHE - FIXME: Make this part of renderer? ////
 //////////////////////////////////////////////////////////
 
+// per-glyph data that we keep for the lifetime of the font instance
+//
+// these are allocated in blocks, so they never move and freeing
+// the font only has to free the blocks
+struct GlyphSlot
+{
+    Glyph       glyph;      // what we return to the outside world
+    int         index;      // glyph index in the font
+    int         page;       // atlas page with the bitmap, -1 if none
+};
+
 // we could theoretically hash codepoints to glyph indexes and
 // then glyph indexes to glyph data, but just skip the indexes
 //
@@ -23,79 +38,264 @@ using namespace dust;
 struct GlyphCache
 {
     unsigned cp;
-    Glyph * glyph;
+    GlyphSlot * slot;
 
     unsigned getKey() const { return cp; }
     bool keyEqual(unsigned _cp) const { return _cp == cp; }
     static uint64_t getHash(unsigned cp) { return hash64(cp); }
 };
 
-///////////////////////////////
-//// Actual back-end logic ////
-///////////////////////////////
+// Maps codepoints to glyph slots.
+//
+// Text is measured and drawn one character at a time, so this needs to
+// be fast for the common case: the low characters (Latin, Greek,
+// Cyrillic, Hebrew, Arabic..) are looked up directly from a flat array,
+// the rest of the BMP from pages of 256 characters that are allocated
+// when the first glyph in the page is created. Only the astral planes
+// go through the hash table.
+struct GlyphMap
+{
+    static const unsigned nLow = 0x800;
 
-struct FontInstanceSTB : FontInstance
+    GlyphSlot   *low[nLow];
+
+    std::unique_ptr<GlyphSlot*[]>   pages[0x100];
+    unsigned    nPages = 0;
+
+    Table<GlyphCache>   astral;
+
+    GlyphMap() { clear(); }
+
+    // returns null if there's no glyph for ch yet
+    GlyphSlot * find(unsigned ch)
+    {
+        if(ch < nLow) return low[ch];
+        if(ch < 0x10000)
+        {
+            GlyphSlot ** page = pages[ch >> 8].get();
+            return page ? page[ch & 0xff] : 0;
+        }
+
+        GlyphCache * gc = astral.find(ch);
+        return gc ? gc->slot : 0;
+    }
+
+    void insert(unsigned ch, GlyphSlot * slot)
+    {
+        if(ch < nLow) { low[ch] = slot; return; }
+        if(ch < 0x10000)
+        {
+            auto & page = pages[ch >> 8];
+            if(!page)
+            {
+                page.reset(new GlyphSlot*[0x100]());
+                ++nPages;
+            }
+            page[ch & 0xff] = slot;
+            return;
+        }
+
+        astral.insert(GlyphCache{ch, slot});
+    }
+
+    void clear()
+    {
+        for(unsigned i = 0; i < nLow; ++i) low[i] = 0;
+        for(auto & page : pages) page.reset();
+        nPages = 0;
+        astral.clear();
+    }
+
+    // bytes used by the pages, the rest is more or less fixed
+    size_t getPageMemory() const
+    {
+        return nPages * 0x100 * sizeof(GlyphSlot*);
+    }
+};
+
+// Glyph bitmaps are packed into large pages of alpha, rather than
+// allocating each one separately, so that text touches a few pages
+// instead of hundreds of scattered heap blocks.
+//
+// Each page is split into shelves: rows of glyphs of similar height
+// placed from left to right. Glyphs go into the shelf that wastes the
+// least height, or a new shelf if none of them have room left.
+//
+// When the total size of the pages would exceed the budget, the least
+// recently used page is evicted: the glyphs on it just lose their
+// bitmaps and are rasterized again when they are needed.
+struct GlyphAtlas
 {
-    stbtt_fontinfo  info;
-    float           scale;  // scale from font units to pixels
+    // the default page size, larger glyphs get a page of their own
+    static const unsigned pageSize = 256;
 
-    Table<GlyphCache>   cache;
+    // maximum bytes of pages, before we start evicting
+    // the font sets this according to the size of the glyphs
+    size_t      budget = 4 << 20;
 
-    FontInstanceSTB(const FontCreateParameters & p) : FontInstance(p) {}
+    struct Shelf
+    {
+        unsigned y, h;      // position and height
+        unsigned used;      // width used so far
+    };
 
-    ~FontInstanceSTB() { clearCache(); }
+    struct Page
+    {
+        std::vector<Alpha>  pixels;
+        unsigned            w, h;
+        unsigned            top = 0;    // height used by shelves
 
-    // return true if successful
-    bool init()
+        std::vector<Shelf>      shelves;
+        std::vector<GlyphSlot*> glyphs;
+
+        uint64_t            lastUse = 0;
+    };
+
+    // evicted pages leave null entries, which are reused
+    std::vector<std::unique_ptr<Page>>  pages;
+
+    size_t      bytes = 0;
+    uint64_t    clock = 0;
+
+    int         current = -1;   // page we're currently filling
+
+    void clear()
     {
-        if(!stbtt_InitFont(&info, parameters.data, 0)) return false;
+        pages.clear();
+        bytes = 0;
+        current = -1;
+    }
 
-        oversampleX = 1;    // oversample on X axis (set below)
-        oversampleY = 1;    // oversample on Y axis (just snap?)
+    // mark the page with a glyph that is being used
+    void touch(int page) { pages[page]->lastUse = ++clock; }
 
-        float sizePx = parameters.sizePt * parameters.dpi * (1 / 72.f);
+    // find space for the bitmap of slot, which must not have one
+    void alloc(GlyphSlot * slot)
+    {
+        Glyph & g = slot->glyph;
 
-        // double the pixel size in X-direction with oversampling
-        // until it's above a threshold; this improves positioning
-        // of small fonts while reducing render time of large ones
-        // also cap the oversampling for very small sizes just in case
-        int resX = 1 + (int)sizePx;
-        while(resX < 96 && oversampleX < 3)
+        unsigned x = 0, y = 0;
+        if(current >= 0 && place(*pages[current], g.bbW, g.bbH, x, y))
         {
-            oversampleX <<= 1; resX <<= 1;
+            finishAlloc(slot, current, x, y);
+            return;
         }
 
-        // compute pixel size: 72 dpi gives 1pt = 1px
-        scale = stbtt_ScaleForMappingEmToPixels(&info, sizePx);
+        // new page, of it's own if the glyph is too large
+        unsigned w = (std::max)(unsigned(pageSize), g.bbW);
+        unsigned h = (std::max)(unsigned(pageSize), g.bbH);
+        int page = newPage(w, h);
 
-        // get metrics, scale them and store them
-        // we want descent as distance going down, so negate
-        int ascent, descent, lineGap;
-        stbtt_GetFontVMetrics(&info, &ascent, &descent, &lineGap);
+        // this can't fail on an empty page that is large enough, but
+        // if it ever did, (0,0) is still a valid spot on a new page
+        if(!place(*pages[page], g.bbW, g.bbH, x, y)) x = y = 0;
 
-        setMetrics(scale*ascent, -scale*descent, scale*lineGap);
+        // keep filling regular pages, rather than the large ones
+        if(current < 0 || (w == pageSize && h == pageSize)) current = page;
 
-        // clear cache just in case
-        clearCache();
+        finishAlloc(slot, page, x, y);
+    }
+
+private:
+    void finishAlloc(GlyphSlot * slot, int page, unsigned x, unsigned y)
+    {
+        Page & p = *pages[page];
+
+        slot->page = page;
+        slot->glyph.pitch = p.w;
+        slot->glyph.bitmap = p.pixels.data() + x + y * p.w;
+        p.glyphs.push_back(slot);
+
+        touch(page);
+    }
+
+    bool place(Page & p, unsigned w, unsigned h, unsigned & x, unsigned & y)
+    {
+        // best fit shelf by wasted height, but don't waste too much
+        Shelf * best = 0;
+        for(auto & s : p.shelves)
+        {
+            if(s.h < h || s.h > h + h/2 + 2 || s.used + w > p.w) continue;
+            if(!best || s.h < best->h) best = &s;
+        }
+
+        if(!best)
+        {
+            if(p.top + h > p.h || w > p.w) return false;
+
+            Shelf s = { p.top, h, 0 };
+            p.shelves.push_back(s);
+            p.top += h;
+            best = &p.shelves.back();
+        }
 
+        x = best->used;
+        y = best->y;
+        best->used += w;
         return true;
     }
 
-    void clearCache()
+    int newPage(unsigned w, unsigned h)
     {
-        cache.foreach([](GlyphCache & gc){ free(gc.glyph); });
-        cache.clear();
+        // make room, if a single page is over budget then so be it
+        while(bytes + w * h > budget && evictOldest()) {}
+
+        unsigned i = 0;
+        while(i < pages.size() && pages[i]) ++i;
+        if(i == pages.size()) pages.emplace_back();
+
+        pages[i].reset(new Page);
+        Page & p = *pages[i];
+        p.w = w;
+        p.h = h;
+        p.pixels.resize(w * h);
+
+        bytes += w * h;
+        return i;
     }
 
-    const Glyph * getGlyphForChar(unsigned ch)
+    bool evictOldest()
     {
-        auto * gc = cache.find(ch);
-        if(gc) return gc->glyph;
+        int oldest = -1;
+        for(unsigned i = 0; i < pages.size(); ++i)
+        {
+            if(!pages[i]) continue;
+            if(oldest < 0 || pages[i]->lastUse < pages[oldest]->lastUse)
+                oldest = i;
+        }
+        if(oldest < 0) return false;
 
-        //debugPrint("generating glyph for '%c' (=%d)\n", ch, ch);
+        Page & p = *pages[oldest];
+        for(GlyphSlot * slot : p.glyphs)
+        {
+            slot->glyph.bitmap = 0;
+            slot->page = -1;
+        }
 
-        // didn't find it, create one
+        bytes -= p.w * p.h;
+        pages[oldest].reset();
+        if(current == oldest) current = -1;
+        return true;
+    }
+};
 
+///////////////////////////////
+//// Actual back-end logic ////
+///////////////////////////////
+
+// The part of the font that creates glyphs: this only reads the font
+// data, so prewarm() can give a copy to the pool threads.
+struct GlyphRenderer
+{
+    stbtt_fontinfo  info;
+    float           scale;  // scale from font units to pixels
+
+    unsigned        oversampleX, oversampleY;
+
+    // compute the metrics and the bitmap box for a character,
+    // but leave the bitmap null; returns the glyph index
+    int initGlyph(unsigned ch, Glyph & g) const
+    {
         // find index, unpack some metrics
         int index = stbtt_FindGlyphIndex(&info, ch);
         // fall back to "invalid char" if not found?
@@ -117,144 +317,460 @@ struct FontInstanceSTB : FontInstance
             r.y1 += 2*oversampleY + 2;
         }
 
-        // allocate
-        auto * g = (Glyph*) malloc(sizeof(Glyph) + sizeof(Alpha) * r.w() * r.h());
-
         // get metrics and scale; do we need lsb for anything?
         int advanceW, lsb;
         stbtt_GetGlyphHMetrics(&info, index, &advanceW, &lsb);
-        g->advanceW = scale * advanceW;
-        g->lsb = scale * lsb;
+        g.advanceW = scale * advanceW;
+        g.lsb = scale * lsb;
 
         // compute rsb: advance - lsb - (xMax-xMin)
         // these are design units
         int xMin, xMax, yMin, yMax;
         stbtt_GetGlyphBox(&info, index, &xMin, &yMin, &xMax, &yMax);
-        g->rsb = scale * (advanceW - lsb - (xMax - xMin));
+        g.rsb = scale * (advanceW - lsb - (xMax - xMin));
 
         // we offset by 1 pixel to avoid clipping our stroke
-        g->originX = r.x0 - 1;
-        g->originY = r.y0 - 1;
+        g.originX = r.x0 - 1;
+        g.originY = r.y0 - 1;
+
+        g.bitmap = 0;
+        g.pitch = 0;
 
         // check if glyph actually has a legit bitmap (eg. not space)
         if(r.w() && r.h())
         {
-            g->bbW = r.w();
-            g->bbH = r.h();
-
-            // get the vertices
-            stbtt_vertex    *verts;
-            int nVerts = stbtt_GetGlyphShape(&info, index, &verts);
-
-            // bitmap descriptor in stbtt format, then rasterize
-            stbtt__bitmap sbm;
-            sbm.pixels = g->bitmap;
-            sbm.stride = r.w();
-            sbm.w = r.w();
-            sbm.h = r.h();
-
-            // prefiltering will shift the glyph by .5*(os-1)
-            // so calculate inverse offsets
-            float shiftX = .5f*(oversampleX - 1) / oversampleX;
-            float shiftY = .5f*(oversampleY - 1) / oversampleY;
-
-            // second parameter is tolerance, last two are invert and userdata
-            // we always want our coordinate system with y going up, so invert
-            if(0) stbtt_Rasterize(&sbm, .25f, verts, nVerts,
-                xSize, ySize, shiftX, shiftY,
-                r.x0-oversampleX, r.y0-oversampleY, 1, 0);
-            else
+            g.bbW = r.w();
+            g.bbH = r.h();
+        }
+        else
+        {
+            g.bbW = 0;
+            g.bbH = 0;
+        }
+
+        return index;
+    }
+
+    // render the bitmap of a glyph set up by initGlyph()
+    void renderGlyph(int index, const Glyph & g,
+        Alpha * bitmap, unsigned pitch) const
+    {
+        // the bitmap box, as computed in initGlyph()
+        Rect r(g.originX + 1, g.originY + 1, g.bbW, g.bbH);
+
+        float xSize = scale * oversampleX;
+        float ySize = scale * oversampleY;
+
+        // get the vertices
+        stbtt_vertex    *verts;
+        int nVerts = stbtt_GetGlyphShape(&info, index, &verts);
+
+        // bitmap descriptor in stbtt format, then rasterize
+        stbtt__bitmap sbm;
+        sbm.pixels = bitmap;
+        sbm.stride = pitch;
+        sbm.w = r.w();
+        sbm.h = r.h();
+
+        // prefiltering will shift the glyph by .5*(os-1)
+        // so calculate inverse offsets
+        float shiftX = .5f*(oversampleX - 1) / oversampleX;
+        float shiftY = .5f*(oversampleY - 1) / oversampleY;
+
+        // second parameter is tolerance, last two are invert and userdata
+        // we always want our coordinate system with y going up, so invert
+        if(0) stbtt_Rasterize(&sbm, .25f, verts, nVerts,
+            xSize, ySize, shiftX, shiftY,
+            r.x0-oversampleX, r.y0-oversampleY, 1, 0);
+        else
+        {
+            dust::Path p;
+            for(int i = 0; i < nVerts; ++i)
             {
-                dust::Path p;
-                for(int i = 0; i < nVerts; ++i)
+                float x = verts[i].x * scale;
+                float y = verts[i].y * scale;
+                switch(verts[i].type)
                 {
-                    float x = verts[i].x * scale;
-                    float y = verts[i].y * scale;
-                    switch(verts[i].type)
+                case STBTT_vmove:
+                    p.move(x, -y);
+                    break;
+                case STBTT_vline:
+                    p.line(x, -y);
+                    break;
+                case STBTT_vcurve:
                     {
-                    case STBTT_vmove:
-                        p.move(x, -y);
-                        break;
-                    case STBTT_vline:
-                        p.line(x, -y);
-                        break;
-                    case STBTT_vcurve:
-                        {
-                            float cx = verts[i].cx * scale;
-                            float cy = verts[i].cy * scale;
-                            p.quad(cx, -cy, x, -y);
-                        }
-                        break;
+                        float cx = verts[i].cx * scale;
+                        float cy = verts[i].cy * scale;
+                        p.quad(cx, -cy, x, -y);
                     }
+                    break;
                 }
+            }
+
+            Rect rr(0,0,r.w(),r.h());
 
-                Rect rr(0,0,r.w(),r.h());
-                memset(g->bitmap, 0, r.w() * r.h());
-
-                // stroke the path, to force visibility
-                // makes fonts a bit fatter, but whatever
-                dust::Path p2;
-                dust::TransformPath<dust::Path> tp(p2,
-                    oversampleX, 0, float(oversampleX) - r.x0 + shiftX,
-                    0, oversampleY, float(oversampleY) - r.y0 + shiftY);
-                // about 1/2 pixels?
-                p.stroke(tp, .25f);
-                
-                // copy the original path on top of the stroke
-                p.process(tp);
-                
-                // then just draw as usual
-                dust::renderPathRef(p2, rr,
-                    dust::FILL_NONZERO, g->bitmap, r.w(), 4, false);
+            // pages can be reused after eviction, so always clear
+            for(unsigned y = 0; y < g.bbH; ++y)
+            {
+                memset(bitmap + y*pitch, 0, g.bbW);
             }
 
-            // free the vertices
-            STBTT_free(verts, 0);
+            // stroke the path, to force visibility
+            // makes fonts a bit fatter, but whatever
+            dust::Path p2;
+            dust::TransformPath<dust::Path> tp(p2,
+                oversampleX, 0, float(oversampleX) - r.x0 + shiftX,
+                0, oversampleY, float(oversampleY) - r.y0 + shiftY);
+            // about 1/2 pixels?
+            p.stroke(tp, .25f);
+            
+            // copy the original path on top of the stroke
+            p.process(tp);
+            
+            // then just draw as usual
+            dust::renderPathRef(p2, rr,
+                dust::FILL_NONZERO, bitmap, pitch, 4, false);
+        }
+
+        // free the vertices
+        STBTT_free(verts, 0);
 
-            // finally do a filtering
-            if(oversampleX > 1)
+        // finally do a filtering
+        if(oversampleX > 1)
+        {
+            for(unsigned y = 0; y < g.bbH; ++y)
             {
-                for(unsigned y = 0; y < g->bbH; ++y)
+                for(unsigned x = 0; x < g.bbW - oversampleX; ++x)
                 {
-                    for(unsigned x = 0; x < g->bbW - oversampleX; ++x)
+                    int total = 0;
+                    // short kernel so just run it brute-force
+                    for(unsigned j = 0; j < oversampleX; ++j)
                     {
-                        int total = 0;
-                        // short kernel so just run it brute-force
-                        for(unsigned j = 0; j < oversampleX; ++j)
-                        {
-                            total += g->bitmap[(x+j) + y*g->bbW];
-                        }
-                        g->bitmap[x + y*g->bbW] = total / oversampleX;
+                        total += bitmap[(x+j) + y*pitch];
                     }
+                    bitmap[x + y*pitch] = total / oversampleX;
                 }
             }
+        }
 
-            if(oversampleY > 1)
+        if(oversampleY > 1)
+        {
+            for(unsigned y = 0; y < g.bbH - oversampleY; ++y)
             {
-                for(unsigned y = 0; y < g->bbH - oversampleY; ++y)
+                for(unsigned x = 0; x < g.bbW; ++x)
                 {
-                    for(unsigned x = 0; x < g->bbW; ++x)
+                    int total = 0;
+                    // short kernel so just run it brute-force
+                    for(unsigned j = 0; j < oversampleY; ++j)
                     {
-                        int total = 0;
-                        // short kernel so just run it brute-force
-                        for(unsigned j = 0; j < oversampleY; ++j)
-                        {
-                            total += g->bitmap[x + (j+y)*g->bbW];
-                        }
-                        g->bitmap[x + y*g->bbW] = total / oversampleY;
+                        total += bitmap[x + (j+y)*pitch];
                     }
+                    bitmap[x + y*pitch] = total / oversampleY;
                 }
             }
         }
-        else
+    }
+};
+
+// Glyphs rendered in the background by prewarm(), waiting for the font
+// to pick them up and place them into the atlas on the UI thread.
+//
+// The tasks only use this (and their own copy of the renderer) because
+// they can outlive the font, so both the font and the tasks hold a
+// reference and the font sets cancel when it's freed. Tasks that never
+// run (eg. when the pool is destroyed first on exit) just leak theirs.
+struct GlyphPrewarm
+{
+    struct Result
+    {
+        unsigned            cp;
+        GlyphSlot           slot;   // without a page
+        std::vector<Alpha>  pixels; // bbW x bbH, empty if not rendered
+    };
+
+    const GlyphRenderer     renderer;
+
+    std::atomic<unsigned>   refs;
+    std::atomic<bool>       cancel;
+    std::atomic<bool>       ready;  // set when there are results
+
+    Mutex                   mutex;  // protects results
+    std::vector<Result>     results;
+
+    GlyphPrewarm(const GlyphRenderer & renderer)
+    : renderer(renderer), refs(1), cancel(false), ready(false) {}
+
+    void release() { if(!--refs) delete this; }
+};
+
+struct GlyphPrewarmTask : ThreadTask
+{
+    GlyphPrewarm            *prewarm;
+    std::vector<unsigned>   chars;
+
+    void threadpool_runtask()
+    {
+        std::vector<GlyphPrewarm::Result> out(chars.size());
+
+        unsigned n = 0;
+        for(; n < chars.size() && !prewarm->cancel; ++n)
+        {
+            GlyphPrewarm::Result & r = out[n];
+            r.cp = chars[n];
+            r.slot.page = -1;
+            r.slot.index = prewarm->renderer.initGlyph(r.cp, r.slot.glyph);
+
+            // renderPathRef() splits anything this large into bands on
+            // the pool anyway, so rather than hold up this task with it,
+            // leave it for getGlyphForChar() to rasterize when needed
+            const Glyph & g = r.slot.glyph;
+            if(!g.bbW || g.bbW * g.bbH >= unsigned(renderParallelMinArea))
+                continue;
+
+            r.pixels.resize(g.bbW * g.bbH);
+            prewarm->renderer.renderGlyph(r.slot.index, g,
+                r.pixels.data(), g.bbW);
+        }
+
+        if(n)
+        {
+            Mutex::Lock lock(prewarm->mutex);
+            for(unsigned i = 0; i < n; ++i)
+            {
+                prewarm->results.push_back(std::move(out[i]));
+            }
+            prewarm->ready = true;
+        }
+
+        prewarm->release();
+        delete this;
+    }
+};
+
+struct FontInstanceSTB : FontInstance
+{
+    GlyphRenderer       renderer;
+
+    GlyphMap            cache;
+    GlyphAtlas          atlas;
+
+    // glyph slots are allocated in blocks of this many
+    static const unsigned slotBlockSize = 256;
+
+    std::vector<std::unique_ptr<GlyphSlot[]>>   slotBlocks;
+    unsigned    slotsUsed = 0;  // in the last block
+
+    // created by the first prewarm() that uses the pool
+    GlyphPrewarm        *prewarmState = 0;
+
+    FontInstanceSTB(const FontCreateParameters & p) : FontInstance(p) {}
+
+    ~FontInstanceSTB()
+    {
+        if(prewarmState)
+        {
+            prewarmState->cancel = true;
+            prewarmState->release();
+        }
+        clearCache();
+    }
+
+    // return true if successful
+    bool init()
+    {
+        stbtt_fontinfo & info = renderer.info;
+        if(!stbtt_InitFont(&info, parameters.data, 0)) return false;
+
+        oversampleX = 1;    // oversample on X axis (set below)
+        oversampleY = 1;    // oversample on Y axis (just snap?)
+
+        float sizePx = parameters.sizePt * parameters.dpi * (1 / 72.f);
+
+        // double the pixel size in X-direction with oversampling
+        // until it's above a threshold; this improves positioning
+        // of small fonts while reducing render time of large ones
+        // also cap the oversampling for very small sizes just in case
+        int resX = 1 + (int)sizePx;
+        while(resX < 96 && oversampleX < 3)
+        {
+            oversampleX <<= 1; resX <<= 1;
+        }
+
+        renderer.oversampleX = oversampleX;
+        renderer.oversampleY = oversampleY;
+
+        // compute pixel size: 72 dpi gives 1pt = 1px
+        float scale = stbtt_ScaleForMappingEmToPixels(&info, sizePx);
+        renderer.scale = scale;
+
+        // get metrics, scale them and store them
+        // we want descent as distance going down, so negate
+        int ascent, descent, lineGap;
+        stbtt_GetFontVMetrics(&info, &ascent, &descent, &lineGap);
+
+        setMetrics(scale*ascent, -scale*descent, scale*lineGap);
+
+        // clear cache just in case
+        clearCache();
+
+        // eviction is for large character sets, so keep at least
+        // the equivalent of a thousand or so full size glyphs
+        size_t emW = size_t(sizePx * oversampleX) + 2*oversampleX + 2;
+        size_t emH = size_t(sizePx * oversampleY) + 2*oversampleY + 2;
+        atlas.budget = (std::max)(atlas.budget, 1024 * emW * emH);
+
+        return true;
+    }
+
+    void clearCache()
+    {
+        cache.clear();
+        atlas.clear();
+        slotBlocks.clear();
+        slotsUsed = 0;
+
+        clearLowAdvanceW();
+    }
+
+    // bytes of memory used by the glyphs
+    size_t getGlyphMemory()
+    {
+        return atlas.bytes + cache.getPageMemory()
+            + slotBlocks.size() * slotBlockSize * sizeof(GlyphSlot);
+    }
+
+    GlyphSlot * newSlot()
+    {
+        if(!slotBlocks.size() || slotsUsed == slotBlockSize)
         {
-            g->bbW = 0;
-            g->bbH = 0;
+            slotBlocks.emplace_back(new GlyphSlot[slotBlockSize]);
+            slotsUsed = 0;
         }
+        return &slotBlocks.back()[slotsUsed++];
+    }
+
+    // store a new glyph into the cache
+    void addSlot(unsigned ch, GlyphSlot * slot)
+    {
+        cache.insert(ch, slot);
+        if(ch < nLowChars) lowAdvanceW[ch] = slot->glyph.advanceW;
+    }
+
+    // find or create the glyph for ch, but don't rasterize it
+    GlyphSlot * getSlot(unsigned ch)
+    {
+        GlyphSlot * slot = cache.find(ch);
+        if(slot) return slot;
+
+        //debugPrint("generating glyph for '%c' (=%d)\n", ch, ch);
+
+        // didn't find it, create one
+        slot = newSlot();
+        slot->index = renderer.initGlyph(ch, slot->glyph);
+        slot->page = -1;
 
         // oh right, store the glyph into the cache
-        cache.insert(GlyphCache{ch, g});
-        return g;
+        addSlot(ch, slot);
+        return slot;
+    }
+
+    const Glyph * getGlyphMetrics(unsigned ch)
+    {
+        return &getSlot(ch)->glyph;
+    }
+
+    const Glyph * getGlyphForChar(unsigned ch)
+    {
+        // do this first, since it can evict atlas pages
+        if(prewarmState && prewarmState->ready) addPrewarmed();
+
+        GlyphSlot * slot = getSlot(ch);
+        if(slot->page >= 0) atlas.touch(slot->page);
+        else if(slot->glyph.bbW) rasterize(slot);
+        return &slot->glyph;
+    }
+
+    void prewarm(const CharRange * ranges, unsigned nRanges)
+    {
+        ThreadPool * pool = getRenderThreadPool();
+        if(!pool) { FontInstance::prewarm(ranges, nRanges); return; }
+
+        // anything still in flight from a previous call is just
+        // rendered again, addPrewarmed() drops the duplicates
+        std::vector<unsigned> chars;
+        for(unsigned i = 0; i < nRanges; ++i)
+        {
+            for(unsigned ch = ranges[i].first; ch <= ranges[i].last; ++ch)
+            {
+                if(!cache.find(ch)) chars.push_back(ch);
+            }
+        }
+        if(!chars.size()) return;
+
+        if(!prewarmState) prewarmState = new GlyphPrewarm(renderer);
+
+        // a few tasks per thread for balance, but not tiny ones
+        unsigned nChars = chars.size();
+        unsigned chunk = (std::max)(32u,
+            nChars / (4 * pool->getThreadCount()) + 1);
+
+        std::vector<ThreadTask*> tasks;
+        for(unsigned i = 0; i < nChars; i += chunk)
+        {
+            GlyphPrewarmTask * task = new GlyphPrewarmTask;
+            task->prewarm = prewarmState;
+            task->chars.assign(chars.begin() + i,
+                chars.begin() + (std::min)(i + chunk, nChars));
+            ++prewarmState->refs;
+
+            tasks.push_back(task);
+        }
+
+        pool->queue_tasks(tasks.data(), tasks.size());
+    }
+
+    // place the glyphs finished by prewarm() into the cache
+    void addPrewarmed()
+    {
+        std::vector<GlyphPrewarm::Result> results;
+        {
+            Mutex::Lock lock(prewarmState->mutex);
+            results.swap(prewarmState->results);
+            prewarmState->ready = false;
+        }
+
+        for(auto & r : results)
+        {
+            // skip the ones we've created in the meantime
+            if(cache.find(r.cp)) continue;
+
+            GlyphSlot * slot = newSlot();
+            *slot = r.slot;
+
+            // without pixels, the bitmap is rendered when needed
+            if(r.pixels.size())
+            {
+                atlas.alloc(slot);
+
+                Glyph & g = slot->glyph;
+                for(unsigned y = 0; y < g.bbH; ++y)
+                {
+                    memcpy(g.bitmap + y*g.pitch,
+                        r.pixels.data() + y*g.bbW, g.bbW);
+                }
+            }
+
+            addSlot(r.cp, slot);
+        }
+    }
+
+    // render the bitmap of a glyph into the atlas
+    void rasterize(GlyphSlot * slot)
+    {
+        atlas.alloc(slot);
+
+        Glyph & g = slot->glyph;
+        renderer.renderGlyph(slot->index, g, g.bitmap, g.pitch);
     }
 };
 
@@ -262,11 +778,13 @@ struct FontInstanceSTB : FontInstance
 //// FONT CACHE ////
 ////////////////////
 
-struct FontCache
+struct FontCacheEntry
 {
     FontCreateParameters    key;
     FontInstanceSTB         *value;
 
+    uint64_t                lastUse;
+
     FontCreateParameters const & getKey() const { return key; }
     bool keyEqual(FontCreateParameters const & other) const
     {
@@ -280,39 +798,133 @@ struct FontCache
     }
 };
 
-static Table<FontCache> fontCache;
-
-struct FontInstanceSTBCached : FontInstanceSTB
-{
-    FontInstanceSTBCached(const FontCreateParameters & param)
-    : FontInstanceSTB(param)
+namespace {
+    struct FontCacheData
     {
-        fontCache.insert(FontCache{parameters, this});
-        //debugPrint("Fonts in cache: %d\n", fontCache.size());
-    }
-    ~FontInstanceSTBCached()
+        // each instance in the table has one reference held by us
+        Table<FontCacheEntry>   fonts;
+
+        FontCache::Stats        stats = {};
+        uint64_t                clock = 0;
+
+        FontCacheData() { stats.bytesBudget = 16 << 20; }
+
+        ~FontCacheData() { freeUnused(0); }
+
+        // free the least recently used instances that only we hold
+        // until the glyphs of all the instances fit in the budget
+        // or all of them if the budget is zero
+        //
+        // returns the number of instances freed
+        unsigned freeUnused(size_t budget)
+        {
+            std::vector<FontCacheEntry*> unused;
+            size_t bytes = 0;
+            fonts.foreach([&](FontCacheEntry & e)
+            {
+                bytes += e.value->getGlyphMemory();
+                if(e.value->getRefCount() == 1) unused.push_back(&e);
+            });
+
+            std::sort(unused.begin(), unused.end(),
+                [](FontCacheEntry * a, FontCacheEntry * b)
+                { return a->lastUse < b->lastUse; });
+
+            unsigned n = 0;
+            for(; n < unused.size() && (bytes > budget || !budget); ++n)
+            {
+                FontInstanceSTB * font = unused[n]->value;
+                bytes -= font->getGlyphMemory();
+
+                // removing doesn't move the other entries around
+                fonts.remove(unused[n]->getKey());
+                font->release();
+            }
+
+            stats.bytesGlyphs = bytes;
+            stats.instances = fonts.size();
+            return n;
+        }
+    };
+
+    static FontCacheData & fontCache()
     {
-        fontCache.remove(parameters);
-        //debugPrint("Fonts in cache: %d\n", fontCache.size());
+        static FontCacheData cache;
+        return cache;
     }
-};
+}
+
+void FontCache::setBudget(size_t bytes)
+{
+    FontCacheData & cache = fontCache();
+    cache.stats.bytesBudget = bytes;
+    cache.stats.evictions += cache.freeUnused(bytes);
+}
+
+void FontCache::clear()
+{
+    FontCacheData & cache = fontCache();
+    cache.stats.evictions += cache.freeUnused(0);
+}
+
+FontCache::Stats FontCache::getStats()
+{
+    FontCacheData & cache = fontCache();
+
+    // glyphs are created lazily, so count them again
+    size_t bytes = 0;
+    cache.fonts.foreach([&](FontCacheEntry & e)
+        { bytes += e.value->getGlyphMemory(); });
+    cache.stats.bytesGlyphs = bytes;
+
+    return cache.stats;
+}
 
 void Font::loadFont(const FontCreateParameters & param)
 {
+    FontCacheData & cache = fontCache();
+
     FontInstanceSTB * font = 0;
 
-    auto * cached = fontCache.find(param);
+    auto * cached = cache.fonts.find(param);
 
-    if(cached) { font = cached->value; font->retain(); }
+    if(cached)
+    {
+        ++cache.stats.hits;
+        cached->lastUse = ++cache.clock;
+
+        font = cached->value;
+        font->retain();
+    }
     else
     {
-        font = new FontInstanceSTBCached(param);
+        ++cache.stats.misses;
+
+        font = new FontInstanceSTB(param);
 
         // try to initialise the font
         if(!font->init()) { font->release(); return; }
+
+        // the cache keeps the initial reference
+        cache.fonts.insert(FontCacheEntry{param, font, ++cache.clock});
+        font->retain();
+
+        // warm up the default fonts, but only in the background
+        if(getRenderThreadPool()
+        && (param.data == __getDefaultFontData(false)
+        || param.data == __getDefaultFontData(true)))
+        {
+            static const CharRange latin[] =
+            { { 0x20, 0x7e }, { 0xa0, 0xff } };
+
+            font->prewarm(latin, 2);
+        }
     }
 
     // once we're done, replace any existing font
     release();
     instance = font;
+
+    // this might have made the previous instance unused
+    cache.stats.evictions += cache.freeUnused(cache.stats.bytesBudget);
 }
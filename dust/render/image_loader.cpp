@@ -0,0 +1,232 @@
+
+#include "image_loader.h"
+#include "render_path.h"    // for getRenderThreadPool()
+
+#include "dust/core/mapped_file.h"
+
+using namespace dust;
+
+// the size that fits (w, h) keeping the aspect ratio, never larger
+static void fitSize(unsigned sw, unsigned sh,
+    unsigned w, unsigned h, unsigned & dw, unsigned & dh)
+{
+    double scale = 1;
+    if(w && w < sw) scale = (std::min)(scale, w / double(sw));
+    if(h && h < sh) scale = (std::min)(scale, h / double(sh));
+
+    dw = (std::max)(1u, unsigned(sw * scale + .5));
+    dh = (std::max)(1u, unsigned(sh * scale + .5));
+}
+
+// scale src down to (dw, dh) which must not be larger
+//
+// This halves with the mipmaps for as long as the result is still at
+// least the target size, then box filters the rest of the way so that
+// each target pixel averages one or two source pixels along each axis.
+static void downscale(Surface & src, Surface & dst, unsigned dw, unsigned dh)
+{
+    unsigned level = 0, sw = src.getSizeX(), sh = src.getSizeY();
+    while(((sw + 1) >> 1) >= dw && ((sh + 1) >> 1) >= dh
+    && (sw > 1 || sh > 1))
+    {
+        sw = (sw + 1) >> 1;
+        sh = (sh + 1) >> 1;
+        ++level;
+    }
+
+    Surface & mip = src.getMip(level);
+
+    dst.validate(dw, dh);
+
+    ARGB * in = mip.getPixels();
+    ARGB * out = dst.getPixels();
+    unsigned inPitch = mip.getPitch(), outPitch = dst.getPitch();
+
+    for(unsigned y = 0; y < dh; ++y)
+    {
+        unsigned y0 = y * sh / dh, y1 = ((y + 1) * sh + dh - 1) / dh;
+
+        for(unsigned x = 0; x < dw; ++x)
+        {
+            unsigned x0 = x * sw / dw, x1 = ((x + 1) * sw + dw - 1) / dw;
+
+            unsigned a = 0, r = 0, g = 0, b = 0;
+            for(unsigned j = y0; j < y1; ++j)
+            {
+                for(unsigned i = x0; i < x1; ++i)
+                {
+                    ARGB c = in[i + j * inPitch];
+                    a += c >> 24; r += (c >> 16) & 0xff;
+                    g += (c >> 8) & 0xff; b += c & 0xff;
+                }
+            }
+
+            unsigned n = (x1 - x0) * (y1 - y0), h = n >> 1;
+            out[x + y * outPitch] = ((a + h) / n << 24)
+                | ((r + h) / n << 16) | ((g + h) / n << 8) | ((b + h) / n);
+        }
+    }
+}
+
+struct ImageLoader::Job : ThreadTask
+{
+    ImageLoader *loader;
+
+    std::string path;
+    unsigned    w, h;
+
+    Surface     image;
+
+    void threadpool_runtask()
+    {
+        // decode straight from the page cache, no need for a copy
+        MappedFile file(path.c_str());
+        if(file.data())
+        {
+            Surface full(file.data(), file.size());
+            file.close();
+
+            unsigned dw, dh;
+            fitSize(full.getSizeX(), full.getSizeY(), w, h, dw, dh);
+
+            if(!full.getSizeX()
+            || (dw == full.getSizeX() && dh == full.getSizeY()))
+            {
+                image.swap(full);
+            }
+            else
+            {
+                downscale(full, image, dw, dh);
+            }
+        }
+
+        loader->finish(this);
+    }
+};
+
+ImageLoader::~ImageLoader()
+{
+    // wait for the jobs still out there, then free everything
+    doneCount.wait(nPending);
+
+    for(Job * job : doneJobs) delete job;
+}
+
+void ImageLoader::finish(Job * job)
+{
+    {
+        Mutex::Lock lock(doneMutex);
+        doneJobs.push_back(job);
+    }
+    doneCount.post();
+}
+
+void ImageLoader::load(const char * path,
+    unsigned w, unsigned h, Callback done)
+{
+    Key key = { path, w, h };
+
+    Entry * e = cache.find(key);
+    if(e)
+    {
+        if(!e->image) { if(done) e->waiting.push_back(done); }
+        else if(done) done(*e->image);
+        return;
+    }
+
+    Entry ne;
+    ne.path = path;
+    ne.w = w;
+    ne.h = h;
+    if(done) ne.waiting.push_back(done);
+    cache.insert(ne);
+
+    Job * job = new Job;
+    job->loader = this;
+    job->path = path;
+    job->w = w;
+    job->h = h;
+
+    ++nPending;
+
+    ThreadPool * p = pool ? pool : getRenderThreadPool();
+    if(p)
+    {
+        ThreadTask * task = job;
+        p->queue_tasks(&task, 1);
+    }
+    else
+    {
+        job->threadpool_runtask();
+    }
+}
+
+Surface * ImageLoader::find(const char * path, unsigned w, unsigned h)
+{
+    Key key = { path, w, h };
+
+    Entry * e = cache.find(key);
+    return e ? e->image.get() : 0;
+}
+
+unsigned ImageLoader::poll()
+{
+    std::vector<Job*> jobs;
+    {
+        Mutex::Lock lock(doneMutex);
+        if(!doneJobs.size()) return 0;
+        jobs.swap(doneJobs);
+    }
+
+    for(Job * job : jobs)
+    {
+        // consume the post that goes with the job, so that the
+        // destructor only waits for the ones still out there
+        doneCount.wait();
+        --nPending;
+
+        Key key = { job->path.c_str(), job->w, job->h };
+
+        // if the entry is gone or already has an image (because it was
+        // released and then loaded again) then drop the result
+        Entry * e = cache.find(key);
+        if(e && !e->image)
+        {
+            e->image.reset(new Surface(std::move(job->image)));
+            cacheBytes += e->image->getCapacity() * sizeof(ARGB);
+
+            // callbacks could load() more, so don't keep the pointer
+            std::vector<Callback> waiting;
+            waiting.swap(e->waiting);
+            Surface * image = e->image.get();
+
+            for(auto & done : waiting) done(*image);
+        }
+
+        delete job;
+    }
+
+    return jobs.size();
+}
+
+void ImageLoader::release(const char * path, unsigned w, unsigned h)
+{
+    Key key = { path, w, h };
+
+    Entry * e = cache.find(key);
+    if(!e) return;
+
+    if(e->image) cacheBytes -= e->image->getCapacity() * sizeof(ARGB);
+    cache.remove(key);
+}
+
+void ImageLoader::clear()
+{
+    std::vector<Entry*> loaded;
+    cache.foreach([&](Entry & e) { if(e.image) loaded.push_back(&e); });
+
+    // removing doesn't move the other entries around
+    for(Entry * e : loaded) cache.remove(e->getKey());
+
+    cacheBytes = 0;
+}
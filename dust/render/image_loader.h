@@ -0,0 +1,114 @@
+#pragma once
+
+#include "render_surface.h"
+
+#include "dust/core/hash.h"
+#include "dust/thread/threadpool.h"
+
+#include <memory>
+#include <functional>
+
+namespace dust
+{
+    // Loads image files in the background, with a cache of the results.
+    //
+    // Decoding with Surface(fileContents) on the UI thread stalls it for
+    // the duration, which adds up when there are many images to load at
+    // startup. Instead load() queues the file to be mapped into memory
+    // and decoded on a thread pool (one image per task, so a bunch of
+    // images decode in parallel) and the results are delivered back on
+    // the UI thread by poll(), which should be called regularly from the
+    // UI thread (eg. from ev_update() of some panel).
+    //
+    // Images can be requested at a target size, in which case they are
+    // scaled down (by mipmapping and a box filter, on the worker) to fit
+    // that size, keeping the aspect ratio. The cache is keyed by both the
+    // path and the target size, so a skin that only ever draws scaled
+    // never keeps the full resolution image in memory.
+    //
+    // Results are owned by the loader and remain valid until release()
+    // or clear(). Failed loads are cached as empty surfaces.
+    //
+    // All the methods must be called from the same (UI) thread.
+    struct ImageLoader
+    {
+        typedef std::function<void(Surface &)>  Callback;
+
+        // decode on pool, or on the render thread pool if null (which
+        // Application sets up) or directly in load() if neither exists
+        ImageLoader(ThreadPool * pool = 0) : pool(pool) {}
+
+        // waits for any decodes still running
+        ~ImageLoader();
+
+        // request the image at path (UTF-8) scaled down to fit (w, h),
+        // where zero means no limit on that axis (so 0,0 is full size)
+        //
+        // if the image is already loaded, done is called right away
+        // otherwise it is called from poll() once the image is ready
+        //
+        // callbacks can load() more images, but shouldn't release()
+        void load(const char * path,
+            unsigned w = 0, unsigned h = 0, Callback done = Callback());
+
+        // returns the image if it has finished loading, null otherwise
+        Surface * find(const char * path, unsigned w = 0, unsigned h = 0);
+
+        // deliver finished images, returns the number delivered
+        unsigned poll();
+
+        // true if any requested image hasn't been delivered yet
+        bool isBusy() const { return nPending != 0; }
+
+        // drop a cached image, eg. to reload it from disk
+        // if it's still loading, any callbacks waiting for it are dropped
+        void release(const char * path, unsigned w = 0, unsigned h = 0);
+
+        // drop all the cached images (pending loads are still delivered)
+        void clear();
+
+        // bytes of pixels in the cache
+        size_t getCacheBytes() const { return cacheBytes; }
+
+    private:
+        struct Key
+        {
+            const char  *path;
+            unsigned    w, h;
+        };
+
+        struct Entry
+        {
+            std::string             path;
+            unsigned                w = 0, h = 0;
+
+            std::unique_ptr<Surface>    image;  // null while loading
+            std::vector<Callback>       waiting;
+
+            Key getKey() const { return Key { path.c_str(), w, h }; }
+            bool keyEqual(const Key & k) const
+            { return w == k.w && h == k.h && path == k.path; }
+            static uint64_t getHash(const Key & k)
+            {
+                return hash64(stringHash64((const uint8_t*) k.path,
+                    strlen(k.path)) ^ (k.w | uint64_t(k.h) << 32));
+            }
+        };
+
+        struct Job;
+
+        ThreadPool  *pool;
+        Table<Entry> cache;
+        size_t      cacheBytes = 0;
+
+        // jobs that have been queued, but not delivered by poll()
+        unsigned    nPending = 0;
+
+        // finished jobs, protected by the mutex, one post per job
+        Mutex               doneMutex;
+        std::vector<Job*>   doneJobs;
+        Semaphore           doneCount;
+
+        void finish(Job * job);
+    };
+};
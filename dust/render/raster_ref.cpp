@@ -2,77 +2,41 @@
 #include <cstdint>      // for portable int64_t
 #include <algorithm>    // for min/max
 #include <vector>       // use for dynamic arrays
+#include <cstring>      // for memset
+#include <cmath>
+#include <atomic>
 
 #include "dust/core/defs.h"
+#include "dust/thread/threadpool.h"
 
 #include "rect.h"
 #include "render_path.h"
+#include "render_paint.h"
+#include "raster_resolve.h"
 
 using namespace dust;
 
-// none of this stuff needs to be public
-namespace {
-
-template <typename T>
-inline static void heapsort_siftDown(T * a, int start, int end)
-{
-    int root = start;
-
-    T rv = a[root];
+// counts allocations, see getRasterAllocCount()
+static std::atomic<unsigned> rasterAllocCount(0);
 
-    while(root*2+1 < end) {
-        int child = 2*root + 1;
-
-        if((child + 1 < end) && (a[child] < a[child+1]))
-        {
-            child += 1;
-        }
-        if(rv < a[child])
-        {
-            a[root] = a[child];
-            root = child;
-        }
-        else break;
-    }
+unsigned dust::getRasterAllocCount() { return rasterAllocCount; }
 
-    a[root] = rv;
-}
+// none of this stuff needs to be public
+namespace {
 
+// grow a scratch buffer to at least n elements and return the data
+// the contents are whatever was left over from the previous use
 template <typename T>
-inline static void heapsort(T * a, int count)
+static T * scratchBuffer(std::vector<T> & v, size_t n)
 {
-    int start, end;
-
-    /* heapify */
-    for(start = (count-2)/2; start >=0; start--)
+    if(v.size() < n)
     {
-        heapsort_siftDown(a, start, count);
-    }
-
-    /* then extract all */
-    for(end=count-1; end > 0; end--)
-    {
-        std::swap(a[0], a[end]);
-
-        // this could be improved by shifting children
-        // up until we reach the heap, putting the end
-        // node at the bottom level and shifting up
-        heapsort_siftDown(a, 0, end);
+        if(v.capacity() < n) ++rasterAllocCount;
+        v.resize(n);
     }
+    return v.data();
 }
 
-// index + key pair used for sorting
-struct SortIK
-{
-    int key;
-    unsigned index;
-
-    bool operator<(const SortIK & other) const
-    {
-        return key < other.key;
-    }
-};
-
 // stores point coordinates as fixed point integers
 struct XPoint
 {
@@ -145,7 +109,7 @@ typedef std::vector<Edge>   EdgeList;
 // builds an edgelist from flattened path
 struct EdgeListBuilder
 {
-    EdgeList    edges;
+    EdgeList    &edges;
 
     Rect    bb;
 
@@ -155,11 +119,24 @@ struct EdgeListBuilder
     float   offset;
 
     // offset is used to compensate for sampling position
-    EdgeListBuilder(float offset) : isOpen(false), offset(offset)
+    EdgeListBuilder(EdgeList & edges, float offset)
+        : edges(edges), isOpen(false), offset(offset)
     {
+        edges.clear();
+
         // reserve enough space that small paths
         // don't need to reallocate
-        edges.reserve(1024);
+        if(edges.capacity() < 1024)
+        {
+            edges.reserve(1024);
+            ++rasterAllocCount;
+        }
+    }
+
+    void push(const Edge & e)
+    {
+        if(edges.size() == edges.capacity()) ++rasterAllocCount;
+        edges.push_back(e);
     }
 
     void move(float x, float y)
@@ -175,7 +152,7 @@ struct EdgeListBuilder
         if(p1 == p0) return;    // ignore identical points
 
         Edge e = { p0, p1 };
-        edges.push_back(e);
+        push(e);
         p0 = p1;
 
         bb.extendWithPoint(p0.fpX, p0.fpY);
@@ -188,7 +165,7 @@ struct EdgeListBuilder
         if(!isOpen) return;
 
         Edge e = { p0, pC };
-        edges.push_back(e);
+        push(e);
         p0 = pC;
 
         bb.extendWithPoint(p0.fpX, p0.fpY);
@@ -213,115 +190,448 @@ struct EdgeListBuilder
 };
 
 
-// sampleBits sets quality as 4^sampleBits samples
-// note that this is power of four, eg. 4 -> 256 levels
-// so the sensible range is from 0 to 4
+// extend sign bit to all bits
+static inline int imask(int x) { return x>>(sizeof(int)*8-1); }
+
+// branchless absolute value, needs imask(x)
+// can also be used to conditionally invert another value
+static inline int iabs(int x, int mask) { return (x^mask)-mask; }
+
+// branchless signum, needs imask(x)
+static inline int isign(int mask) { return 1+(mask<<1); }
+
+// active trace structure, optimized for cache size
 //
-// template class to compile specialized versions
-template <unsigned sampleBits = 2, bool verticalScan = false>
-struct PainterRenderTemplate
+// the stepping depends on the quality, but the data doesn't
+// so this is not part of the template and the storage for
+// traces can be reused by all the specializations
+struct Trace
 {
-    //// constants, derived from sampleBits
+    int x, ymax;    // current x, max y
+    int dx, dy;     // (x1-x0) and (y1-y0), signed
+    int err;
 
-    // extra precision bits
-    static const unsigned extraBits = XPoint::spBits - sampleBits;
-    // sample count
-    static const unsigned sampleCount = (1<<sampleBits);
-    // sample step
-    static const unsigned sampleStep = (1<<extraBits);
-    // max coverage = sampleCount ^2
-    static const unsigned maxCoverage = sampleCount * sampleCount;
-    // extra bits mask
-    static const unsigned extraMask = sampleStep - 1;
-    // sample bits mask
-    static const unsigned sampleMask = ~extraMask;
+    template <unsigned extraBits>
+    inline void step()
+    {
+        int dxm = imask(dx);
+        int dxa = iabs(dx, dxm);
+        int dya = iabs(dy, imask(dy));
 
-    // extend sign bit to all bits
-    static inline int imask(int x) { return x>>(sizeof(int)*8-1); }
+        // step whole sample
+        err += dxa << extraBits;
 
-    // branchless absolute value, needs imask(x)
-    // can also be used to conditionally invert another value
-    static inline int iabs(int x, int mask) { return (x^mask)-mask; }
+        if(err >= dya)
+        {
+            int step = err/dya;
+            err -= dya * step;
 
-    // branchless signum, needs imask(x)
-    static inline int isign(int mask) { return 1+(mask<<1); }
+            x += iabs(step, dxm);
+        }
+    }
 
-    // active trace structure, optimized for cache size
-    struct Trace
+    // initialize the edge and bump forward to clipTop if necessary
+    template <unsigned extraBits>
+    inline void init(const XPoint & p0, const XPoint & p1, int clipTop)
     {
-        unsigned next;  // next edge index (in bucket or active list)
+        const int sampleStep = 1 << extraBits;
+        const int extraMask = sampleStep - 1;
+
+        int x0 = p0.fpX, y0 = p0.fpY;
+        int x1 = p1.fpX, y1 = p1.fpY;
+
+        dx = x1 - x0;
+        dy = y1 - y0;
+
+        // figure out which direction we are going
+        // change the sign of dx if necessary
+        int y;
+        if(dy > 0) { x = x0; y = y0; ymax = y1; }
+        else { x = x1; y = y1; ymax = y0; dx = -dx; }
 
-        int x, ymax;    // current x, max y
-        int dx, dy;     // (x1-x0) and (y1-y0), signed
-        int err;
+        // perform a manual step forward
+        int dxm = imask(dx);
+        int dxa = iabs(dx, dxm);
+        int dya = iabs(dy, imask(dy));
 
-        // for sorting to work
-        bool operator<(const Trace & other) const
+        // if y has any extra bits set, we want to step it forward
+        int yAdjust = (sampleStep - int(y & extraMask)) & extraMask;
+        // alternatively, if we're clipping top then just do that
+        if(clipTop > y) yAdjust = clipTop - y;
+
+        y += yAdjust;
+
+        // here we need 64-bit accumulator
+        int64_t err64 = int64_t(dxa) * int64_t(yAdjust);
+        if(err64 >= dya)
         {
-            return x < other.x;
+            int64_t step = err64/dya;
+            err64 -= dya * step;
+            x += isign(dxm)*int(step);
         }
+        err = int(err64);
+    }
 
-        inline void step()
-        {
-            int dxm = imask(dx);
-            int dxa = iabs(dx, dxm);
-            int dya = iabs(dy, imask(dy));
+    int wdir() const
+    {
+        return isign(imask(dy));
+    }
+};
 
-            // step whole sample
-            err += dxa << extraBits;
+// edge for the analytic rasterizer, in pixels relative to the clip
+// always going down, with dir = -1 if the original edge went up
+struct AreaEdge
+{
+    float   x0, y0, y1;
+    float   dxdy, dir;
+};
 
-            if(err >= dya)
-            {
-                int step = err/dya;
-                err -= dya * step;
+// LSD radix sort of traces by x, temp must have space for n traces
+static void radixSortTraces(Trace * t, unsigned n, Trace * temp)
+{
+    // flip the sign bit, so we can sort as unsigned
+    const unsigned flip = 0x80000000u;
 
-                x += iabs(step, dxm);
-            }
+    // histograms for all the bytes in one pass
+    unsigned count[4][256] = {};
+    for(unsigned i = 0; i < n; ++i)
+    {
+        unsigned key = unsigned(t[i].x) ^ flip;
+        for(unsigned b = 0; b < 4; ++b) ++count[b][(key >> (8*b)) & 0xff];
+    }
+
+    Trace * src = t, * dst = temp;
+    for(unsigned b = 0; b < 4; ++b)
+    {
+        unsigned shift = 8*b;
+
+        // skip the pass if all the keys have the same digit here
+        // which is typically the case for the high bytes
+        if(count[b][((unsigned(src[0].x) ^ flip) >> shift) & 0xff] == n)
+            continue;
+
+        unsigned sum = 0;
+        for(unsigned d = 0; d < 256; ++d)
+        {
+            unsigned c = count[b][d]; count[b][d] = sum; sum += c;
         }
 
-        // initialize the edge and bump forward to clipTop if necessary
-        inline void init(const XPoint & p0, const XPoint & p1, int clipTop)
+        for(unsigned i = 0; i < n; ++i)
         {
-            int x0 = p0.fpX, y0 = p0.fpY;
-            int x1 = p1.fpX, y1 = p1.fpY;
+            unsigned d = ((unsigned(src[i].x) ^ flip) >> shift) & 0xff;
+            dst[count[b][d]++] = src[i];
+        }
+        (std::swap)(src, dst);
+    }
+
+    if(src != t) memcpy(t, src, n * sizeof(Trace));
+}
+
+// Sort traces by x: the active traces are almost always nearly sorted
+// so insertion sort is the fastest, but when there is a lot of edges
+// crossing each other (or a large unsorted bucket) we switch to radix
+// sort once insertion sort has moved things around too much
+static void sortTraces(Trace * t, unsigned n, Trace * temp)
+{
+    unsigned budget = 8*n + 256;
+    for(unsigned i = 1; i < n; ++i)
+    {
+        if(t[i-1].x <= t[i].x) continue;
+
+        Trace v = t[i];
+        unsigned j = i;
+        do { t[j] = t[j-1]; --j; } while(j && t[j-1].x > v.x);
+        t[j] = v;
+
+        unsigned moves = i - j;
+        if(moves > budget) { radixSortTraces(t, n, temp); return; }
+        budget -= moves;
+    }
+}
+
+// line segment for hairlines, in pixel center coordinates
+struct HairSegment
+{
+    float x0, y0, x1, y1;
+};
+
+// collects flattened paths as hairline segments
+//
+// unlike EdgeListBuilder this only closes contours on close()
+// since a stroke of an open path shouldn't connect the ends
+struct HairlineBuilder
+{
+    std::vector<HairSegment>    &segs;
+
+    float   x0, y0, xC, yC;     // previous and first point of contour
+    bool    isOpen;
+
+    float   bx0, by0, bx1, by1; // bounding box of all segments
+
+    HairlineBuilder(std::vector<HairSegment> & segs)
+        : segs(segs), isOpen(false)
+    {
+        segs.clear();
+
+        bx0 = by0 = HUGE_VALF;
+        bx1 = by1 = -HUGE_VALF;
+    }
+
+    void push(float x, float y)
+    {
+        HairSegment s = { x0, y0, x, y };
+        if(segs.size() == segs.capacity()) ++rasterAllocCount;
+        segs.push_back(s);
+
+        bx0 = (std::min)(bx0, (std::min)(x0, x));
+        by0 = (std::min)(by0, (std::min)(y0, y));
+        bx1 = (std::max)(bx1, (std::max)(x0, x));
+        by1 = (std::max)(by1, (std::max)(y0, y));
+
+        x0 = x; y0 = y;
+    }
+
+    // pixel centers are at integer coordinates
+    void move(float x, float y)
+    {
+        x0 = xC = x - .5f;
+        y0 = yC = y - .5f;
+        isOpen = false;
+    }
+
+    void line(float x, float y)
+    {
+        push(x - .5f, y - .5f);
+        isOpen = true;
+    }
+
+    void close()
+    {
+        if(isOpen && (x0 != xC || y0 != yC)) push(xC, yC);
+        isOpen = false;
+    }
+
+    void end() { isOpen = false; }
+};
 
-            dx = x1 - x0;
-            dy = y1 - y0;
+struct RasterBandJob;
 
-            // figure out which direction we are going
-            // change the sign of dx if necessary
-            int y;
-            if(dy > 0) { x = x0; y = y0; ymax = y1; }
-            else { x = x1; y = y1; ymax = y0; dx = -dx; }
+}; // anonymous namespace
+
+struct RasterScratch::Data
+{
+    EdgeList                edges;      // output from EdgeListBuilder
+    std::vector<unsigned>   startList;  // bucket start indexes
+    std::vector<Trace>      traces;     // in bucket order
+    std::vector<Trace>      activeTraces;
+    std::vector<Trace>      traceTemp;  // for radix sorting
+    std::vector<short>      coverage;   // one scanline of coverage
+    std::vector<uint8_t>    alpha;      // one scanline of alpha, for spans
+    std::vector<Span>       spans;      // one scanline of spans
+    std::vector<Alpha>      mask;       // see RasterScratch::getMask()
+
+    // for the analytic rasterizer
+    std::vector<AreaEdge>   areaEdges;
+    std::vector<unsigned>   active;     // indexes of active edges
+    std::vector<float>      area;       // one scanline of area deltas
+
+    // for hairlines, see drawHairlines()
+    std::vector<HairSegment>    hairSegs;
+    std::vector<int>            hairRows;   // touched range for each row
+    std::vector<uint8_t>        hairMask;   // always cleared after use
+
+    // for parallel rendering, see renderEdges()
+    std::vector<RasterBandJob*> jobs;
+};
+
+RasterScratch::Data & RasterScratch::getData()
+{
+    if(!data) { data = new Data; ++rasterAllocCount; }
+    return *data;
+}
+
+uint8_t * RasterScratch::getMask(unsigned size)
+{
+    return scratchBuffer(getData().mask, size);
+}
+
+namespace {
 
-            // perform a manual step forward
-            int dxm = imask(dx);
-            int dxa = iabs(dx, dxm);
-            int dya = iabs(dy, imask(dy));
+// Rasterizer outputs: these take one scanline of coverage at a time
+// and use Resolver to turn it into alpha (see raster_resolve.h)
 
-            // if y has any extra bits set, we want to step it forward
-            int yAdjust = (int(sampleStep) - int(y & extraMask)) & extraMask;
-            // alternatively, if we're clipping top then just do that
-            if(clipTop > y) yAdjust = clipTop - y;
+// writes every pixel of the clip rectangle into an alpha mask
+template <typename Resolver, bool verticalScan>
+struct MaskOutput
+{
+    uint8_t     *maskOut;
+    unsigned    maskPitch;
+
+    MaskOutput(uint8_t * maskOut, unsigned maskPitch)
+        : maskOut(maskOut), maskPitch(maskPitch) {}
 
-            y += yAdjust;
+    // coverage deltas in [lo,hi) are the only non-zero ones
+    // if lo >= hi then the whole line is empty
+    void scanline(const Rect & clipRect, int y,
+        typename Resolver::Cell * coverage, int xLimit, int lo, int hi)
+    {
+        uint8_t * alphaScan = verticalScan
+            ? (maskOut + clipRect.y0 * int(maskPitch) + y)
+            : (maskOut + clipRect.x0 + y * int(maskPitch));
 
-            // here we need 64-bit accumulator
-            int64_t err64 = int64_t(dxa) * int64_t(yAdjust);
-            if(err64 >= dya)
+        unsigned alphaPitch = verticalScan ? maskPitch : 1;
+        if(lo < hi)
+        {
+            Resolver::simd(coverage, alphaScan, xLimit, alphaPitch);
+        }
+        else if(!verticalScan)
+        {
+            memset(alphaScan, 0, xLimit);
+        }
+        else
+        {
+            for(int x = 0; x < xLimit; ++x)
             {
-                int64_t step = err64/dya;
-                err64 -= dya * step;
-                x += isign(dxm)*int(step);
+                alphaScan[x*alphaPitch] = 0;
             }
-            err = int(err64);
         }
+    }
+};
+
+// push a span, counting allocations
+static void addSpan(std::vector<Span> & spans,
+    int x0, int x1, const Alpha * mask)
+{
+    Span s = { x0, x1, mask };
+    if(spans.size() == spans.capacity()) ++rasterAllocCount;
+    spans.push_back(s);
+}
+
+// returns the end of a run of value v in a[x..hi)
+static inline int findRunEnd(const uint8_t * a, int x, int hi, uint8_t v)
+{
+    // skip whole blocks first, then finish one at a time
+    __m128i vv = _mm_set1_epi8(char(v));
+    while(x + 16 <= hi && 0xffff == _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i*)(a + x)), vv))) x += 16;
+
+    while(x < hi && a[x] == v) ++x;
+    return x;
+}
+
+// Split alpha values a[lo..hi) of one scanline into spans of opaque
+// and masked pixels (skipping empty ones) and pass them to the paint.
+// Spans are offset by x0, y is passed to the paint as-is.
+static void paintAlphaSpans(IPaint & paint, std::vector<Span> & spans,
+    const uint8_t * a, int lo, int hi, int x0, int y)
+{
+    // opaque or empty runs shorter than this are merged
+    // into the surrounding masked spans, since splitting
+    // spans has some overhead too
+    const int minRun = 8;
+
+    spans.clear();
+
+    // x0 of the current masked span, or -1 if none
+    int maskStart = -1;
+
+    int x = lo;
+    while(x < hi)
+    {
+        uint8_t v = a[x];
+        if(v && v != 0xff)
+        {
+            if(maskStart < 0) maskStart = x;
+            ++x; continue;
+        }
+
+        int runStart = x;
+        x = findRunEnd(a, x, hi, v);
 
-        int wdir() const
+        // short runs of 0 or 255 just go into masked spans
+        // except at the end, where we can't merge anything
+        if(x - runStart < minRun && x < hi)
         {
-            return isign(imask(dy));
+            if(maskStart < 0 && v) maskStart = runStart;
+            continue;
         }
-    };
+
+        if(maskStart >= 0)
+        {
+            addSpan(spans, x0 + maskStart, x0 + runStart, a + maskStart);
+            maskStart = -1;
+        }
+
+        if(v) addSpan(spans, x0 + runStart, x0 + x, 0);
+    }
+    if(maskStart >= 0) addSpan(spans, x0 + maskStart, x0 + hi, a + maskStart);
+
+    if(spans.size()) paint.paintSpans(y, spans.data(), spans.size());
+}
+
+// sends runs of non-zero alpha to a paint, one scanline at a time
+// only resolves the part of the scanline that actually has edges
+//
+// this only makes sense for horizontal scanlines
+template <typename Resolver>
+struct SpanOutput
+{
+    IPaint      &paint;
+    int         offX, offY;
+
+    std::vector<uint8_t>    &alpha; // one scanline, from clip x0
+    std::vector<Span>       &spans;
+
+    SpanOutput(IPaint & paint, int offX, int offY,
+        RasterScratch::Data & scratch)
+        : paint(paint), offX(offX), offY(offY)
+        , alpha(scratch.alpha), spans(scratch.spans) {}
+
+    void scanline(const Rect & clipRect, int y,
+        typename Resolver::Cell * coverage, int xLimit, int lo, int hi)
+    {
+        if(hi > xLimit) hi = xLimit;
+        if(lo >= hi) return;
+
+        uint8_t * a = scratchBuffer(alpha, xLimit);
+
+        Resolver::simd(coverage + lo, a + lo, hi - lo, 1);
+
+        // there are no more deltas past hi, so whatever the last
+        // pixel was continues until the end of the scanline
+        if(a[hi-1])
+        {
+            memset(a + hi, a[hi-1], xLimit - hi);
+            hi = xLimit;
+        }
+
+        paintAlphaSpans(paint, spans, a, lo, hi,
+            clipRect.x0 + offX, y + offY);
+    }
+};
+
+// sampleBits sets quality as 4^sampleBits samples
+// note that this is power of four, eg. 4 -> 256 levels
+// so the sensible range is from 0 to 4
+//
+// template class to compile specialized versions
+template <unsigned sampleBits = 2, bool verticalScan = false>
+struct PainterRenderTemplate
+{
+    //// constants, derived from sampleBits
+
+    // extra precision bits
+    static const unsigned extraBits = XPoint::spBits - sampleBits;
+    // sample count
+    static const unsigned sampleCount = (1<<sampleBits);
+    // sample step
+    static const unsigned sampleStep = (1<<extraBits);
+    // max coverage = sampleCount ^2
+    static const unsigned maxCoverage = sampleCount * sampleCount;
+    // extra bits mask
+    static const unsigned extraMask = sampleStep - 1;
+    // sample bits mask
+    static const unsigned sampleMask = ~extraMask;
 
     static unsigned firstScanForEdge(const Edge & e, int clipTop)
     {
@@ -333,8 +643,9 @@ struct PainterRenderTemplate
         return (y + yAdjust - clipTop) >> extraBits;
     }
 
+    template <typename Output>
     static bool render(EdgeList & edges, const Rect & clipRect, FillRule fill,
-        uint8_t * maskOut, unsigned maskPitch)
+        Output & out, RasterScratch::Data & scratch)
     {
         //debugPrint("raster_ref: %d edges, r: %d,%d %dx%d\n",
         //    edges.size(), clipRect.x0, clipRect.y0, clipRect.w(), clipRect.h());
@@ -352,7 +663,7 @@ struct PainterRenderTemplate
         // initialize startup edge list
         // we use this initially for startup edge counts
         // and then replace them with index to first trace
-        std::vector<unsigned> startList(nScan);
+        unsigned * startList = scratchBuffer(scratch.startList, nScan);
         for(unsigned i = 0; i < nScan; ++i)
         {
             startList[i] = 0;
@@ -390,74 +701,54 @@ struct PainterRenderTemplate
 
         // accumulate startup counts so we can then
         // subtract backwards to get start limits
-        // also find the maximum bucket size
-        int maxBucketSize = startList[0];
         for(unsigned i = 1; i < nScan; ++i)
         {
-            if(maxBucketSize < startList[i]) maxBucketSize = startList[i];
             startList[i] += startList[i-1];
         }
 
         // allocate traces, then initialize from edges
-        std::vector<Trace>    traces(edges.size());
+        Trace * traces = scratchBuffer(scratch.traces, edges.size());
         for(unsigned i = 0; i < edges.size(); ++i)
         {
             Edge & e = edges[i];
 
             int yMin = firstScanForEdge(e, clipY0);
             int t = --startList[yMin];
-            traces[t].init(e.a, e.b, clipY0);
+            traces[t].init<extraBits>(e.a, e.b, clipY0);
         }
 
-        // sort all the bins, fix startup limits
+        // sort all the buckets, startList has the first index of each
+        unsigned nEdges = edges.size();
+        Trace * temp = scratchBuffer(scratch.traceTemp, nEdges);
+        for(unsigned i = 0; i < nScan; ++i)
         {
-            // allocate a temporary std::vector for the purpose
-            std::vector<SortIK> tsort(maxBucketSize);
-
-            unsigned sortEnd = edges.size();
-            for(unsigned i = nScan; i--;)
-            {
-                unsigned sortStart = startList[i];
-                // while it's less than ideal to fill indexes like this
-                // just for the purpose of sorting, doing lots of swaps
-                // on the actual traces is not ideal either
-                for(unsigned j = sortStart; j < sortEnd; ++j)
-                {
-                    tsort[j-sortStart].index = j;
-                    tsort[j-sortStart].key = traces[j].x;
-                }
-                heapsort(tsort.data(), sortEnd - sortStart);
-
-                unsigned next = ~0;  // end of list
-                for(unsigned j = sortStart; j < sortEnd; ++j)
-                {
-                    traces[tsort[j-sortStart].index].next = next;
-                    next = tsort[j-sortStart].index;
-                }
-                startList[i] = next;
-                sortEnd = sortStart;
-            }
+            unsigned end = (i + 1 < nScan) ? startList[i+1] : nEdges;
+            sortTraces(traces + startList[i], end - startList[i], temp);
         }
 
         int xLimit = (verticalScan ? clipRect.h() : clipRect.w());
 
         // coverage buffer for one scanline
         // extra pixels to skip some checks
-        std::vector<short>    coverage(xLimit+2);
+        short * coverage = scratchBuffer(scratch.coverage, xLimit+2);
         for(int i = 0; i < 2+xLimit; ++i)
         {
             coverage[i] = 0;
         }
 
         //// MAINLOOP
-        unsigned activeHead = ~0;
+
+        // active traces, in a flat array sorted by x
+        Trace * active = scratchBuffer(scratch.activeTraces, nEdges);
+        unsigned nActive = 0;
 
         int yStart = verticalScan ? clipRect.x0 : clipRect.y0;
         int yLimit = verticalScan ? clipRect.x1 : clipRect.y1;
         for(int y = yStart; y < yLimit; ++y)
         {
-            // skip lines with no edges
-            bool lineHasEdges = false;
+            // range of coverage deltas touched on this line
+            // if this stays empty, then we can skip the line
+            int coverLo = xLimit + 2, coverHi = 0;
 
             unsigned scanIndexPx = (y-yStart) << sampleBits;
             // sub-pixel scanlines
@@ -468,104 +759,79 @@ struct PainterRenderTemplate
 
                 //// UPDATE EDGE TABLE
 
-                // in order to sort this "almost sorted" single linked list
-                // we want to pop from front and push to another list
-                // then check that we have reverse order (push down if not)
-                // and finally reverse the list back to the original list?
-                unsigned nextPop = activeHead;
-                unsigned revHead = ~0;
-                while(~nextPop)
+                // drop dead edges, then step the rest
+                unsigned nLive = 0;
+                for(unsigned i = 0; i < nActive; ++i)
                 {
-                    // pop from the old list
-                    unsigned t = nextPop;
-                    nextPop = traces[t].next;
-
-                    // drop dead edges before stepping and sorting
-                    if(traces[t].ymax <= scanY) continue;
-
-                    // step the edge
-                    traces[t].step();
+                    if(active[i].ymax <= scanY) continue;
 
-                    // scan the list from revhead to find where to
-                    // place the newly popped entry
-                    unsigned *nextPtr = &revHead;
-                    while(~*nextPtr && traces[*nextPtr].x >= traces[t].x)
-                    {
-                        nextPtr = &traces[*nextPtr].next;
-                    }
-                    // then place it
-                    traces[t].next = *nextPtr; *nextPtr = t;
+                    active[nLive] = active[i];
+                    active[nLive++].step<extraBits>();
                 }
-                // merge the list with new edges
-                unsigned addHead = startList[scanIndex];
-                activeHead = ~0;
-                // merge the two
-                while(~revHead)
-                {
-                    unsigned t = revHead; revHead = traces[t].next;
-                    while(~addHead && traces[addHead].x >= traces[t].x)
-                    {
-                        unsigned a = addHead;
-                        addHead = traces[addHead].next;
 
-                        // check for "dead on arrival"
-                        if(traces[a].ymax <= scanY) continue;
+                // stepping only changes the order where edges cross
+                sortTraces(active, nLive, temp);
 
-                        traces[a].next = activeHead;
-                        activeHead = a;
-                    }
-                    traces[t].next = activeHead; activeHead = t;
-                }
-                // add any additional edges
-                while(~addHead)
+                // merge with new edges, which are sorted already
+                unsigned add0 = startList[scanIndex];
+                unsigned add1 = (scanIndex + 1 < nScan)
+                    ? startList[scanIndex + 1] : nEdges;
+
+                // check for "dead on arrival"
+                unsigned nAdd = 0;
+                for(unsigned j = add0; j < add1; ++j)
                 {
-                    unsigned a = addHead;
-                    addHead = traces[addHead].next;
+                    if(traces[j].ymax > scanY) ++nAdd;
+                }
 
-                    // check for "dead on arrival"
-                    if(traces[a].ymax <= scanY) continue;
+                // merge backwards, so we can do it in place
+                unsigned out = nLive + nAdd;
+                unsigned i = nLive, j = add1;
+                while(j > add0)
+                {
+                    const Trace & t = traces[j-1];
+                    if(t.ymax <= scanY) { --j; continue; }
 
-                    traces[a].next = activeHead;
-                    activeHead = a;
+                    if(i && active[i-1].x > t.x) active[--out] = active[--i];
+                    else { active[--out] = t; --j; }
                 }
+                nActive = nLive + nAdd;
 
                 // if no active edges, go to next scanline
-                if(!~activeHead) continue;
+                if(!nActive) continue;
                 
                 //// WINDING CALC + EDGE UPDATES
-                unsigned *edgePtr = &activeHead;
+                unsigned edge = 0;
                 int winding = 0;
                 bool inPoly = false;
 
                 // skip coverage if all edges are past visible area
-                if(traces[*edgePtr].x < clipX1)
+                if(active[0].x < clipX1)
                 {
-                    lineHasEdges = true;
-                    
                     // deal with the edges before visible area first
                     // we can do the coverage for these in bulk
-                    while(~*edgePtr)
+                    for(; edge < nActive; ++edge)
                     {
-                        unsigned edge = *edgePtr;
-                        if(traces[edge].x >= clipX0) break;
+                        if(active[edge].x >= clipX0) break;
                         
-                        winding += traces[edge].wdir();
+                        winding += active[edge].wdir();
                         inPoly = 0 != (winding & fill);
-                        edgePtr = &traces[edge].next;
                     }
     
                     // add coverage in bulk
-                    if(inPoly) coverage[0] += sampleCount;
+                    if(inPoly)
+                    {
+                        coverage[0] += sampleCount;
+                        coverLo = 0; coverHi = (std::max)(coverHi, 1);
+                    }
     
                     // process edges in visible area
-                    while(~*edgePtr)
+                    for(; edge < nActive; ++edge)
                     {
-                        unsigned edge = *edgePtr;
-    
                         // break out if past visible area
-                        if(traces[edge].x >= clipX1) break;
+                        if(active[edge].x >= clipX1) break;
     
-                        winding += traces[edge].wdir();
+                        winding += active[edge].wdir();
                         bool inPolyAfter = 0 != (winding & fill);
     
                         if(inPoly != inPolyAfter)
@@ -573,7 +839,7 @@ struct PainterRenderTemplate
                             inPoly = inPolyAfter;
     
                             // clip on the left edge
-                            int x = traces[edge].x + extraMask;
+                            int x = active[edge].x + extraMask;
                             if(x < clipX0) x = clipX0;
     
                             int xPix0 = ((x-clipX0) >> XPoint::spBits);
@@ -581,6 +847,9 @@ struct PainterRenderTemplate
     
                             int xOff1 = (x & (XPoint::spCount-1)) >> extraBits;
                             int xOff0 = sampleCount - xOff1;
+
+                            coverLo = (std::min)(coverLo, xPix0);
+                            coverHi = (std::max)(coverHi, xPix1 + 1);
     
                             if(inPoly)
                             {
@@ -593,134 +862,887 @@ struct PainterRenderTemplate
                                 coverage[xPix1] -= xOff1;
                             }
                         }
-    
-                        edgePtr = &traces[edge].next;
                     }
                 }
                 
                 // process any edges past visible area
-                while(~*edgePtr)
+                // drop edges going further right
+                unsigned keep = edge;
+                for(; edge < nActive; ++edge)
                 {
-                    unsigned edge = *edgePtr;
-
-                    // drop edges going further right
-                    if(!imask(traces[edge].dx))
-                    {
-                        *edgePtr = traces[edge].next;
-                        continue;
-                    }
-
-                    edgePtr = &traces[edge].next;
+                    if(imask(active[edge].dx)) active[keep++] = active[edge];
                 }
+                nActive = keep;
             }
 
             // coverage sum and coverage to alpha
-            int coverageSum = 0;
-            uint8_t * alphaScan = verticalScan
-                ? (maskOut + clipRect.y0 * int(maskPitch) + y)
-                : (maskOut + clipRect.x0 + y * int(maskPitch));
-                
-            if(lineHasEdges)
-            {
-                for(int x = 0; x < xLimit; ++x)
-                {
-                    // sum and clear
-                    coverageSum += coverage[x]; coverage[x] = 0;
-
-                    alphaScan[x*(verticalScan?maskPitch:1)] = (unsigned char)
-                        ((coverageSum * 255) / maxCoverage);
-                }
-            }
-            else
-            {
-                for(int x = 0; x < xLimit; ++x)
-                {
-                    alphaScan[x*(verticalScan?maskPitch:1)] = 0;
-                }
-            }
+            out.scanline(clipRect, y, coverage, xLimit,
+                coverLo, coverHi);
         }
 
         return true;
     }
 };
 
-}; // anonymous namespace
 
-// Wrapper to pick a template specialization for the desired
-// quality, allowing actual code to be optimized much better.
+// Analytic coverage rasterizer: instead of sampling, this computes the
+// exact area covered by each edge in every pixel (like font-rs, libart
+// and friends) and only makes one pass for each row of pixels.
+//
+// Each edge adds the signed area between itself and the right edge of
+// the pixel into the cell where it is (and the next one), so that
+// the prefix sum of the cells gives the coverage for each pixel.
+//
+// Overlapping contours within a pixel are approximated (see AreaResolve)
+// but otherwise this is exact, so it's comparable to quality 4 in terms
+// of the results while being quite a bit cheaper.
+template <bool verticalScan = false>
+struct AreaRenderTemplate
+{
+    // accumulates area for a row of pixels
+    struct Accumulator
+    {
+        float   *acc;
+        float   xLimit;
+        int     lo, hi;     // range of cells touched
+
+        // add a line segment going from xa to xb (either direction)
+        // within the current pixel row, with d = height * direction
+        void line(float xa, float xb, float d)
+        {
+            // anything to the left of the clip covers the whole row
+            // so it's the same as a vertical segment at the left edge
+            if(xa < 0 || xb < 0)
+            {
+                if(xa < 0 && xb < 0) { cells(0, 0, d); return; }
+
+                // split where the segment crosses the edge
+                float t = xa / (xa - xb);
+                if(xa < 0) { cells(0, 0, d*t); line(0, xb, d - d*t); }
+                else { line(xa, 0, d*t); cells(0, 0, d - d*t); }
+                return;
+            }
+
+            // anything to the right of the clip is not visible at all
+            if(xa > xLimit || xb > xLimit)
+            {
+                if(xa > xLimit && xb > xLimit) return;
+
+                float t = (xa - xLimit) / (xa - xb);
+                if(xa > xLimit) cells(xLimit, xb, d - d*t);
+                else cells(xa, xLimit, d*t);
+                return;
+            }
+
+            cells(xa, xb, d);
+        }
+
+        // add area for a segment that is within [0, xLimit]
+        void cells(float xa, float xb, float d)
+        {
+            float x0 = (std::min)(xa, xb);
+            float x1 = (std::max)(xa, xb);
+
+            float x0floor = floorf(x0);
+            int x0i = int(x0floor);
+            int x1i = int(ceilf(x1));
+
+            lo = (std::min)(lo, x0i);
+            hi = (std::max)(hi, (std::max)(x0i + 2, x1i + 1));
+
+            if(x1i <= x0i + 1)
+            {
+                // the whole thing is within one pixel
+                float xmf = .5f * (xa + xb) - x0floor;
+                acc[x0i] += d - d * xmf;
+                acc[x0i + 1] += d * xmf;
+                return;
+            }
+
+            // the segment spans several pixels, so split the area
+            float s = 1.f / (x1 - x0);
+            float x0f = x0 - x0floor;
+            float a0 = .5f * s * (1 - x0f) * (1 - x0f);
+            float x1f = x1 - float(x1i) + 1;
+            float am = .5f * s * x1f * x1f;
+
+            acc[x0i] += d * a0;
+            if(x1i == x0i + 2)
+            {
+                acc[x0i + 1] += d * (1 - a0 - am);
+            }
+            else
+            {
+                float a1 = s * (1.5f - x0f);
+                acc[x0i + 1] += d * (a1 - a0);
+                for(int x = x0i + 2; x < x1i - 1; ++x) acc[x] += d * s;
+
+                float a2 = a1 + float(x1i - x0i - 3) * s;
+                acc[x1i - 1] += d * (1 - a2 - am);
+            }
+            acc[x1i] += d * am;
+        }
+    };
+
+    template <typename Output>
+    static bool render(EdgeList & edges, const Rect & clipRect,
+        Output & out, RasterScratch::Data & scratch)
+    {
+        if(!edges.size() || clipRect.isEmpty()) return false;
+
+        int clipX0 = (verticalScan?clipRect.y0:clipRect.x0) << XPoint::spBits;
+        int clipY0 = (verticalScan?clipRect.x0:clipRect.y0) << XPoint::spBits;
+
+        int xLimit = (verticalScan ? clipRect.h() : clipRect.w());
+        int nScan = (verticalScan ? clipRect.w() : clipRect.h());
+
+        // bucket counts for the first scanline of each edge
+        unsigned * startList = scratchBuffer(scratch.startList, nScan);
+        for(int i = 0; i < nScan; ++i) startList[i] = 0;
+
+        // convert to pixels, relative to the clip
+        const float fpScale = 1.f / XPoint::spCount;
+
+        // go through edges and find bucket sizes
+        // throw away the ones that can't contribute
+        for(unsigned i = edges.size(); i--;)
+        {
+            Edge & e = edges[i];
+
+            if(verticalScan)
+            {
+                (std::swap)(e.a.fpX, e.a.fpY);
+                (std::swap)(e.b.fpX, e.b.fpY);
+            }
+
+            float ya = float(e.a.fpY - clipY0) * fpScale;
+            float yb = float(e.b.fpY - clipY0) * fpScale;
+            float xa = float(e.a.fpX - clipX0) * fpScale;
+            float xb = float(e.b.fpX - clipX0) * fpScale;
+
+            if(ya == yb
+            || (ya <= 0 && yb <= 0)
+            || (ya >= nScan && yb >= nScan)
+            || (xa >= xLimit && xb >= xLimit))
+            {
+                // replace with last one and pop_back
+                e = edges.back();
+                edges.pop_back();
+                continue;
+            }
+
+            int y0 = int(floorf((std::min)(ya, yb)));
+            ++startList[(std::max)(y0, 0)];
+        }
+
+        if(!edges.size()) return false;
+
+        for(int i = 1; i < nScan; ++i) startList[i] += startList[i-1];
+
+        // convert the edges into buckets, in scanline order
+        unsigned nEdges = edges.size();
+        AreaEdge * areaEdges = scratchBuffer(scratch.areaEdges, nEdges);
+        for(unsigned i = 0; i < nEdges; ++i)
+        {
+            Edge & e = edges[i];
+
+            float xa = float(e.a.fpX - clipX0) * fpScale;
+            float ya = float(e.a.fpY - clipY0) * fpScale;
+            float xb = float(e.b.fpX - clipX0) * fpScale;
+            float yb = float(e.b.fpY - clipY0) * fpScale;
+
+            float dir = 1;
+            if(ya > yb) { (std::swap)(xa, xb); (std::swap)(ya, yb); dir = -1; }
+
+            int y0 = (std::max)(int(floorf(ya)), 0);
+            AreaEdge & ae = areaEdges[--startList[y0]];
+
+            ae.x0 = xa;
+            ae.y0 = ya;
+            ae.y1 = yb;
+            ae.dxdy = (xb - xa) / (yb - ya);
+            ae.dir = dir;
+        }
+
+        unsigned * active = scratchBuffer(scratch.active, nEdges);
+        unsigned nActive = 0, nextEdge = 0;
+
+        // one extra cell for the right edge, another for the
+        // next pixel, which we need when the edge is at xLimit
+        Accumulator acc;
+        acc.acc = scratchBuffer(scratch.area, xLimit + 2);
+        acc.xLimit = float(xLimit);
+        for(int i = 0; i < xLimit + 2; ++i) acc.acc[i] = 0;
+
+        int yStart = verticalScan ? clipRect.x0 : clipRect.y0;
+        for(int y = 0; y < nScan; ++y)
+        {
+            float fy0 = float(y), fy1 = float(y + 1);
+
+            // add new edges, these are sorted by the first scanline
+            while(nextEdge < nEdges && areaEdges[nextEdge].y0 < fy1)
+            {
+                active[nActive++] = nextEdge++;
+            }
+
+            acc.lo = xLimit + 2; acc.hi = 0;
+
+            unsigned keep = 0;
+            for(unsigned i = 0; i < nActive; ++i)
+            {
+                AreaEdge & e = areaEdges[active[i]];
+
+                float ya = (std::max)(e.y0, fy0);
+                float yb = (std::min)(e.y1, fy1);
+
+                float xa = e.x0 + (ya - e.y0) * e.dxdy;
+                float xb = e.x0 + (yb - e.y0) * e.dxdy;
+
+                acc.line(xa, xb, (yb - ya) * e.dir);
+
+                // keep if the edge continues on the next row
+                if(e.y1 > fy1) active[keep++] = active[i];
+            }
+            nActive = keep;
+
+            out.scanline(clipRect, yStart + y, acc.acc, xLimit,
+                acc.lo, (std::min)(acc.hi, xLimit));
+        }
+
+        return true;
+    }
+};
+
+}; // anonymous namespace
+
+// Where the rasterizer output goes: if paint is set, then spans
+// are sent to the paint and the mask is not used at all
+struct RasterTarget
+{
+    uint8_t     *maskOut;
+    unsigned    maskPitch;
+
+    IPaint      *paint;
+    int         offX, offY;
+};
+
+// Wrapper to pick the output type for a specialization
+template <unsigned sampleBits, bool verticalScan>
+static bool renderPath_T(EdgeList & edges,
+    const Rect & clip, FillRule fill, const RasterTarget & target,
+    RasterScratch::Data & scratch)
+{
+    typedef PainterRenderTemplate<sampleBits, verticalScan> R;
+    typedef raster::Resolve<sampleBits> Resolver;
+    if(target.paint)
+    {
+        SpanOutput<Resolver> out(*target.paint,
+            target.offX, target.offY, scratch);
+        return R::render(edges, clip, fill, out, scratch);
+    }
+    else
+    {
+        MaskOutput<Resolver, verticalScan> out(
+            target.maskOut, target.maskPitch);
+        return R::render(edges, clip, fill, out, scratch);
+    }
+}
+
+// Wrapper to pick the output type for the analytic rasterizer
+// the fill rule only matters when resolving
+template <bool evenOdd, bool verticalScan>
+static bool renderPath_A(EdgeList & edges,
+    const Rect & clip, const RasterTarget & target,
+    RasterScratch::Data & scratch)
+{
+    typedef AreaRenderTemplate<verticalScan> R;
+    typedef raster::AreaResolve<evenOdd> Resolver;
+    if(target.paint)
+    {
+        SpanOutput<Resolver> out(*target.paint,
+            target.offX, target.offY, scratch);
+        return R::render(edges, clip, out, scratch);
+    }
+    else
+    {
+        MaskOutput<Resolver, verticalScan> out(
+            target.maskOut, target.maskPitch);
+        return R::render(edges, clip, out, scratch);
+    }
+}
+
+// Wrapper to pick a template specialization for the desired
+// quality, allowing actual code to be optimized much better.
 template <bool verticalScan>
-static bool renderPath_Q(EdgeListBuilder & builder,
-    const Rect & clip, FillRule fill,
-    uint8_t * maskOut, unsigned maskPitch, int quality)
+static bool renderPath_Q(EdgeList & edges,
+    const Rect & clip, FillRule fill, const RasterTarget & target,
+    int quality, RasterScratch::Data & scratch)
 {
+    // analytic coverage for negative quality
+    if(quality < 0)
+    {
+        if(fill == FILL_EVENODD)
+        {
+            return renderPath_A<true, verticalScan>(
+                edges, clip, target, scratch);
+        }
+        return renderPath_A<false, verticalScan>(
+            edges, clip, target, scratch);
+    }
+
     // convert runtime quality to compile time constant
     switch(quality)
     {
-    case 0:
-        return PainterRenderTemplate<0, verticalScan>::render(
-            builder.edges, clip, fill, maskOut, maskPitch);
-    case 1:
-        return PainterRenderTemplate<1, verticalScan>::render(
-            builder.edges, clip, fill, maskOut, maskPitch);
-    case 2:
-        return PainterRenderTemplate<2, verticalScan>::render(
-            builder.edges, clip, fill, maskOut, maskPitch);
-    case 3:
-        return PainterRenderTemplate<3, verticalScan>::render(
-            builder.edges, clip, fill, maskOut, maskPitch);
+    case 0: return renderPath_T<0, verticalScan>(
+            edges, clip, fill, target, scratch);
+    case 1: return renderPath_T<1, verticalScan>(
+            edges, clip, fill, target, scratch);
+    case 2: return renderPath_T<2, verticalScan>(
+            edges, clip, fill, target, scratch);
+    case 3: return renderPath_T<3, verticalScan>(
+            edges, clip, fill, target, scratch);
     default:    // use quality=4 for anything more
-        return PainterRenderTemplate<4, verticalScan>::render(
-            builder.edges, clip, fill, maskOut, maskPitch);
+        return renderPath_T<4, verticalScan>(
+            edges, clip, fill, target, scratch);
     }
 }
 
 // Wrapper to pick a template specialization for vScan
-static bool renderPath_Q_vScan(EdgeListBuilder & builder,
+// spans are always horizontal, so vScan is ignored for those
+static bool renderPath_Q_vScan(EdgeList & edges,
     const Rect & clip, FillRule fill,
-    uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan)
+    const RasterTarget & target, int quality, bool vScan,
+    RasterScratch::Data & scratch)
 {
-    if(vScan)
+    if(vScan && !target.paint)
     {
         //debugPrint("raster_ref: transposed mode\n");
         return renderPath_Q<true>(
-            builder, clip, fill, maskOut, maskPitch, quality);
+            edges, clip, fill, target, quality, scratch);
     }
     else
     {
         //debugPrint("raster_ref: normal mode\n");
         return renderPath_Q<false>(
-            builder, clip, fill, maskOut, maskPitch, quality);
+            edges, clip, fill, target, quality, scratch);
     }
 }
 
+// don't split into bands with fewer scanlines than this
+static const int parallelMinBand = 32;
+
+// set by setRenderThreadPool()
+static ThreadPool * renderThreadPool = 0;
+
+void dust::setRenderThreadPool(ThreadPool * pool)
+{
+    renderThreadPool = pool;
+}
+
+ThreadPool * dust::getRenderThreadPool()
+{
+    return renderThreadPool;
+}
+
+namespace {
+
+// Band-parallel rasterization: the clip rectangle is split into bands
+// along the scan direction and each band gets a copy of the edges that
+// overlap it. Edges are stepped exactly (see Trace::init) so the results
+// don't depend on where a band starts and the mask is bit-identical.
+//
+// With span output, the paint gets called from several threads at once,
+// but each scanline belongs to exactly one band.
+//
+// The calling thread also claims bands, so it never has to wait for
+// tasks that the pool hasn't started yet (eg. when the queue is busy).
+// Those can run after we've returned, hence the reference counting.
+//
+// Jobs are kept in the caller's scratch (which holds a reference) and
+// reused once all the helper tasks have released theirs, so the band
+// buffers are also retained from one call to the next. The pool threads
+// keep their own thread-local scratch for the actual rasterization.
+struct RasterBandJob : ThreadTask
+{
+    std::vector<EdgeList>   edges;  // edges for each band
+    std::vector<Rect>       clips;  // clip rectangle for each band
+    std::vector<ThreadTask*>    tasks;  // for queue_tasks_reentrant()
+
+    FillRule    fill;
+    RasterTarget target;
+    int         quality;
+    bool        vScan;
+
+    unsigned    nBands;
+
+    std::atomic<unsigned>   nextBand;
+    std::atomic<unsigned>   bandsDone;
+    std::atomic<unsigned>   refs;
+    std::atomic<bool>       result;
+
+    // posted once, when the last band is done
+    Semaphore   done;
+
+    void runBands(RasterScratch::Data & data)
+    {
+        while(true)
+        {
+            unsigned i = nextBand++;
+            if(i >= nBands) break;
+
+            Rect & r = clips[i];
+            if(renderPath_Q_vScan(edges[i], r, fill,
+                target, quality, vScan, data))
+            {
+                result = true;
+            }
+            else if(!target.paint)
+            {
+                // nothing drawn, but the rest of the mask is valid
+                for(int y = r.y0; y < r.y1; ++y)
+                {
+                    memset(target.maskOut + r.x0 + y*int(target.maskPitch),
+                        0, r.w());
+                }
+            }
+
+            if(++bandsDone == nBands) done.post();
+        }
+    }
+
+    void release() { if(!--refs) delete this; }
+
+    void threadpool_runtask()
+    {
+        static thread_local RasterScratch workerScratch;
+
+        runBands(workerScratch.getData());
+        release();
+    }
+};
+
+}; // anonymous namespace
+
+// EdgeListBuilder offset to center the samples within pixels
+// the analytic rasterizer doesn't sample, so it wants no offset
+static float sampleOffset(int quality)
+{
+    return quality < 0 ? 0.f : .5f / (1<<quality);
+}
+
+RasterScratch::~RasterScratch()
+{
+    if(!data) return;
+
+    // helper tasks might still hold a reference
+    for(auto * job : data->jobs) job->release();
+    delete data;
+}
+
+// Rasterize edges, in parallel bands if the clip area is large enough
+static bool renderEdges(EdgeList & edges,
+    const Rect & clip, FillRule fill,
+    const RasterTarget & target, int quality, bool vScan,
+    RasterScratch::Data & scratch)
+{
+    // spans are always horizontal
+    if(target.paint) vScan = false;
+
+    ThreadPool * pool = renderThreadPool;
+
+    // length of the clip along the scan direction
+    int scanLen = vScan ? clip.w() : clip.h();
+
+    int nBands = 0;
+    if(pool && clip.area() >= renderParallelMinArea)
+    {
+        // a few bands per thread, so claiming balances the load
+        nBands = (std::min)(int(2*(pool->getThreadCount() + 1)),
+            scanLen / parallelMinBand);
+    }
+
+    if(nBands < 2)
+    {
+        return renderPath_Q_vScan(edges, clip, fill,
+            target, quality, vScan, scratch);
+    }
+
+    // helpers that didn't get to start before we finished might
+    // still be holding on to previous jobs, so find one that's free
+    RasterBandJob * job = 0;
+    for(auto * j : scratch.jobs)
+    {
+        if(j->refs == 1) { job = j; break; }
+    }
+    if(!job)
+    {
+        job = new RasterBandJob;
+        job->refs = 1;
+        scratch.jobs.push_back(job);
+        ++rasterAllocCount;
+    }
+
+    job->nBands = nBands;
+    job->fill = fill;
+    job->target = target;
+    job->quality = quality;
+    job->vScan = vScan;
+    job->nextBand = 0;
+    job->bandsDone = 0;
+    job->result = false;
+
+    // never shrink these, so the band edge lists are kept
+    scratchBuffer(job->edges, nBands);
+    scratchBuffer(job->clips, nBands);
+
+    int scan0 = vScan ? clip.x0 : clip.y0;
+    for(int i = 0; i < nBands; ++i)
+    {
+        int b0 = scan0 + (scanLen * i) / nBands;
+        int b1 = scan0 + (scanLen * (i+1)) / nBands;
+
+        Rect & r = job->clips[i];
+        r = clip;
+        if(vScan) { r.x0 = b0; r.x1 = b1; }
+        else { r.y0 = b0; r.y1 = b1; }
+
+        // copy anything that might overlap the band, let render()
+        // do the actual culling; band limits in fixed point
+        int fp0 = b0 << XPoint::spBits;
+        int fp1 = b1 << XPoint::spBits;
+
+        EdgeList & bandEdges = job->edges[i];
+        size_t capacity = bandEdges.capacity();
+
+        bandEdges.clear();
+        for(auto & e : edges)
+        {
+            int a = vScan ? e.a.fpX : e.a.fpY;
+            int b = vScan ? e.b.fpX : e.b.fpY;
+            if((std::max)(a, b) < fp0 || (std::min)(a, b) >= fp1) continue;
+            bandEdges.push_back(e);
+        }
+
+        if(bandEdges.capacity() != capacity) ++rasterAllocCount;
+    }
+
+    // one reference for each helper task, the scratch has one already
+    unsigned nTasks = (std::min)(unsigned(nBands - 1), pool->getThreadCount());
+    job->refs += nTasks;
+
+    ThreadTask ** tasks = scratchBuffer(job->tasks, nTasks);
+    for(unsigned i = 0; i < nTasks; ++i) tasks[i] = job;
+
+    // we might be on a worker of the pool ourselves
+    pool->queue_tasks_reentrant(tasks, nTasks);
+
+    job->runBands(scratch);
+    job->done.wait();
+
+    return job->result;
+}
+
 // public wrapper for path filling
 bool dust::renderPathRef(Path & path, Rect & clip, FillRule fill,
-    uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan)
+    uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan,
+    RasterScratch * scratch)
 {
     // don't even build edges if cliprect is empty
     if(clip.isEmpty()) return false;
 
-    EdgeListBuilder builder(.5f / (1<<quality));
+    // temporary scratch if we didn't get one
+    RasterScratch temp;
+    RasterScratch::Data & data = (scratch ? *scratch : temp).getData();
+
+    EdgeListBuilder builder(data.edges, sampleOffset(quality));
     flattenPath(path, builder);
 
     builder.clipToBB(clip);
 
-    return renderPath_Q_vScan(builder, clip, fill,
-        maskOut, maskPitch, quality, vScan);
+    RasterTarget target = { maskOut, maskPitch, 0, 0, 0 };
+    return renderEdges(builder.edges, clip, fill,
+        target, quality, vScan, data);
 }
 
 // public wrapper for path stroking
 bool dust::strokePathRef(Path & path, float width, Rect & clip,
-    uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan)
+    uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan,
+    RasterScratch * scratch)
 {
     // don't even build edges if cliprect is empty
     if(clip.isEmpty()) return false;
 
-    EdgeListBuilder builder(.5f / (1<<quality));
+    RasterScratch temp;
+    RasterScratch::Data & data = (scratch ? *scratch : temp).getData();
+
+    EdgeListBuilder builder(data.edges, sampleOffset(quality));
+    strokePath(path, builder, width);
+
+    builder.clipToBB(clip);
+
+    RasterTarget target = { maskOut, maskPitch, 0, 0, 0 };
+    return renderEdges(builder.edges, clip, FILL_NONZERO,
+        target, quality, vScan, data);
+}
+
+// public wrapper for path filling with spans
+bool dust::renderPathSpans(Path & path, Rect & clip, FillRule fill,
+    IPaint & paint, int offX, int offY, int quality,
+    RasterScratch * scratch)
+{
+    if(clip.isEmpty()) return false;
+
+    RasterScratch temp;
+    RasterScratch::Data & data = (scratch ? *scratch : temp).getData();
+
+    EdgeListBuilder builder(data.edges, sampleOffset(quality));
+    flattenPath(path, builder);
+
+    builder.clipToBB(clip);
+
+    RasterTarget target = { 0, 0, &paint, offX, offY };
+    return renderEdges(builder.edges, clip, fill,
+        target, quality, false, data);
+}
+
+// public wrapper for path stroking with spans
+bool dust::strokePathSpans(Path & path, float width, Rect & clip,
+    IPaint & paint, int offX, int offY, int quality,
+    RasterScratch * scratch)
+{
+    if(clip.isEmpty()) return false;
+
+    RasterScratch temp;
+    RasterScratch::Data & data = (scratch ? *scratch : temp).getData();
+
+    EdgeListBuilder builder(data.edges, sampleOffset(quality));
     strokePath(path, builder, width);
 
     builder.clipToBB(clip);
 
-    return renderPath_Q_vScan(builder, clip, FILL_NONZERO,
-        maskOut, maskPitch, quality, vScan);
+    RasterTarget target = { 0, 0, &paint, offX, offY };
+    return renderEdges(builder.edges, clip, FILL_NONZERO,
+        target, quality, false, data);
+}
+
+// Draw hairline segments into a mask, which points to (0,0) and must
+// be cleared inside the clipping rectangle. Coverage is from distance
+// to the closest point on each segment, which gives round caps and
+// joins like StrokePath. Segments are combined with max() so there's
+// no extra coverage where they meet.
+//
+// The width of the coverage ramp is one pixel, so the total coverage
+// across the line is exactly the stroke width for widths of at least
+// one pixel; thinner strokes keep the one pixel ramp and fade instead.
+//
+// If rows is not null, it gets the touched x-range for each row as
+// pairs of [lo, hi) which must be initialized to empty by the caller.
+static void drawHairlines(const HairSegment * segs, unsigned nSegs,
+    float width, const Rect & clip, uint8_t * mask, int pitch, int * rows)
+{
+    float r = (std::max)(.5f * width, .5f);
+    float reach = r + .5f;  // zero coverage past this distance
+
+    // coverage is scale * (reach - distance), clamped to [0, scale]
+    // which is full coverage for distance <= r - .5
+    float scale = 255.f * (std::min)(width, 1.f);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 half = _mm_set1_ps(.5f);
+    const __m128 step = _mm_set_ps(3, 2, 1, 0);
+    const __m128 vReach = _mm_set1_ps(reach);
+    const __m128 vScale = _mm_set1_ps(scale);
+
+    float cx0 = float(clip.x0), cx1 = float(clip.x1 - 1);
+    float cy0 = float(clip.y0), cy1 = float(clip.y1 - 1);
+
+    for(unsigned i = 0; i < nSegs; ++i)
+    {
+        const HairSegment & s = segs[i];
+
+        float dx = s.x1 - s.x0, dy = s.y1 - s.y0;
+        float len2 = dx*dx + dy*dy;
+
+        // zero length segments are just dots, with t = 0
+        float invLen2 = len2 > 0 ? 1.f / len2 : 0.f;
+
+        // rows that can have coverage, clip in float to avoid overflow
+        float fy0 = (std::max)(cy0, ceilf((std::min)(s.y0, s.y1) - reach));
+        float fy1 = (std::min)(cy1, floorf((std::max)(s.y0, s.y1) + reach));
+        if(fy0 > fy1) continue;
+
+        // for short segments, just use the bounding box for every row
+        // otherwise find the part of the segment within reach per row
+        bool perRow = fabsf(dx) > 2*reach && dy != 0;
+        float invDy = perRow ? 1.f / dy : 0.f;
+
+        float xMin = (std::min)(s.x0, s.x1), xMax = (std::max)(s.x0, s.x1);
+
+        __m128 vdx = _mm_set1_ps(dx), vdy = _mm_set1_ps(dy);
+        __m128 vInv = _mm_set1_ps(invLen2);
+
+        for(int y = int(fy0), yEnd = int(fy1); y <= yEnd; ++y)
+        {
+            float py = float(y) - s.y0;
+
+            float xa = xMin, xb = xMax;
+            if(perRow)
+            {
+                float ta = (py - reach) * invDy, tb = (py + reach) * invDy;
+                float t0 = (std::max)(0.f, (std::min)(ta, tb));
+                float t1 = (std::min)(1.f, (std::max)(ta, tb));
+                if(t0 > t1) continue;
+
+                xa = s.x0 + t0 * dx; xb = s.x0 + t1 * dx;
+                if(xa > xb) std::swap(xa, xb);
+            }
+
+            float fx0 = (std::max)(cx0, ceilf(xa - reach));
+            float fx1 = (std::min)(cx1, floorf(xb + reach));
+            if(fx0 > fx1) continue;
+
+            int x0 = int(fx0), x1 = int(fx1) + 1;
+
+            __m128 vpy = _mm_set1_ps(py);
+            __m128 pyDy = _mm_set1_ps(py * dy);
+
+            uint8_t * row = mask + y * pitch;
+
+            // four pixels at a time, the extra pixels past x1 (but
+            // still inside the clip) get the correct coverage anyway
+            int x = x0;
+            for(; x < x1; x += 4)
+            {
+                __m128 px = _mm_add_ps(_mm_set1_ps(float(x) - s.x0), step);
+
+                __m128 t = _mm_mul_ps(_mm_add_ps(
+                    _mm_mul_ps(px, vdx), pyDy), vInv);
+                t = _mm_min_ps(one, _mm_max_ps(zero, t));
+
+                __m128 ex = _mm_sub_ps(px, _mm_mul_ps(t, vdx));
+                __m128 ey = _mm_sub_ps(vpy, _mm_mul_ps(t, vdy));
+                __m128 d = _mm_sqrt_ps(_mm_add_ps(
+                    _mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)));
+
+                __m128 c = _mm_mul_ps(vScale, _mm_sub_ps(vReach, d));
+                c = _mm_max_ps(zero, _mm_min_ps(vScale, c));
+
+                __m128i a = _mm_cvttps_epi32(_mm_add_ps(c, half));
+                a = _mm_packs_epi32(a, a);
+                a = _mm_packus_epi16(a, a);
+
+                int32_t a4 = _mm_cvtsi128_si32(a);
+                if(x + 4 > clip.x1)
+                {
+                    // would go past the clip, so store one at a time
+                    for(int j = 0; x + j < x1; ++j)
+                    {
+                        uint8_t aj = uint8_t(a4 >> (8*j));
+                        if(row[x+j] < aj) row[x+j] = aj;
+                    }
+                    break;
+                }
+
+                int32_t m4;
+                memcpy(&m4, row + x, 4);
+                m4 = _mm_cvtsi128_si32(_mm_max_epu8(
+                    _mm_cvtsi32_si128(m4), a));
+                memcpy(row + x, &m4, 4);
+            }
+
+            if(rows)
+            {
+                // include the extra pixels from the last four
+                int xEnd = (std::min)(clip.x1, x0 + ((x1 - x0 + 3) & ~3));
+
+                int * lohi = rows + 2*(y - clip.y0);
+                lohi[0] = (std::min)(lohi[0], x0);
+                lohi[1] = (std::max)(lohi[1], xEnd);
+            }
+        }
+    }
+}
+
+// build hairline segments and shrink clip to their bounding box
+// returns false if there is nothing to draw
+static bool buildHairlines(Path & path, float width, Rect & clip,
+    RasterScratch::Data & data)
+{
+    HairlineBuilder builder(data.hairSegs);
+    flattenPath(path, builder);
+
+    if(!data.hairSegs.size()) return false;
+
+    // pixels whose centers are within reach, clipped in float
+    float reach = (std::max)(.5f * width, .5f) + .5f;
+
+    Rect bb;
+    bb.x0 = int((std::max)(float(clip.x0), ceilf(builder.bx0 - reach)));
+    bb.y0 = int((std::max)(float(clip.y0), ceilf(builder.by0 - reach)));
+    bb.x1 = int((std::min)(float(clip.x1), floorf(builder.bx1 + reach) + 1));
+    bb.y1 = int((std::min)(float(clip.y1), floorf(builder.by1 + reach) + 1));
+
+    clip.clip(bb);
+    return !clip.isEmpty();
+}
+
+// public wrapper for hairlines
+bool dust::strokeHairlineRef(Path & path, float width, Rect & clip,
+    uint8_t * maskOut, unsigned maskPitch, RasterScratch * scratch)
+{
+    if(clip.isEmpty()) return false;
+
+    RasterScratch temp;
+    RasterScratch::Data & data = (scratch ? *scratch : temp).getData();
+
+    if(!buildHairlines(path, width, clip, data)) return false;
+
+    for(int y = clip.y0; y < clip.y1; ++y)
+    {
+        memset(maskOut + y * int(maskPitch) + clip.x0, 0, clip.w());
+    }
+
+    drawHairlines(data.hairSegs.data(), data.hairSegs.size(),
+        width, clip, maskOut, int(maskPitch), 0);
+
+    return true;
+}
+
+// public wrapper for hairlines with spans
+bool dust::strokeHairlineSpans(Path & path, float width, Rect & clip,
+    IPaint & paint, int offX, int offY, RasterScratch * scratch)
+{
+    if(clip.isEmpty()) return false;
+
+    RasterScratch temp;
+    RasterScratch::Data & data = (scratch ? *scratch : temp).getData();
+
+    if(!buildHairlines(path, width, clip, data)) return false;
+
+    // draw into a mask covering the clip, then send the touched
+    // part of each row to the paint as spans; this mask is always
+    // cleared after use, so we only need to clear what we touch
+    int w = clip.w(), h = clip.h();
+    uint8_t * mask = scratchBuffer(data.hairMask, w * h);
+
+    int * rows = scratchBuffer(data.hairRows, 2 * h);
+    for(int i = 0; i < h; ++i) { rows[2*i] = clip.x1; rows[2*i+1] = clip.x0; }
+
+    uint8_t * maskPtr = mask - clip.x0 - w * clip.y0;
+    drawHairlines(data.hairSegs.data(), data.hairSegs.size(),
+        width, clip, maskPtr, w, rows);
+
+    for(int i = 0; i < h; ++i)
+    {
+        int lo = rows[2*i] - clip.x0, hi = rows[2*i+1] - clip.x0;
+        if(lo >= hi) continue;
+
+        paintAlphaSpans(paint, data.spans, mask + i * w, lo, hi,
+            clip.x0 + offX, clip.y0 + i + offY);
+
+        memset(mask + i * w + lo, 0, hi - lo);
+    }
+
+    return true;
 }
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "dust/core/defs.h"
+
+// Coverage resolve kernels for the reference rasterizer.
+//
+// The rasterizer accumulates coverage deltas for each pixel of a scanline
+// and resolves them into alpha with a prefix sum. This is the one loop that
+// touches every pixel of the clip rectangle, so it gets SIMD kernels.
+//
+// These are in a separate header mainly so that the benchmark program can
+// compare them against the scalar reference; there is normally no reason
+// to use them directly.
+//
+// NEON goes through sse2neon.h (included by defs.h) like everything else.
+//
+namespace dust
+{
+    namespace raster
+    {
+        // sampleBits is the same as in PainterRenderTemplate, so the
+        // maximum coverage for a pixel is (1 << (2*sampleBits))
+        //
+        // coverage values must be in [0, maxCoverage] after summing,
+        // but the deltas themselves can be anything that fits a short
+        template <unsigned sampleBits>
+        struct Resolve
+        {
+            // type of the coverage buffer
+            typedef short Cell;
+
+            // coverage to alpha is (sum * 255) / maxCoverage, but since
+            // maxCoverage is a power of two and sum is never negative,
+            // the division is always exactly a right shift
+            static const unsigned shift = 2 * sampleBits;
+
+            // scalar reference: prefix sum and clear coverage[0..n)
+            // then store alpha to out[x*pitch]
+            static void scalar(short * coverage,
+                uint8_t * out, unsigned n, unsigned pitch)
+            {
+                int sum = 0;
+                for(unsigned x = 0; x < n; ++x)
+                {
+                    sum += coverage[x]; coverage[x] = 0;
+                    out[x*pitch] = (uint8_t) ((sum * 255) >> shift);
+                }
+            }
+
+            // prefix sum of 8 shorts, plus the carry from previous block
+            // then broadcast the last lane as the carry for the next one
+            //
+            // we don't care about overflow, since any wrap-around will
+            // cancel out and the final sums are always in range
+            static inline __m128i prefixSum(__m128i v, __m128i & carry)
+            {
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi16(v, carry);
+
+                carry = _mm_shufflehi_epi16(v, 0xff);
+                carry = _mm_unpackhi_epi64(carry, carry);
+                return v;
+            }
+
+            // convert 8 coverage sums to alpha in 16-bit lanes
+            //
+            // for sampleBits = 4 the maximum product is 256*255
+            // which overflows a signed short, so shift as unsigned
+            static inline __m128i normalize(__m128i v)
+            {
+                v = _mm_mullo_epi16(v, _mm_set1_epi16(255));
+                return _mm_srli_epi16(v, shift);
+            }
+
+            // SIMD version: results are identical to scalar()
+            static void simd(short * coverage,
+                uint8_t * out, unsigned n, unsigned pitch)
+            {
+                __m128i carry = _mm_setzero_si128();
+                __m128i zero = _mm_setzero_si128();
+
+                unsigned x = 0;
+                if(pitch == 1)
+                {
+                    // horizontal layout: 16 pixels per store
+                    for(; x + 16 <= n; x += 16)
+                    {
+                        __m128i * cv = (__m128i*) (coverage + x);
+                        __m128i v0 = prefixSum(_mm_loadu_si128(cv), carry);
+                        __m128i v1 = prefixSum(_mm_loadu_si128(cv+1), carry);
+                        _mm_storeu_si128(cv, zero);
+                        _mm_storeu_si128(cv+1, zero);
+
+                        __m128i a = _mm_packus_epi16(
+                            normalize(v0), normalize(v1));
+                        _mm_storeu_si128((__m128i*)(out + x), a);
+                    }
+                }
+                else
+                {
+                    // vertical layout: resolve 8 pixels, then scatter
+                    for(; x + 8 <= n; x += 8)
+                    {
+                        __m128i * cv = (__m128i*) (coverage + x);
+                        __m128i v = prefixSum(_mm_loadu_si128(cv), carry);
+                        _mm_storeu_si128(cv, zero);
+
+                        v = normalize(v);
+                        v = _mm_packus_epi16(v, v);
+
+                        uint8_t a[16];
+                        _mm_storeu_si128((__m128i*)a, v);
+
+                        uint8_t * column = out + x*pitch;
+                        for(unsigned i = 0; i < 8; ++i)
+                        {
+                            column[i*pitch] = a[i];
+                        }
+                    }
+                }
+
+                // scalar tail
+                int sum = (short) _mm_cvtsi128_si32(carry);
+                for(; x < n; ++x)
+                {
+                    sum += coverage[x]; coverage[x] = 0;
+                    out[x*pitch] = (uint8_t) ((sum * 255) >> shift);
+                }
+            }
+        };
+
+        // Resolve for the analytic rasterizer: the cells contain signed
+        // area deltas and the prefix sum is the winding weighted coverage
+        //
+        // nonzero uses min(|sum|, 1) and even-odd folds the sum so that
+        // 0, 2, 4.. are empty and 1, 3, 5.. are full; this is exact for
+        // shapes that don't overlap themselves inside a single pixel
+        template <bool evenOdd>
+        struct AreaResolve
+        {
+            typedef float Cell;
+
+            // coverage to alpha in [0,1]
+            static inline float alpha(float sum)
+            {
+                float a = fabsf(sum);
+                if(evenOdd)
+                {
+                    a -= 2.f * float(int(.5f * a));
+                    return (std::min)(a, 2.f - a);
+                }
+                return (std::min)(a, 1.f);
+            }
+
+            static void scalar(float * coverage,
+                uint8_t * out, unsigned n, unsigned pitch)
+            {
+                float sum = 0;
+                for(unsigned x = 0; x < n; ++x)
+                {
+                    sum += coverage[x]; coverage[x] = 0;
+                    out[x*pitch] = (uint8_t) int(255.f * alpha(sum) + .5f);
+                }
+            }
+
+            // prefix sum of 4 floats, like the integer version
+            static inline __m128 prefixSum(__m128 v, __m128 & carry)
+            {
+                v = _mm_add_ps(v, _mm_castsi128_ps(
+                    _mm_slli_si128(_mm_castps_si128(v), 4)));
+                v = _mm_add_ps(v, _mm_castsi128_ps(
+                    _mm_slli_si128(_mm_castps_si128(v), 8)));
+                v = _mm_add_ps(v, carry);
+
+                carry = _mm_shuffle_ps(v, v, 0xff);
+                return v;
+            }
+
+            // convert 4 coverage sums to alpha in 32-bit lanes
+            static inline __m128i normalize(__m128 v)
+            {
+                const __m128 absMask = _mm_castsi128_ps(
+                    _mm_set1_epi32(0x7fffffff));
+
+                __m128 a = _mm_and_ps(v, absMask);
+                if(evenOdd)
+                {
+                    __m128 half = _mm_cvtepi32_ps(_mm_cvttps_epi32(
+                        _mm_mul_ps(a, _mm_set1_ps(.5f))));
+                    a = _mm_sub_ps(a, _mm_add_ps(half, half));
+                    a = _mm_min_ps(a, _mm_sub_ps(_mm_set1_ps(2.f), a));
+                }
+                else
+                {
+                    a = _mm_min_ps(a, _mm_set1_ps(1.f));
+                }
+
+                a = _mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(255.f)),
+                    _mm_set1_ps(.5f));
+                return _mm_cvttps_epi32(a);
+            }
+
+            // resolve and clear 4 cells, carry is the sum so far
+            static inline __m128i resolve4(float * c, __m128 & carry)
+            {
+                __m128 v = prefixSum(_mm_loadu_ps(c), carry);
+                _mm_storeu_ps(c, _mm_setzero_ps());
+                return normalize(v);
+            }
+
+            // SIMD version: results can differ from scalar() by one
+            // in rare cases, since the summation order is different
+            static void simd(float * coverage,
+                uint8_t * out, unsigned n, unsigned pitch)
+            {
+                __m128 carry = _mm_setzero_ps();
+
+                unsigned x = 0;
+                if(pitch == 1)
+                {
+                    // most blocks have no edges, in which case the sum
+                    // doesn't change and we can just repeat the alpha
+                    // from the previous block which we compute lazily
+                    const __m128i zero = _mm_setzero_si128();
+                    __m128i run = zero;
+                    bool runValid = true;
+
+                    // horizontal layout: 16 pixels per store
+                    for(; x + 16 <= n; x += 16)
+                    {
+                        float * c = coverage + x;
+
+                        __m128i any = _mm_or_si128(
+                            _mm_or_si128(_mm_loadu_si128((__m128i*)c),
+                                _mm_loadu_si128((__m128i*)(c+4))),
+                            _mm_or_si128(_mm_loadu_si128((__m128i*)(c+8)),
+                                _mm_loadu_si128((__m128i*)(c+12))));
+                        if(0xffff == _mm_movemask_epi8(
+                            _mm_cmpeq_epi32(any, zero)))
+                        {
+                            if(!runValid)
+                            {
+                                run = normalize(carry);
+                                run = _mm_packs_epi32(run, run);
+                                run = _mm_packus_epi16(run, run);
+                                runValid = true;
+                            }
+                            _mm_storeu_si128((__m128i*)(out + x), run);
+                            continue;
+                        }
+                        runValid = false;
+
+                        __m128i a0 = resolve4(c, carry);
+                        __m128i a1 = resolve4(c+4, carry);
+                        __m128i a2 = resolve4(c+8, carry);
+                        __m128i a3 = resolve4(c+12, carry);
+
+                        __m128i a = _mm_packus_epi16(
+                            _mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+                        _mm_storeu_si128((__m128i*)(out + x), a);
+                    }
+                }
+                else
+                {
+                    // vertical layout: resolve 4 pixels, then scatter
+                    for(; x + 4 <= n; x += 4)
+                    {
+                        __m128i v = resolve4(coverage + x, carry);
+
+                        v = _mm_packs_epi32(v, v);
+                        v = _mm_packus_epi16(v, v);
+
+                        uint32_t a = _mm_cvtsi128_si32(v);
+
+                        uint8_t * column = out + x*pitch;
+                        for(unsigned i = 0; i < 4; ++i)
+                        {
+                            column[i*pitch] = uint8_t(a >> (8*i));
+                        }
+                    }
+                }
+
+                // scalar tail
+                float sum = _mm_cvtss_f32(carry);
+                for(; x < n; ++x)
+                {
+                    sum += coverage[x]; coverage[x] = 0;
+                    out[x*pitch] = (uint8_t) int(255.f * alpha(sum) + .5f);
+                }
+            }
+        };
+    };
+};
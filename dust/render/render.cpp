@@ -78,3 +78,30 @@ float RenderContext::drawTextWithPaint(Font & f, IPaintGlyph & paint,
     return width;
 
 }
+
+// same as above, but with the glyphs already looked up
+float RenderContext::drawTextRunWithPaint(Font & f, IPaintGlyph & paint,
+    const TextRun & run, float x, float y, bool adjustLeft)
+{
+    unsigned osX = f->getOversampleX();
+    unsigned osY = f->getOversampleY();
+
+    float width = 0;
+
+    for(auto & item : run.getItems())
+    {
+        // look the glyph up again even if it still has a bitmap, so
+        // that its atlas page is kept alive; it's a table lookup and
+        // brings the bitmap back if it was evicted or never rendered
+        const Glyph * g = f->getGlyphForChar(item.ch);
+
+        // if this is first char of a line then pad with lsb
+        if(adjustLeft) { width -= g->lsb; adjustLeft = false; }
+
+        paint.paintGlyph(g, offX + x + width, offY + y, osX, osY);
+
+        width += g->advanceW;
+    }
+
+    return width;
+}
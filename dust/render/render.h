@@ -18,6 +18,9 @@ namespace dust
     //
     struct RenderContext
     {
+        // All the constructors drop the mip levels of the target (see
+        // Surface::getMip) as whatever is drawn will make them stale.
+        //
         // construct a render context for a surface
         // sets the clipping rectangle to cover the surface
         // set the origin point to (0,0)
@@ -26,6 +29,7 @@ namespace dust
             , clipRect(0,0,dst.getSizeX(),dst.getSizeY())
             , offX(0), offY(0)
         {
+            target.invalidateMips();
         }
 
         // construct a render context for a surface
@@ -39,6 +43,7 @@ namespace dust
             , offY(offset ? clip.y0 : 0)
         {
             clipRect.clip(Rect(0,0,dst.getSizeX(), dst.getSizeY()));
+            target.invalidateMips();
         }
 
         // construct a render context for a surface
@@ -50,6 +55,7 @@ namespace dust
             : target(dst), clipRect(clip), offX(oX), offY(oY)
         {
             clipRect.clip(Rect(0,0, dst.getSizeX(), dst.getSizeY()));
+            target.invalidateMips();
         }
 
         // Construct a render context from existing context with
@@ -64,6 +70,7 @@ namespace dust
         {
             // clipTo is in parent coordinates so offset to surface
             clipRect.clip(clipTo, parent.offX, parent.offY);
+            target.invalidateMips();
         }
 
         // Construct a render context from existing context with
@@ -78,6 +85,7 @@ namespace dust
         {
             // clipTo is in parent coordinates so offset to surface
             clipRect.clip(clipTo, parent.offX, parent.offY);;
+            target.invalidateMips();
         }
 
         // Construct a render context from existing contxt with
@@ -86,6 +94,7 @@ namespace dust
             : target(parent.target), clipRect(parent.clipRect)
             , offX(parent.offX + oX), offY(parent.offY + oY)
         {
+            target.invalidateMips();
         }
 
         // returns clip rect relative to current offset
@@ -176,8 +185,24 @@ namespace dust
             fillRect<Blend>(srcPaint, x, y, w, h);
         }
 
+        // draw src into the rectangle (x,y,w,h) keeping the borders
+        // given as insets into src at their original size, while the
+        // middle is stretched or tiled (see paint::NineSlice)
+        template <typename Blend = blend::Over>
+        void nineSlice(Surface & src, int x, int y, int w, int h,
+            int left, int top, int right, int bottom, bool tile = false)
+        {
+            // an empty source has no pixels to map to
+            if(!src.getSizeX() || !src.getSizeY()) return;
+
+            paint::NineSlice srcPaint(src, x, y, w, h,
+                left, top, right, bottom, tile);
+            fillRect<Blend>(srcPaint, x, y, w, h);
+        }
+
         // rasterize the path and fill it using the specified paint
         // setting vScan = true might make horizontal plots faster
+        // quality can also be QUALITY_ANALYTIC (see render_path.h)
         template <typename Blend = blend::Over, typename PaintSource>
         void fillPath(Path & p, const PaintSource & src,
             FillRule fill = FILL_NONZERO, int quality = 2, bool vScan = false)
@@ -186,14 +211,23 @@ namespace dust
             Rect r(clipRect.x0-offX, clipRect.y0-offY,
                 clipRect.w(), clipRect.h());
 
+            // horizontal scans can just paint spans directly
+            if(!vScan)
+            {
+                Paint<PaintSource, Blend> paint(*this, src);
+                renderPathSpans(p, r, fill, paint,
+                    offX, offY, quality, &scratch);
+                return;
+            }
+
             // allocate space for alpha
-            maskData.resize(r.w()*r.h());
             int maskPitch = r.w();
+            Alpha * mask = scratch.getMask(r.w()*r.h());
 
             // draw the shape
-            Alpha * maskPtr = maskData.data() - r.x0 - maskPitch*r.y0;
+            Alpha * maskPtr = mask - r.x0 - maskPitch*r.y0;
             if(renderPathRef(p, r, fill,
-                maskPtr, maskPitch, quality, vScan))
+                maskPtr, maskPitch, quality, vScan, &scratch))
             {
                 // then do the fill
                 Paint<PaintSource, Blend> paint(*this, src);
@@ -204,6 +238,10 @@ namespace dust
 
         // rasterize a stroke for a path and fill it using the specified paint
         // setting vScan = true might make horizontal plots faster
+        // quality can also be QUALITY_ANALYTIC (see render_path.h)
+        //
+        // strokes up to hairlineMaxWidth are drawn as hairlines instead
+        // unless quality is 0, which keeps them aliased
         template <typename Blend = blend::Over, typename PaintSource>
         void strokePath(Path & p, float width, const PaintSource & src,
             int quality = 2, bool vScan = false)
@@ -212,13 +250,32 @@ namespace dust
             Rect r(clipRect.x0-offX, clipRect.y0-offY,
                 clipRect.w(), clipRect.h());
 
+            // thin lines are a lot faster as hairlines
+            if(quality && width <= hairlineMaxWidth)
+            {
+                Paint<PaintSource, Blend> paint(*this, src);
+                strokeHairlineSpans(p, width, r, paint,
+                    offX, offY, &scratch);
+                return;
+            }
+
+            // horizontal scans can just paint spans directly
+            if(!vScan)
+            {
+                Paint<PaintSource, Blend> paint(*this, src);
+                strokePathSpans(p, width, r, paint,
+                    offX, offY, quality, &scratch);
+                return;
+            }
+
             // allocate space for alpha
-            maskData.resize(r.w()*r.h());
             int maskPitch = r.w();
+            Alpha * mask = scratch.getMask(r.w()*r.h());
 
             // draw the shape
-            Alpha * maskPtr = maskData.data() - r.x0 - maskPitch*r.y0;
-            if(strokePathRef(p, width, r, maskPtr, maskPitch, quality, vScan))
+            Alpha * maskPtr = mask - r.x0 - maskPitch*r.y0;
+            if(strokePathRef(p, width, r,
+                maskPtr, maskPitch, quality, vScan, &scratch))
             {
                 // then do the fill
                 Paint<PaintSource, Blend> paint(*this, src);
@@ -294,13 +351,40 @@ namespace dust
         {
             drawCenteredText(font, str.c_str(), str.size(), src, x, y);
         }
+
+        // draw prepared text - returns total advance width
+        //
+        // this calls run.update(font) so the run is laid out again
+        // if the font instance has changed since the last time
+        template <typename PaintSource>
+        float drawText(Font & font, TextRun & run,
+            const PaintSource & src, float x, float y, bool adjustLeft = false)
+        {
+            if(!run.update(font)) return 0;
+
+            Paint<PaintSource, blend::Over> paint(*this, src);
+            return drawTextRunWithPaint(font, paint, run, x, y, adjustLeft);
+        }
+
+        // draw prepared text horizontally centered around x
+        template <typename PaintSource>
+        void drawCenteredText(Font & font, TextRun & run,
+            const PaintSource & src, float x, float y)
+        {
+            if(!run.update(font)) return;
+
+            Paint<PaintSource, blend::Over> paint(*this, src);
+            float w = run.getAdjustedWidth();
+            drawTextRunWithPaint(font, paint, run, x - .5f * w, y, true);
+        }
     private:
         Surface &target;    // CPU render into a surface
         Rect    clipRect;   // clipping rect, in surface coordinates
         int     offX, offY; // origin point, relative to surface
 
+        // rasterizer buffers and the alpha mask
         friend struct MaskDataBorrow;
-        std::vector<Alpha>  maskData;
+        RasterScratch   scratch;
 
         // this is just used internally to avoid templating drawText
         struct IPaintGlyph
@@ -322,7 +406,7 @@ namespace dust
             const PaintSource & src;
 
             Paint(RenderContext & rc, const PaintSource & src)
-            : rc(rc), src(src) {}
+            : rc(rc), src(src) { paint::prepare(src); }
 
             void paintRect(const Rect & rr)
             {
@@ -333,17 +417,9 @@ namespace dust
                 const Rect * srcClip = src.getClipRect();
                 if(srcClip) { r.clip(*srcClip, rc.offX, rc.offY); }
 
-                ARGB * dst = rc.target.getPixels();
-                unsigned dstPitch = rc.target.getPitch();
                 for(int y = r.y0; y < r.y1; ++y)
                 {
-                    for(int x = r.x0; x < r.x1; ++x)
-                    {
-                        ARGB & pixel = dst[x+dstPitch*y];
-                        // source expects RC relative coordinates
-                        pixel = Blend::blend(pixel,
-                            src.color(x-rc.offX,y-rc.offY));
-                    }
+                    paintRow(y, r.x0, r.x1, 0);
                 }
             }
 
@@ -357,23 +433,118 @@ namespace dust
                 const Rect * srcClip = src.getClipRect();
                 if(srcClip) { r.clip(*srcClip, rc.offX, rc.offY); }
 
-                ARGB * dst = rc.target.getPixels();
-                unsigned dstPitch = rc.target.getPitch();
-
                 for(int y = r.y0; y < r.y1; ++y)
                 {
-                    for(int x = r.x0; x < r.x1; ++x)
+                    paintRow(y, r.x0, r.x1, mask + r.x0 + maskPitch*y);
+                }
+            }
+
+            void paintSpans(int y, const Span * spans, unsigned n)
+            {
+                // get source clipping rectangle and clip if necessary
+                int cx0 = rc.clipRect.x0, cx1 = rc.clipRect.x1;
+                const Rect * srcClip = src.getClipRect();
+                if(srcClip)
+                {
+                    if(y < srcClip->y0 + rc.offY) return;
+                    if(y >= srcClip->y1 + rc.offY) return;
+                    cx0 = (std::max)(cx0, srcClip->x0 + rc.offX);
+                    cx1 = (std::min)(cx1, srcClip->x1 + rc.offX);
+                }
+
+                for(unsigned i = 0; i < n; ++i)
+                {
+                    int x0 = (std::max)(spans[i].x0, cx0);
+                    int x1 = (std::min)(spans[i].x1, cx1);
+
+                    const Alpha * mask = spans[i].mask;
+                    if(mask) mask += x0 - spans[i].x0;
+
+                    paintRow(y, x0, x1, mask);
+                }
+            }
+
+            // paint pixels [x0, x1) of row y, with mask[x-x0] as alpha
+            // for each pixel if mask is not null
+            //
+            // masks are processed in blocks of 16 pixels, skipping empty
+            // blocks and painting fully covered ones without the mask
+            void paintRow(int y, int x0, int x1, const Alpha * mask)
+            {
+                // clipping can leave nothing (or less than nothing)
+                if(x1 <= x0) return;
+
+                if(!mask) { paintRun(y, x0, x1, 0); return; }
+
+                const int block = 16;
+
+                int runStart = x0;
+                simd::MaskType runType = simd::MASK_ZERO;
+                for(int x = x0; x < x1; x += block)
+                {
+                    unsigned n = (std::min)(block, x1 - x);
+                    simd::MaskType t = simd::maskType(mask + (x - x0), n);
+                    if(t == runType) continue;
+
+                    if(runType != simd::MASK_ZERO)
                     {
-                        // fast path to reduce bandwidth
-                        uint8_t alpha = mask[x+maskPitch*y];
-                        if(!alpha) continue;
+                        paintRun(y, runStart, x, runType == simd::MASK_FULL
+                            ? 0 : mask + (runStart - x0));
+                    }
+                    runStart = x; runType = t;
+                }
 
-                        ARGB & pixel = dst[x+dstPitch*y];
-                        // source expects RC relative coordinates
-                        pixel = color::alphaMask(pixel,
-                            Blend::blend(pixel,
-                                src.color(x-rc.offX,y-rc.offY)),
-                            alpha);
+                if(runType != simd::MASK_ZERO)
+                {
+                    paintRun(y, runStart, x1, runType == simd::MASK_FULL
+                        ? 0 : mask + (runStart - x0));
+                }
+            }
+
+            // paint pixels [x0, x1) of row y in chunks, so that the
+            // source colors can be fetched and blended with SIMD
+            void paintRun(int y, int x0, int x1, const Alpha * mask)
+            {
+                if(x1 <= x0) return;
+
+                const int chunk = 64;
+                ARGB colors[chunk];
+
+                ARGB * dst = rc.target.getPixels() + y*rc.target.getPitch();
+
+                // solid colors only need to be filled once and opaque
+                // parts can be stored directly for some blend types
+                ARGB solid = 0;
+                bool isSolid = paint::solidColor(src, solid);
+                if(isSolid)
+                {
+                    if(!mask && dust::blend::isStore<Blend>::test(solid))
+                    {
+                        simd::fill(dst + x0, solid, x1 - x0);
+                        return;
+                    }
+                    simd::fill(colors, solid, chunk);
+                }
+
+                for(int x = x0; x < x1; x += chunk)
+                {
+                    unsigned n = (std::min)(chunk, x1 - x);
+
+                    // source expects RC relative coordinates
+                    if(!isSolid)
+                    {
+                        paint::spanColors(src,
+                            x-rc.offX, y-rc.offY, n, colors);
+                    }
+
+                    if(mask)
+                    {
+                        simd::SpanBlend<Blend>::blendMask(
+                            dst + x, colors, mask + (x - x0), n);
+                    }
+                    else
+                    {
+                        simd::SpanBlend<Blend>::blend(dst + x, colors, n);
                     }
                 }
             }
@@ -414,17 +585,18 @@ namespace dust
                 {
                     for(int x = r.x0; x < r.x1; ++x)
                     {
-                        int offset = (x*osX-xs)+(y*osY-ys)*g->bbW;
+                        int gx = x*osX-xs, gy = y*osY-ys;
 
-                        if(offset < 0 || offset >= g->bbW * g->bbH)
+                        if(gx < 0 || gx >= int(g->bbW)
+                        || gy < 0 || gy >= int(g->bbH))
                         {
                             debugPrint("bad glyph read offset at (%d,%d):"
                                 "x*os - xs: %d (w:%d), y*os - ys: %d (h:%d)\n",
-                                x, y, x*osX-xs, g->bbW, y*osY-ys, g->bbH);
+                                x, y, gx, g->bbW, gy, g->bbH);
                                 return;
                         }
 
-                        Alpha mask = g->bitmap[offset];
+                        Alpha mask = g->bitmap[gx + gy*g->pitch];
 
                         ARGB & pixel = dst[x+dstPitch*y];
                         pixel = color::alphaMask(pixel,
@@ -439,27 +611,40 @@ namespace dust
         float drawTextWithPaint(Font & font, IPaintGlyph & paint,
             const char *text, unsigned len,
             float x, float y, bool adjustLeft);
+
+        float drawTextRunWithPaint(Font & font, IPaintGlyph & paint,
+            const TextRun & run, float x, float y, bool adjustLeft);
     };
 
-    // Internal helper: used by PanelParent to borrow alphaMask from
-    // parent RenderContext to child RenderContext in order to reduce allocs
+    // Internal helper: used by PanelParent to borrow alphaMask and the
+    // rest of the rasterizer scratch from parent RenderContext to child
+    // RenderContext in order to reduce allocs
+    //
+    // Window keeps a RasterScratch of it's own, so that the buffers are
+    // kept from one frame to the next, and lends it to the root context.
     struct MaskDataBorrow
     {
         MaskDataBorrow(RenderContext & src, RenderContext & dst)
+            : src(src.scratch), dst(dst)
+        {
+            this->src.swap(dst.scratch);
+        }
+
+        MaskDataBorrow(RasterScratch & src, RenderContext & dst)
             : src(src), dst(dst)
         {
-            std::swap(src.maskData, dst.maskData);
+            src.swap(dst.scratch);
         }
 
         ~MaskDataBorrow()
         {
-            std::swap(src.maskData, dst.maskData);
+            src.swap(dst.scratch);
         }
 
     private:
         MaskDataBorrow(MaskDataBorrow const &) = delete;
     
-        RenderContext & src;
+        RasterScratch & src;
         RenderContext & dst;
     };
 
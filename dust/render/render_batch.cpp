@@ -0,0 +1,78 @@
+
+#include "render_batch_kernels.h"
+
+using namespace dust;
+
+static BatchOps selectBatchOps()
+{
+    BatchOps ops;
+#if defined(__AVX2__)
+    // everything is compiled for AVX2 anyway
+    ops = BatchKernels<simd::Vec8>::getOps("avx2");
+#else
+# if defined(DUST_ARCH_X86)
+    // init is only needed if we're called from a static constructor
+    // supports also checks that the OS saves the AVX registers
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && getBatchOpsAVX2(ops)) return ops;
+
+    ops = BatchKernels<simd::Vec4>::getOps("sse2");
+# else
+    ops = BatchKernels<simd::Vec4>::getOps("neon");
+# endif
+#endif
+    return ops;
+}
+
+static const BatchOps & batchOps()
+{
+    static const BatchOps ops = selectBatchOps();
+    return ops;
+}
+
+void color::batch::blend(ARGB * out, const ARGB * c,
+    const Alpha * a, unsigned n)
+{
+    batchOps().blend(out, c, a, n);
+}
+
+void color::batch::multiply(ARGB * out, const ARGB * c1,
+    const ARGB * c2, unsigned n)
+{
+    batchOps().multiply(out, c1, c2, n);
+}
+
+void color::batch::clipAdd(ARGB * out, const ARGB * c1,
+    const ARGB * c2, unsigned n)
+{
+    batchOps().clipAdd(out, c1, c2, n);
+}
+
+void color::batch::AoverB(ARGB * out, const ARGB * a,
+    const ARGB * b, unsigned n)
+{
+    batchOps().AoverB(out, a, b, n);
+}
+
+void color::batch::alphaMask(ARGB * out, const ARGB * c0,
+    const ARGB * c1, const Alpha * a, unsigned n)
+{
+    batchOps().alphaMask(out, c0, c1, a, n);
+}
+
+void color::batch::lerp(ARGB * out, const ARGB * c1,
+    const ARGB * c2, const uint8_t * frac, unsigned n)
+{
+    batchOps().lerp(out, c1, c2, frac, n);
+}
+
+void color::batch::divide(ARGB * out, const ARGB * c1,
+    const ARGB * c2, unsigned n)
+{
+    batchOps().divide(out, c1, c2, n);
+}
+
+const char * color::batch::getImplementation()
+{
+    return batchOps().name;
+}
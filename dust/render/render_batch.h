@@ -0,0 +1,54 @@
+#pragma once
+
+#include "render_color.h"
+
+// Versions of the color operations in render_color.h for arrays.
+//
+// These give results identical to calling the scalar functions for
+// each element, but process 4 or 8 pixels at a time with the vectors
+// from render_simd.h. Unlike the inline templates there (which only use
+// AVX2 when the whole program is compiled for it) these are compiled
+// separately for AVX2 and selected at runtime, so the same binary uses
+// AVX2 when the CPU supports it and falls back to SSE2 (or NEON).
+//
+// The output can be the same array as one of the inputs.
+//
+namespace dust
+{
+    namespace color
+    {
+        namespace batch
+        {
+            // out[i] = blend(c[i], a[i])
+            void blend(ARGB * out, const ARGB * c,
+                const Alpha * a, unsigned n);
+
+            // out[i] = multiply(c1[i], c2[i])
+            void multiply(ARGB * out, const ARGB * c1,
+                const ARGB * c2, unsigned n);
+
+            // out[i] = clipAdd(c1[i], c2[i])
+            void clipAdd(ARGB * out, const ARGB * c1,
+                const ARGB * c2, unsigned n);
+
+            // out[i] = AoverB(a[i], b[i])
+            void AoverB(ARGB * out, const ARGB * a,
+                const ARGB * b, unsigned n);
+
+            // out[i] = alphaMask(c0[i], c1[i], a[i])
+            void alphaMask(ARGB * out, const ARGB * c0,
+                const ARGB * c1, const Alpha * a, unsigned n);
+
+            // out[i] = lerp(c1[i], c2[i], frac[i])
+            void lerp(ARGB * out, const ARGB * c1,
+                const ARGB * c2, const uint8_t * frac, unsigned n);
+
+            // out[i] = divide(c1[i], c2[i])
+            void divide(ARGB * out, const ARGB * c1,
+                const ARGB * c2, unsigned n);
+
+            // name of the version in use: "avx2", "sse2" or "neon"
+            const char * getImplementation();
+        };
+    };
+};
@@ -0,0 +1,15 @@
+
+// The Makefile compiles this with -mavx2 on x86, and render_batch.cpp
+// only calls it after checking that the CPU supports AVX2.
+
+#include "render_batch_kernels.h"
+
+bool dust::getBatchOpsAVX2(BatchOps & ops)
+{
+#if defined(__AVX2__)
+    ops = BatchKernels<simd::Vec8>::getOps("avx2");
+    return true;
+#else
+    return false;
+#endif
+}
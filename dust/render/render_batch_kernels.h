@@ -0,0 +1,139 @@
+#pragma once
+
+#include "render_batch.h"
+#include "render_simd.h"
+
+// The loops behind render_batch.h, shared by the SSE2/NEON version in
+// render_batch.cpp and the AVX2 version in render_batch_avx2.cpp, which
+// instantiate them for Vec4 and Vec8 respectively.
+//
+// Since these are compiled with different instruction sets, the kernels
+// must stay in the anonymous namespace so that the linker can't pick the
+// AVX2 copy for the SSE2 version (render_simd.h takes care of the rest).
+//
+namespace dust
+{
+    // one pointer for each of the functions in color::batch
+    struct BatchOps
+    {
+        const char * name;
+
+        void (*blend)(ARGB *, const ARGB *, const Alpha *, unsigned);
+        void (*multiply)(ARGB *, const ARGB *, const ARGB *, unsigned);
+        void (*clipAdd)(ARGB *, const ARGB *, const ARGB *, unsigned);
+        void (*AoverB)(ARGB *, const ARGB *, const ARGB *, unsigned);
+        void (*alphaMask)(ARGB *, const ARGB *, const ARGB *,
+            const Alpha *, unsigned);
+        void (*lerp)(ARGB *, const ARGB *, const ARGB *,
+            const uint8_t *, unsigned);
+        void (*divide)(ARGB *, const ARGB *, const ARGB *, unsigned);
+    };
+
+    // the AVX2 version, returns false if not compiled in
+    bool getBatchOpsAVX2(BatchOps & ops);
+
+    namespace {
+        template <typename V>
+        struct BatchKernels
+        {
+            static void blend(ARGB * out, const ARGB * c,
+                const Alpha * a, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    simd::blend(V::load(c + i), V::loadAlpha(a + i))
+                        .store(out + i);
+                }
+                for(; i < n; ++i) out[i] = color::blend(c[i], a[i]);
+            }
+
+            static void multiply(ARGB * out, const ARGB * c1,
+                const ARGB * c2, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    simd::multiply(V::load(c1 + i), V::load(c2 + i))
+                        .store(out + i);
+                }
+                for(; i < n; ++i) out[i] = color::multiply(c1[i], c2[i]);
+            }
+
+            static void clipAdd(ARGB * out, const ARGB * c1,
+                const ARGB * c2, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    simd::clipAdd(V::load(c1 + i), V::load(c2 + i))
+                        .store(out + i);
+                }
+                for(; i < n; ++i) out[i] = color::clipAdd(c1[i], c2[i]);
+            }
+
+            static void AoverB(ARGB * out, const ARGB * a,
+                const ARGB * b, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    simd::AoverB(V::load(a + i), V::load(b + i))
+                        .store(out + i);
+                }
+                for(; i < n; ++i) out[i] = color::AoverB(a[i], b[i]);
+            }
+
+            static void alphaMask(ARGB * out, const ARGB * c0,
+                const ARGB * c1, const Alpha * a, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    simd::alphaMask(V::load(c0 + i), V::load(c1 + i),
+                        V::loadAlpha(a + i)).store(out + i);
+                }
+                for(; i < n; ++i)
+                {
+                    out[i] = color::alphaMask(c0[i], c1[i], a[i]);
+                }
+            }
+
+            static void lerp(ARGB * out, const ARGB * c1,
+                const ARGB * c2, const uint8_t * frac, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    // loadAlpha repeats the bytes, lerp wants just one
+                    V f = simd::srli32<24>(V::loadAlpha(frac + i));
+                    simd::lerp(V::load(c1 + i), V::load(c2 + i), f)
+                        .store(out + i);
+                }
+                for(; i < n; ++i)
+                {
+                    out[i] = color::lerp(c1[i], c2[i], frac[i]);
+                }
+            }
+
+            static void divide(ARGB * out, const ARGB * c1,
+                const ARGB * c2, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    simd::divide(V::load(c1 + i), V::load(c2 + i))
+                        .store(out + i);
+                }
+                for(; i < n; ++i) out[i] = color::divide(c1[i], c2[i]);
+            }
+
+            static BatchOps getOps(const char * name)
+            {
+                BatchOps ops = { name, blend, multiply, clipAdd,
+                    AoverB, alphaMask, lerp, divide };
+                return ops;
+            }
+        };
+    };
+};
@@ -4,12 +4,22 @@
 #include "rect.h"
 #include "render_color.h"
 #include "render_surface.h"
+#include "render_simd.h"
 
 // This implements various paint sources and blending modes.
 //
 
 namespace dust
 {
+    // A horizontal run of pixels [x0, x1) on a single scanline,
+    // either fully opaque (mask is null) or with mask[x-x0] as the
+    // alpha for each pixel x in the span.
+    struct Span
+    {
+        int         x0, x1;
+        const Alpha *mask;
+    };
+
     // IPaint is a low-level interface for CPU painting,
     // see the templated Paint class in RenderContext.
     //
@@ -32,6 +42,29 @@ namespace dust
         virtual void paintRectMask(
             const Rect & r, Alpha * mask, unsigned maskPitch) = 0;
 
+        // paint spans on scanline y, in left-to-right order
+        //
+        // NOTE: like paintRect(..) this expects clipped spans and
+        // it can be called from multiple threads at the same time,
+        // but never for the same scanline
+        //
+        // the default paints each span as a one row rectangle, the
+        // built-in paints override this with a faster version
+        virtual void paintSpans(int y, const Span * spans, unsigned n)
+        {
+            for(unsigned i = 0; i < n; ++i)
+            {
+                const Span & s = spans[i];
+                if(s.x1 <= s.x0) continue;
+
+                Rect r(s.x0, y, s.x1 - s.x0, 1);
+                if(!s.mask) { paintRect(r); continue; }
+
+                // only row y is read, so the pitch doesn't matter
+                paintRectMask(r, const_cast<Alpha*>(s.mask) - s.x0, 0);
+            }
+        }
+
     protected:
         ~IPaint() {}    // cannot be destroyed polymorphically!
     };
@@ -55,12 +88,20 @@ namespace dust
             const Rect *getClipRect() const { return 0; }
         };
 
+        // two color linear gradient from (x0,y0) to (x1,y1)
+        //
+        // the position along the gradient is kept in 16.16 fixed point
+        // as 255*t so that spans can step it with a single addition,
+        // and the colors for each step are computed once per draw
+        //
+        // the parameters can be changed at any time, the colors and
+        // steps are rebuilt from them when they are used the next time
         struct Gradient2
         {
             ARGB    c0, c1;
             float   x0, y0;
             float   dx, dy;
-            float   div;
+            float   div;    // 255 / (dx*dx + dy*dy)
 
             Gradient2(
                 ARGB c0, float x0, float y0,
@@ -69,17 +110,289 @@ namespace dust
                 , x0(x0), y0(y0)
                 , dx(x1-x0), dy(y1-y0)
                 , div(255.f / (dx*dx + dy*dy))
+                , built(false)
             {
             }
 
+            // rebuild the colors and steps if the parameters changed
+            //
+            // painting does this before it starts, so the same gradient
+            // can then be used from several threads; calling color()
+            // from several threads on a gradient that was never painted
+            // needs an update() first
+            void update() const
+            {
+                bool colors = !built || key.c0 != c0 || key.c1 != c1;
+                bool steps = !built || key.x0 != x0 || key.y0 != y0
+                    || key.dx != dx || key.dy != dy || key.div != div;
+
+                // nothing is written unless something changed
+                if(!colors && !steps) return;
+
+                if(colors)
+                {
+                    for(unsigned i = 0; i < 256; ++i)
+                    {
+                        lut[i] = color::alphaMask(c0, c1, Alpha(i));
+                    }
+                }
+
+                if(steps)
+                {
+                    double s = double(div) * (1 << 16);
+                    if(!(s > 0 && s < HUGE_VAL)) s = 0;
+
+                    stepX = int64_t(dx * s);
+                    stepY = int64_t(dy * s);
+                    base = int64_t(-(x0*double(dx) + y0*double(dy)) * s);
+                }
+
+                key.c0 = c0; key.c1 = c1;
+                key.x0 = x0; key.y0 = y0;
+                key.dx = dx; key.dy = dy; key.div = div;
+                built = true;
+            }
+
             ARGB color(int x, int y) const
             {
-                float pf = (div * ((x-x0)*dx + (y-y0)*dy));
-                int p = (int) pf;
-                if(p < 0) p = 0;
-                if(p > 255) p = 255;
+                update();
+                return lut[index(position(x, y))];
+            }
+
+            // colors of n pixels from (x,y), see spanColors() below
+            void spanColors(int x, int y, unsigned n, ARGB * out) const
+            {
+                update();
+
+                int64_t p = position(x, y);
+                for(unsigned i = 0; i < n; ++i, p += stepX)
+                {
+                    out[i] = lut[index(p)];
+                }
+            }
+
+            const Rect *getClipRect() const { return 0; }
+
+        private:
+            // derived from the parameters in key by update()
+            struct Key
+            {
+                ARGB    c0, c1;
+                float   x0, y0, dx, dy, div;
+            };
+
+            mutable Key     key;
+            mutable bool    built;
+
+            mutable ARGB    lut[256];
+            mutable int64_t base, stepX, stepY;
+
+            int64_t position(int x, int y) const
+            {
+                return base + x*stepX + y*stepY;
+            }
+
+            static unsigned index(int64_t p)
+            {
+                p >>= 16;
+                return p < 0 ? 0 : p > 255 ? 255 : unsigned(p);
+            }
+        };
+
+        // color stop for multi-stop gradients, at position [0,1]
+        // along the gradient; the color is premultiplied as usual
+        struct GradientStop
+        {
+            float   pos;
+            ARGB    color;
+        };
+
+        // Lookup table for gradients with any number of stops, which
+        // must be sorted by position. Entry i is the color at the
+        // center of [i/256, (i+1)/256), interpolated in premultiplied
+        // space like Gradient2, so the gradient types below just need
+        // to find an index for each pixel.
+        struct GradientTable
+        {
+            ARGB    lut[256];
+
+            GradientTable(const GradientStop * stops, unsigned nStops)
+            {
+                unsigned s = 0;
+                for(unsigned i = 0; i < 256; ++i)
+                {
+                    float t = (i + .5f) * (1 / 256.f);
+
+                    // find the first stop at or past t
+                    while(s < nStops && stops[s].pos < t) ++s;
+
+                    if(!nStops) lut[i] = 0;
+                    else if(!s) lut[i] = stops[0].color;
+                    else if(s == nStops) lut[i] = stops[s-1].color;
+                    else
+                    {
+                        const GradientStop & a = stops[s-1];
+                        const GradientStop & b = stops[s];
+
+                        // a.pos < t <= b.pos so this never divides by 0
+                        float f = (t - a.pos) / (b.pos - a.pos);
+                        lut[i] = color::alphaMask(
+                            a.color, b.color, Alpha(f * 255 + .5f));
+                    }
+                }
+            }
+        };
+
+        // linear gradient with any number of stops from (x0,y0) to
+        // (x1,y1), clamping to the end colors outside the range
+        //
+        // like Gradient2 this steps in fixed point, here as 256*t
+        struct LinearGradient : GradientTable
+        {
+            int64_t base, stepX, stepY;
+
+            LinearGradient(float x0, float y0, float x1, float y1,
+                const GradientStop * stops, unsigned nStops)
+                : GradientTable(stops, nStops)
+            {
+                double dx = x1-x0, dy = y1-y0, d2 = dx*dx + dy*dy;
+                double s = d2 > 0 ? (256 << 16) / d2 : 0;
+
+                stepX = int64_t(dx * s);
+                stepY = int64_t(dy * s);
+                base = int64_t(-(x0*dx + y0*dy) * s);
+            }
+
+            int64_t position(int x, int y) const
+            {
+                return base + x*stepX + y*stepY;
+            }
+
+            static unsigned index(int64_t p)
+            {
+                p >>= 16;
+                return p < 0 ? 0 : p > 255 ? 255 : unsigned(p);
+            }
 
-                return color::alphaMask(c0, c1, p);
+            ARGB color(int x, int y) const
+            {
+                return lut[index(position(x, y))];
+            }
+
+            const Rect *getClipRect() const { return 0; }
+        };
+
+        // radial gradient with stops from the center (t = 0) to
+        // the given radius (t = 1), clamping outside
+        //
+        // indexes are computed with the same operations one pixel at a
+        // time in color() and four at a time with SSE in spans
+        struct RadialGradient : GradientTable
+        {
+            float   cx, cy;
+            float   scale;
+
+            RadialGradient(float cx, float cy, float radius,
+                const GradientStop * stops, unsigned nStops)
+                : GradientTable(stops, nStops), cx(cx), cy(cy)
+                , scale(radius > 0 ? 256 / radius : 0)
+            {
+            }
+
+            unsigned index(float fx, float fy) const
+            {
+                float p = sqrtf(fx*fx + fy*fy) * scale;
+                return unsigned(p < 255 ? p : 255);
+            }
+
+            __m128i index4(__m128 fx, __m128 fy) const
+            {
+                __m128 d2 = _mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy));
+                __m128 p = _mm_mul_ps(_mm_sqrt_ps(d2), _mm_set1_ps(scale));
+                return _mm_cvttps_epi32(_mm_min_ps(p, _mm_set1_ps(255)));
+            }
+
+            ARGB color(int x, int y) const
+            {
+                return lut[index(x - cx, y - cy)];
+            }
+
+            const Rect *getClipRect() const { return 0; }
+        };
+
+        // conic (sweep) gradient around a center, with t going from
+        // 0 to 1 clockwise (with y down) starting from the given angle
+        // in radians; the gradient wraps so the last stop is usually
+        // the same color as the first
+        //
+        // the angle uses a polynomial for atan on [0,1] and the octant
+        // symmetries, with error well below one table entry; like the
+        // radial gradient, spans do the same thing four pixels at a time
+        struct ConicGradient : GradientTable
+        {
+            float   cx, cy;
+            float   offset;     // start angle as [0,256)
+
+            ConicGradient(float cx, float cy, float angle,
+                const GradientStop * stops, unsigned nStops)
+                : GradientTable(stops, nStops), cx(cx), cy(cy)
+            {
+                offset = angle * (256 / (2 * 3.14159265f));
+                offset -= 256 * floorf(offset * (1 / 256.f));
+            }
+
+            unsigned index(float x, float y) const
+            {
+                float ax = fabsf(x), ay = fabsf(y);
+                float mx = ax > ay ? ax : ay;
+                float mn = ax > ay ? ay : ax;
+
+                float q = mn / (mx > 1e-30f ? mx : 1e-30f), q2 = q*q;
+                float a = q * (40.5544f - q2 * (11.7618f - q2 * 3.2322f));
+
+                if(ay > ax) a = 64 - a;
+                if(x < 0) a = 128 - a;
+                if(y < 0) a = 256 - a;
+
+                // a - offset is in (-256, 256] so this truncates up
+                return unsigned(a - offset + 256) & 0xff;
+            }
+
+            __m128i index4(__m128 x, __m128 y) const
+            {
+                __m128 sign = _mm_set1_ps(-0.f);
+                __m128 ax = _mm_andnot_ps(sign, x);
+                __m128 ay = _mm_andnot_ps(sign, y);
+                __m128 mx = _mm_max_ps(ax, ay);
+                __m128 mn = _mm_min_ps(ax, ay);
+
+                __m128 q = _mm_div_ps(mn,
+                    _mm_max_ps(mx, _mm_set1_ps(1e-30f)));
+                __m128 q2 = _mm_mul_ps(q, q);
+                __m128 a = _mm_sub_ps(_mm_set1_ps(11.7618f),
+                    _mm_mul_ps(q2, _mm_set1_ps(3.2322f)));
+                a = _mm_sub_ps(_mm_set1_ps(40.5544f), _mm_mul_ps(q2, a));
+                a = _mm_mul_ps(q, a);
+
+                __m128 m = _mm_cmpgt_ps(ay, ax);
+                a = _mm_or_ps(_mm_andnot_ps(m, a),
+                    _mm_and_ps(m, _mm_sub_ps(_mm_set1_ps(64), a)));
+                m = _mm_cmplt_ps(x, _mm_setzero_ps());
+                a = _mm_or_ps(_mm_andnot_ps(m, a),
+                    _mm_and_ps(m, _mm_sub_ps(_mm_set1_ps(128), a)));
+                m = _mm_cmplt_ps(y, _mm_setzero_ps());
+                a = _mm_or_ps(_mm_andnot_ps(m, a),
+                    _mm_and_ps(m, _mm_sub_ps(_mm_set1_ps(256), a)));
+
+                a = _mm_add_ps(_mm_sub_ps(a, _mm_set1_ps(offset)),
+                    _mm_set1_ps(256));
+                return _mm_and_si128(_mm_cvttps_epi32(a),
+                    _mm_set1_epi32(0xff));
+            }
+
+            ARGB color(int x, int y) const
+            {
+                return lut[index(x - cx, y - cy)];
             }
 
             const Rect *getClipRect() const { return 0; }
@@ -115,6 +428,231 @@ namespace dust
             }
         };
 
+        // Draw a surface with an arbitrary affine transform, using the
+        // same matrix convention as TransformPath (ie. from surface to
+        // context coordinates):
+        //
+        //   x' = ax*x + ay*y + az
+        //   y' = bx*x + by*y + bz
+        //
+        // Pixels are bilinearly filtered with color::lerp, and when
+        // scaling down by more than a factor of two the source comes
+        // from a mip level of the surface (unless mipmap is false).
+        // Samples are clamped at the edges of the surface and pixels
+        // with centers outside of it are transparent.
+        //
+        // NOTE: the surface (and mip level) is fixed at construction
+        // so this must not be resized while the paint source is used
+        struct ScaledImage
+        {
+            Surface &surface;
+            Rect    srcClip;
+
+            // 16.16 position in surface pixel centers at context (0,0)
+            // and the steps for each pixel in x and y
+            int64_t u0, v0, uX, vX, uY, vY;
+            int64_t uMax, vMax;
+
+            // scale, then offset the surface origin to (offX, offY)
+            ScaledImage(Surface & src, float scale,
+                float offX = 0, float offY = 0, bool mipmap = true)
+                : ScaledImage(src, scale, 0, offX, 0, scale, offY, mipmap)
+            {
+            }
+
+            // general case
+            ScaledImage(Surface & src,
+                float ax, float ay, float az,
+                float bx, float by, float bz, bool mipmap = true)
+                : surface(src.getMip(mipLevel(ax, ay, bx, by, mipmap)))
+            {
+                float w = float(src.getSizeX()), h = float(src.getSizeY());
+
+                // bounding box of the transformed surface
+                float cx[4] = { 0, w, 0, w }, cy[4] = { 0, 0, h, h };
+                float x0 = HUGE_VALF, y0 = HUGE_VALF;
+                float x1 = -HUGE_VALF, y1 = -HUGE_VALF;
+                for(int i = 0; i < 4; ++i)
+                {
+                    float x = ax*cx[i] + ay*cy[i] + az;
+                    float y = bx*cx[i] + by*cy[i] + bz;
+                    x0 = (std::min)(x0, x); x1 = (std::max)(x1, x);
+                    y0 = (std::min)(y0, y); y1 = (std::max)(y1, y);
+                }
+                srcClip.x0 = int(floorf(x0)); srcClip.x1 = int(ceilf(x1));
+                srcClip.y0 = int(floorf(y0)); srcClip.y1 = int(ceilf(y1));
+
+                // inverse transform, scaled to the mip level
+                double det = double(ax)*by - double(ay)*bx;
+                double sx = w ? surface.getSizeX() / w : 0;
+                double sy = h ? surface.getSizeY() / h : 0;
+
+                double ia = 0, ib = 0, ic = 0, id = 0;
+                if(det)
+                {
+                    ia = sx * by / det; ib = -sx * ay / det;
+                    ic = -sy * bx / det; id = sy * ax / det;
+                }
+
+                // the center of context pixel (x,y) maps to the position
+                // inverse(x + .5 - az, y + .5 - bz) in the surface where
+                // pixel centers are at .5 so subtract that too
+                double px = .5 - az, py = .5 - bz;
+                double one = 65536;
+                u0 = int64_t((ia*px + ib*py - .5) * one);
+                v0 = int64_t((ic*px + id*py - .5) * one);
+                uX = int64_t(ia * one); uY = int64_t(ib * one);
+                vX = int64_t(ic * one); vY = int64_t(id * one);
+
+                // positions outside [-.5, size - .5) are outside
+                uMax = int64_t(surface.getSizeX()) << 16;
+                vMax = int64_t(surface.getSizeY()) << 16;
+            }
+
+            // each mip level halves the size, so pick the last one that
+            // is still at least as large as the result
+            static unsigned mipLevel(
+                float ax, float ay, float bx, float by, bool mipmap)
+            {
+                unsigned level = 0;
+                float area = fabsf(ax*by - ay*bx);
+                while(mipmap && area > 0 && area <= .25f)
+                {
+                    ++level; area *= 4;
+                }
+                return level;
+            }
+
+            const Rect * getClipRect() const { return &srcClip; }
+
+            // bilinear sample at 16.16 position (u,v)
+            ARGB sample(int64_t u, int64_t v) const
+            {
+                // shift by half a pixel so that this is never negative
+                u += 0x8000; v += 0x8000;
+                if(uint64_t(u) >= uint64_t(uMax)
+                || uint64_t(v) >= uint64_t(vMax)) return 0;
+                u -= 0x8000; v -= 0x8000;
+
+                const ARGB * p[2];
+                unsigned x[2], fx, fy;
+                coords(u, v, p, x, fx, fy);
+
+                return color::lerp(
+                    color::lerp(p[0][x[0]], p[0][x[1]], fx),
+                    color::lerp(p[1][x[0]], p[1][x[1]], fx), fy);
+            }
+
+            // columns to interpolate, clamped to the surface
+            void column(int64_t u,
+                unsigned & x0, unsigned & x1, unsigned & fx) const
+            {
+                int iu = int(u >> 16), xMax = int(uMax >> 16) - 1;
+                fx = unsigned(u >> 8) & 0xff;
+                x0 = unsigned(iu < 0 ? 0 : iu);
+                x1 = unsigned(iu < xMax ? iu + 1 : xMax);
+            }
+
+            // rows and columns to interpolate, clamped to the surface
+            void coords(int64_t u, int64_t v, const ARGB * p[2],
+                unsigned x[2], unsigned & fx, unsigned & fy) const
+            {
+                column(u, x[0], x[1], fx);
+
+                int iv = int(v >> 16), yMax = int(vMax >> 16) - 1;
+                fy = unsigned(v >> 8) & 0xff;
+                unsigned y0 = unsigned(iv < 0 ? 0 : iv);
+                unsigned y1 = unsigned(iv < yMax ? iv + 1 : yMax);
+
+                ARGB * pixels = surface.getPixels();
+                p[0] = pixels + y0 * surface.getPitch();
+                p[1] = pixels + y1 * surface.getPitch();
+            }
+
+            ARGB color(int x, int y) const
+            {
+                return sample(u0 + x*uX + y*uY, v0 + x*vX + y*vY);
+            }
+        };
+
+        // Nine-slice drawing of a surface into the rectangle (x,y,w,h)
+        // where the insets give the borders of the surface which are
+        // copied as-is to the corners and edges of the rectangle, while
+        // the rest is stretched (nearest neighbour) or tiled to fill the
+        // space in between; if the rectangle is smaller than the borders
+        // then the borders are cropped in proportion
+        //
+        // This lets widgets render their chrome into a surface once and
+        // then draw it at any size with just copies.
+        struct NineSlice
+        {
+            // mapping from target to surface along one axis
+            struct Axis
+            {
+                int     dSize, dLeft, dRight;   // target size and borders
+                int     sSize, sLeft;           // surface size and border
+                int     sCenter, dCenter;       // size of the middle parts
+                int64_t step;                   // 16.16 surface per target
+                bool    tile;
+
+                Axis(int dst, int src, int l, int r, bool tile)
+                    : tile(tile)
+                {
+                    l = (std::max)(0, (std::min)(l, src));
+                    r = (std::max)(0, (std::min)(r, src - l));
+
+                    dSize = (std::max)(0, dst);
+                    sSize = src;
+                    sLeft = l;
+                    sCenter = src - l - r;
+
+                    if(dSize < l + r)
+                    {
+                        dLeft = (l + r) ? dSize * l / (l + r) : 0;
+                        dRight = dSize - dLeft;
+                    }
+                    else { dLeft = l; dRight = r; }
+
+                    dCenter = dSize - dLeft - dRight;
+                    step = dCenter ? (int64_t(sCenter) << 16) / dCenter : 0;
+                }
+
+                // surface position for target position d in [0, dSize)
+                int map(int d) const
+                {
+                    if(d < dLeft) return d;
+                    if(d >= dSize - dRight) return sSize - (dSize - d);
+
+                    // no middle in the surface, repeat the left border
+                    if(!sCenter) return sLeft ? sLeft - 1 : 0;
+
+                    int c = d - dLeft;
+                    if(tile) return sLeft + c % sCenter;
+                    return sLeft + int((c * step + (step >> 1)) >> 16);
+                }
+            };
+
+            Surface &surface;
+            Rect    dst;
+            Axis    ax, ay;
+
+            NineSlice(Surface & src, int x, int y, int w, int h,
+                int left, int top, int right, int bottom, bool tile = false)
+                : surface(src), dst(x, y, w, h)
+                , ax(w, src.getSizeX(), left, right, tile)
+                , ay(h, src.getSizeY(), top, bottom, tile)
+            {
+            }
+
+            const Rect * getClipRect() const { return &dst; }
+
+            ARGB color(int x, int y) const
+            {
+                return surface.getPixels()[ax.map(x - dst.x0)
+                    + ay.map(y - dst.y0) * surface.getPitch()];
+            }
+        };
+
         struct ColorMask
         {
             Alpha   *mask;
@@ -137,12 +675,269 @@ namespace dust
                     mask[(x+srcClip.x0)+(y+srcClip.y0)*pitch]);
             }
         };
-        
+
+        // spanColors(src, x, y, n, out) stores the colors of pixels
+        // from (x,y) to (x+n-1,y) into out, so that spans can be blended
+        // with SIMD; the generic version just calls color() per pixel
+        // and paint sources can overload this with something faster
+        template <typename PaintSource>
+        static inline void spanColors(const PaintSource & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            for(unsigned i = 0; i < n; ++i) out[i] = src.color(x+i, y);
+        }
+
+        static inline void spanColors(const Color & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            for(unsigned i = 0; i < n; ++i) out[i] = src.argb;
+        }
+
+        // returns true and sets c if the source is a single color
+        template <typename PaintSource>
+        static inline bool solidColor(const PaintSource & src, ARGB & c)
+        {
+            return false;
+        }
+
+        static inline bool solidColor(const Color & src, ARGB & c)
+        {
+            c = src.argb; return true;
+        }
+
+        // prepare(src) is called once before painting starts, so that
+        // paint sources can build anything they need before the rows
+        // are possibly painted from several threads
+        template <typename PaintSource>
+        static inline void prepare(const PaintSource & src)
+        {
+        }
+
+        static inline void prepare(const Gradient2 & src)
+        {
+            src.update();
+        }
+
+        static inline void spanColors(const Gradient2 & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            src.spanColors(x, y, n, out);
+        }
+
+        static inline void spanColors(const LinearGradient & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            int64_t p = src.position(x, y);
+            for(unsigned i = 0; i < n; ++i, p += src.stepX)
+            {
+                out[i] = src.lut[src.index(p)];
+            }
+        }
+
+        // radial and conic gradients compute four indexes at a time
+        template <typename Gradient>
+        static inline void spanColors4(const Gradient & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            float fy = y - src.cy;
+
+            __m128i vi = _mm_add_epi32(_mm_set1_epi32(x),
+                _mm_setr_epi32(0, 1, 2, 3));
+            __m128 vy = _mm_set1_ps(fy);
+
+            unsigned i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                __m128 vx = _mm_sub_ps(_mm_cvtepi32_ps(vi),
+                    _mm_set1_ps(src.cx));
+                vi = _mm_add_epi32(vi, _mm_set1_epi32(4));
+
+                alignas(16) uint32_t idx[4];
+                _mm_store_si128((__m128i*) idx, src.index4(vx, vy));
+
+                out[i+0] = src.lut[idx[0]];
+                out[i+1] = src.lut[idx[1]];
+                out[i+2] = src.lut[idx[2]];
+                out[i+3] = src.lut[idx[3]];
+            }
+            for(; i < n; ++i) out[i] = src.color(x + i, y);
+        }
+
+        static inline void spanColors(const RadialGradient & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            spanColors4(src, x, y, n, out);
+        }
+
+        static inline void spanColors(const ConicGradient & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            spanColors4(src, x, y, n, out);
+        }
+
+        static inline void spanColors(const Image & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            Surface & s = src.surface;
+            memcpy(out, s.getPixels() + (x - src.offsetX)
+                + (y - src.offsetY) * s.getPitch(), n * sizeof(ARGB));
+        }
+
+        // copies the borders and tiles of the middle as whole runs
+        static inline void spanColors(const NineSlice & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            const NineSlice::Axis & ax = src.ax;
+            const ARGB * row = src.surface.getPixels()
+                + src.ay.map(y - src.dst.y0) * src.surface.getPitch();
+
+            int d = x - src.dst.x0, end = d + int(n);
+            int cEnd = ax.dSize - ax.dRight;
+            while(d < end)
+            {
+                // runs that map to consecutive surface pixels
+                int run = d < ax.dLeft ? ax.dLeft - d
+                    : d >= cEnd ? end - d
+                    : (ax.tile && ax.sCenter) ? (std::min)(cEnd - d,
+                        ax.sCenter - (d - ax.dLeft) % ax.sCenter) : 0;
+
+                if(run)
+                {
+                    run = (std::min)(run, end - d);
+                    memcpy(out, row + ax.map(d), run * sizeof(ARGB));
+                    out += run; d += run;
+                    continue;
+                }
+
+                // stretched middle, stepping like Axis::map()
+                int stop = (std::min)(end, cEnd);
+                if(!ax.sCenter)
+                {
+                    ARGB c = row[ax.map(d)];
+                    for(; d < stop; ++d) *out++ = c;
+                    continue;
+                }
+
+                const ARGB * mid = row + ax.sLeft;
+                int64_t p = (d - ax.dLeft) * ax.step + (ax.step >> 1);
+                for(; d < stop; ++d, p += ax.step) *out++ = mid[p >> 16];
+            }
+        }
+
+        static inline simd::Vec4 gather4(const ARGB * p, const unsigned * x)
+        {
+            return simd::Vec4::make(_mm_setr_epi32(
+                int(p[x[0]]), int(p[x[1]]), int(p[x[2]]), int(p[x[3]])));
+        }
+
+        // interpolates four pixels at a time with simd::lerp
+        //
+        // without rotation the rows are the same for the whole span,
+        // so that case only needs to find the columns for each pixel
+        static inline void spanColors(const ScaledImage & src,
+            int x, int y, unsigned n, ARGB * out)
+        {
+            int64_t u = src.u0 + x*src.uX + y*src.uY;
+            int64_t v = src.v0 + x*src.vX + y*src.vY;
+
+            if(!src.vX)
+            {
+                if(uint64_t(v + 0x8000) >= uint64_t(src.vMax))
+                {
+                    memset(out, 0, n * sizeof(ARGB));
+                    return;
+                }
+
+                const ARGB * p[2];
+                unsigned sx[2], fx, fy;
+                src.coords(0, v, p, sx, fx, fy);
+                simd::Vec4 vfy = simd::Vec4::set1(fy);
+
+                unsigned i = 0;
+                for(; i + 4 <= n; i += 4)
+                {
+                    // only take the fast path if all four are inside
+                    int64_t uEnd = u + 3*src.uX;
+                    if(uint64_t(u + 0x8000) >= uint64_t(src.uMax)
+                    || uint64_t(uEnd + 0x8000) >= uint64_t(src.uMax))
+                    {
+                        for(unsigned k = 0; k < 4; ++k, u += src.uX)
+                        {
+                            out[i+k] = src.sample(u, v);
+                        }
+                        continue;
+                    }
+
+                    unsigned x0[4], x1[4], f[4];
+                    for(unsigned k = 0; k < 4; ++k, u += src.uX)
+                    {
+                        src.column(u, x0[k], x1[k], f[k]);
+                    }
+
+                    simd::Vec4 vfx = simd::Vec4::make(_mm_setr_epi32(
+                        int(f[0]), int(f[1]), int(f[2]), int(f[3])));
+                    simd::Vec4 top = simd::lerp(
+                        gather4(p[0], x0), gather4(p[0], x1), vfx);
+                    simd::Vec4 bottom = simd::lerp(
+                        gather4(p[1], x0), gather4(p[1], x1), vfx);
+                    simd::lerp(top, bottom, vfy).store(out + i);
+                }
+
+                for(; i < n; ++i, u += src.uX) out[i] = src.sample(u, v);
+                return;
+            }
+
+            unsigned i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                ARGB c[4][4];
+                unsigned fx[4], fy[4];
+
+                for(unsigned k = 0; k < 4; ++k, u += src.uX, v += src.vX)
+                {
+                    if(uint64_t(u + 0x8000) >= uint64_t(src.uMax)
+                    || uint64_t(v + 0x8000) >= uint64_t(src.vMax))
+                    {
+                        c[0][k] = c[1][k] = c[2][k] = c[3][k] = 0;
+                        fx[k] = fy[k] = 0;
+                        continue;
+                    }
+
+                    const ARGB * p[2];
+                    unsigned sx[2];
+                    src.coords(u, v, p, sx, fx[k], fy[k]);
+
+                    c[0][k] = p[0][sx[0]]; c[1][k] = p[0][sx[1]];
+                    c[2][k] = p[1][sx[0]]; c[3][k] = p[1][sx[1]];
+                }
+
+                simd::Vec4 vfx = simd::Vec4::make(_mm_setr_epi32(
+                    int(fx[0]), int(fx[1]), int(fx[2]), int(fx[3])));
+                simd::Vec4 vfy = simd::Vec4::make(_mm_setr_epi32(
+                    int(fy[0]), int(fy[1]), int(fy[2]), int(fy[3])));
+
+                simd::Vec4 top = simd::lerp(simd::Vec4::load(c[0]),
+                    simd::Vec4::load(c[1]), vfx);
+                simd::Vec4 bottom = simd::lerp(simd::Vec4::load(c[2]),
+                    simd::Vec4::load(c[3]), vfx);
+                simd::lerp(top, bottom, vfy).store(out + i);
+            }
+
+            for(; i < n; ++i, u += src.uX, v += src.vX)
+            {
+                out[i] = src.sample(u, v);
+            }
+        }
     };
 
     // Blending classes, put them in a sub-namespace
     //
     // these should implement a single function "blend()" as below
+    //
+    // optionally there can also be a template version of blend() that
+    // takes simd::Vec4 or Vec8 (see render_simd.h) to blend several
+    // pixels at a time, which must give the same results as the scalar
+    // version; without one, spans are blended one pixel at a time
     namespace blend
     {
         // no blending, just replace dst with src
@@ -152,6 +947,12 @@ namespace dust
             {
                 return src;
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return src;
+            }
         };
 
         // add src and dst
@@ -161,6 +962,12 @@ namespace dust
             {
                 return color::clipAdd(src, dst);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::clipAdd(src, dst);
+            }
         };
 
         // src over dst, standard blending
@@ -171,6 +978,12 @@ namespace dust
             {
                 return color::AoverB(src, dst);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::AoverB(src, dst);
+            }
         };
         
         // dst over src, reverse blending
@@ -181,6 +994,12 @@ namespace dust
             {
                 return color::AoverB(dst, src);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::AoverB(dst, src);
+            }
         };
 
         // multiply src and dst
@@ -191,6 +1010,12 @@ namespace dust
             {
                 return color::multiply(src, dst);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::multiply(src, dst);
+            }
         };
 
         // inverse multiply src and dst (=1-(1-src)*(1-dst))
@@ -201,6 +1026,12 @@ namespace dust
                 // bitwise negation is equivalent to 1-x
                 return ~color::multiply(~src, ~dst);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return ~simd::multiply(~src, ~dst);
+            }
         };
 
         // multiply dst with inverse src alpha (ignore src color)
@@ -210,6 +1041,12 @@ namespace dust
             {
                 return color::blend(dst, (~src)>>24);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::blend(dst, ~simd::alpha(src));
+            }
         };
 
         // multiply dst with source alpha
@@ -219,6 +1056,12 @@ namespace dust
             {
                 return color::blend(dst, src>>24);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::blend(dst, simd::alpha(src));
+            }
         };
 
         // this takes src color, multiplies by dst alpha
@@ -230,6 +1073,12 @@ namespace dust
             {
                 return color::blend((0xff<<24)|src, dst>>24);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::blend(V::set1(0xff<<24) | src, simd::alpha(dst));
+            }
         };
 
         // this does "over" blending with src alpha and black color
@@ -239,6 +1088,12 @@ namespace dust
             {
                 return color::AoverB(src & (0xff<<24), dst);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::AoverB(src & V::set1(0xff<<24), dst);
+            }
         };
         
         // this does "under" blending with src alpha and black color
@@ -248,6 +1103,12 @@ namespace dust
             {
                 return color::AoverB(dst, src & (0xff<<24));
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                return simd::AoverB(dst, src & V::set1(0xff<<24));
+            }
         };
 
         // does screen blend, but clips to dst alpha
@@ -258,6 +1119,13 @@ namespace dust
                 src = color::blend(0xffffff&src, dst>>24);
                 return ~color::multiply(~dst, ~src);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                src = simd::blend(src & V::set1(0xffffff), simd::alpha(dst));
+                return ~simd::multiply(~dst, ~src);
+            }
         };
 
         // uses src color as light on dst, clipping to dst
@@ -269,8 +1137,29 @@ namespace dust
                 ARGB c = color::multiply(dst, src|(0xff<<24));
                 return color::clipAdd(c, c);
             }
+
+            template <typename V>
+            static V blend(V dst, V src)
+            {
+                V c = simd::multiply(dst, src | V::set1(0xff<<24));
+                return simd::clipAdd(c, c);
+            }
         };
 
+
+        // isStore<Blend>::test(c) returns true if blending the color c
+        // always gives c, so that a solid color can be stored directly
+        template <typename Blend>
+        struct isStore { static bool test(ARGB c) { return false; } };
+
+        template <>
+        struct isStore<None> { static bool test(ARGB c) { return true; } };
+
+        template <>
+        struct isStore<Over>
+        {
+            static bool test(ARGB c) { return (c >> 24) == 0xff; }
+        };
     };
 
 }; // namespace
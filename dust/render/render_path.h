@@ -886,6 +886,48 @@ namespace dust
         FILL_NONZERO = ~0
     };
 
+    // Quality is normally the number of sample bits for supersampling
+    // from 0 (1 sample per pixel) to 4 (256 samples per pixel).
+    //
+    // Passing QUALITY_ANALYTIC instead computes the exact area covered
+    // in each pixel, with results comparable to quality 4 but roughly
+    // as fast as quality 1. Overlapping contours within one pixel are
+    // only approximated though, so supersampling is more accurate for
+    // complex self-intersecting shapes.
+    enum { QUALITY_ANALYTIC = -1 };
+
+    // Memory that the rasterizer keeps between calls, so that it
+    // doesn't need to allocate anything once the buffers have grown
+    // large enough. RenderContext keeps one of these (along with the
+    // alpha mask) and MaskDataBorrow passes it from parent to child.
+    //
+    // The contents are private to raster_ref.cpp and allocated on
+    // first use. This can't be shared between threads.
+    struct RasterScratch
+    {
+        RasterScratch() : data(0) {}
+        ~RasterScratch();
+
+        RasterScratch(RasterScratch const &) = delete;
+
+        void swap(RasterScratch & other) { std::swap(data, other.data); }
+
+        // returns a mask buffer with space for at least size values
+        uint8_t * getMask(unsigned size);
+
+        // internal: the actual buffers
+        struct Data;
+        Data & getData();
+
+    private:
+        Data    *data;
+    };
+
+    // Returns the number of times the rasterizer has allocated memory
+    // (or grown a buffer) since startup, for checking that drawing
+    // with a persistent RasterScratch has no steady-state allocations.
+    unsigned getRasterAllocCount();
+
     // reference rasterizer, see raster_ref.cpp
     // one should normally just let RenderContext call this
     //
@@ -896,14 +938,76 @@ namespace dust
     //
     // vScan uses vertical scanlines (faster for horiz plots)
     //
+    // scratch is optional, without it temporary buffers are allocated
+    //
     // returns true if something was drawn, false if not (eg. fully clipped)
     //
     bool renderPathRef(Path &p, Rect & clip, FillRule fill,
-        uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan);
+        uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan,
+        RasterScratch * scratch = 0);
 
     // this will draw strokes without explicitly storing the stroke
     bool strokePathRef(Path &p, float width, Rect & clip,
-        uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan);
+        uint8_t * maskOut, unsigned maskPitch, int quality, bool vScan,
+        RasterScratch * scratch = 0);
+
+    struct IPaint;
+
+    // Span output versions of the above: instead of writing every pixel
+    // of the clipping rectangle into a mask, each scanline is sent to
+    // paint.paintSpans() as runs of opaque and masked pixels, skipping
+    // anything empty. Spans are offset by (offX, offY) for the paint.
+    //
+    // These always use horizontal scanlines.
+    bool renderPathSpans(Path &p, Rect & clip, FillRule fill,
+        IPaint & paint, int offX, int offY, int quality,
+        RasterScratch * scratch = 0);
+
+    bool strokePathSpans(Path &p, float width, Rect & clip,
+        IPaint & paint, int offX, int offY, int quality,
+        RasterScratch * scratch = 0);
+
+    // Hairlines: thin strokes drawn directly from the distance to each
+    // line segment, instead of rasterizing the outline of the stroke.
+    // This is much faster for long polylines like plots, and the result
+    // is very close to strokePath() with round joins and caps, but it
+    // only looks right for thin lines, see hairlineMaxWidth.
+    //
+    // Quality doesn't apply, the coverage is always analytic.
+    // Otherwise these work like strokePathRef() and strokePathSpans().
+    bool strokeHairlineRef(Path &p, float width, Rect & clip,
+        uint8_t * maskOut, unsigned maskPitch,
+        RasterScratch * scratch = 0);
+
+    bool strokeHairlineSpans(Path &p, float width, Rect & clip,
+        IPaint & paint, int offX, int offY,
+        RasterScratch * scratch = 0);
+
+    // RenderContext draws strokes up to this width as hairlines
+    static const float hairlineMaxWidth = 2.f;
+
+    struct ThreadPool;
+
+    // If a thread pool is set, then paths covering a large area are split
+    // into bands that are rasterized in parallel (small paths are always
+    // rasterized serially). The output is identical either way. The same
+    // goes for the filters of large surfaces (see Surface::blur).
+    //
+    // The pool must outlive any rendering; set to null to disable.
+    // Application does this automatically with a pool of its own.
+    void setRenderThreadPool(ThreadPool * pool);
+
+    // Paths with a smaller (clipped bounding box) area than this and
+    // filters of surfaces with a smaller area are always done serially.
+    //
+    // Larger ones can be drawn from the pool's own workers too (eg. in
+    // an ImageLoader job), the helper tasks are queued reentrantly and
+    // the calling thread does whatever the pool doesn't get to.
+    static const int renderParallelMinArea = 256*256;
+
+    // The pool set with setRenderThreadPool() or null if there is none,
+    // for other rendering code that splits work the same way.
+    ThreadPool * getRenderThreadPool();
 
 
 }; // namespace
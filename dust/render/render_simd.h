@@ -0,0 +1,481 @@
+#pragma once
+
+#include <cstring>
+
+#include "dust/core/defs.h"
+#include "render_color.h"
+
+// SIMD versions of the color operations, for blending spans of pixels.
+//
+// Vec4 holds four pixels (SSE2, or NEON through sse2neon) and Vec8 holds
+// eight (AVX2, only when compiling with AVX2 enabled). Both have the same
+// set of operations, so the higher level functions are written once as
+// templates, and blend:: types (see render_paint.h) can do the same.
+//
+// All of these give results identical to the scalar functions in
+// render_color.h (the 64-bit paths), so vector and scalar code can be
+// mixed freely (eg. for the tails of spans).
+//
+namespace dust
+{
+    namespace simd
+    {
+    // The same functions compile to different code with AVX2 enabled, so
+    // they go in a namespace named after the instruction set, otherwise
+    // the linker could pick the AVX2 copy of something that didn't get
+    // inlined for code that is meant to run without (see render_batch.h).
+#if defined(__AVX2__)
+    inline namespace avx2 {
+#else
+    inline namespace sse2 {
+#endif
+        struct Vec4
+        {
+            __m128i v;
+
+            static const unsigned size = 4;
+
+            static Vec4 make(__m128i v) { Vec4 r = { v }; return r; }
+
+            static Vec4 load(const ARGB * p)
+            { return make(_mm_loadu_si128((const __m128i*) p)); }
+
+            void store(ARGB * p) const
+            { _mm_storeu_si128((__m128i*) p, v); }
+
+            static Vec4 set1(uint32_t x)
+            { return make(_mm_set1_epi32(int(x))); }
+
+            static Vec4 set1_64(uint64_t x)
+            { return make(_mm_set1_epi64x(int64_t(x))); }
+
+            // alpha values with each repeated in all bytes of a pixel
+            static Vec4 loadAlpha(const Alpha * a)
+            {
+                uint32_t a4; memcpy(&a4, a, 4);
+                __m128i x = _mm_cvtsi32_si128(int(a4));
+                x = _mm_unpacklo_epi8(x, x);
+                return make(_mm_unpacklo_epi16(x, x));
+            }
+
+            // per-byte (c*a + 128) >> 8, this is what color::blend does
+            static Vec4 mulBytes(Vec4 c, Vec4 a)
+            {
+                const __m128i zero = _mm_setzero_si128();
+                const __m128i round = _mm_set1_epi16(0x80);
+
+                __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(c.v, zero),
+                    _mm_unpacklo_epi8(a.v, zero));
+                __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(c.v, zero),
+                    _mm_unpackhi_epi8(a.v, zero));
+
+                lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+                hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+                return make(_mm_packus_epi16(lo, hi));
+            }
+
+            // per-byte min(255, c*255 / max(1, d)), see color::divide
+            static Vec4 divBytes(Vec4 c, Vec4 d)
+            {
+                const __m128i zero = _mm_setzero_si128();
+
+                __m128i c16[2] = { _mm_unpacklo_epi8(c.v, zero),
+                    _mm_unpackhi_epi8(c.v, zero) };
+                __m128i d16[2] = { _mm_unpacklo_epi8(d.v, zero),
+                    _mm_unpackhi_epi8(d.v, zero) };
+
+                __m128i q16[2];
+                for(int i = 0; i < 2; ++i)
+                {
+                    q16[i] = _mm_packs_epi32(
+                        divWords(_mm_unpacklo_epi16(c16[i], zero),
+                            _mm_unpacklo_epi16(d16[i], zero)),
+                        divWords(_mm_unpackhi_epi16(c16[i], zero),
+                            _mm_unpackhi_epi16(d16[i], zero)));
+                }
+                return make(_mm_packus_epi16(q16[0], q16[1]));
+            }
+
+        private:
+            // the quotients are exact after truncation, since they are
+            // never closer than 1/65025 (relative) to the next integer
+            static __m128i divWords(__m128i c, __m128i d)
+            {
+                __m128 n = _mm_mul_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(255));
+                __m128 q = _mm_div_ps(n, _mm_max_ps(_mm_cvtepi32_ps(d),
+                    _mm_set1_ps(1)));
+                return _mm_cvttps_epi32(q);
+            }
+        };
+
+        static inline Vec4 operator&(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_and_si128(a.v, b.v)); }
+        static inline Vec4 operator|(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_or_si128(a.v, b.v)); }
+        static inline Vec4 operator^(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_xor_si128(a.v, b.v)); }
+        static inline Vec4 operator~(Vec4 a)
+        { return Vec4::make(_mm_xor_si128(a.v, _mm_set1_epi32(-1))); }
+
+        static inline Vec4 add32(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_add_epi32(a.v, b.v)); }
+        static inline Vec4 sub32(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_sub_epi32(a.v, b.v)); }
+        static inline Vec4 add64(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_add_epi64(a.v, b.v)); }
+        static inline Vec4 adds8(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_adds_epu8(a.v, b.v)); }
+        static inline Vec4 mulEpu32(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_mul_epu32(a.v, b.v)); }
+        static inline Vec4 cmpeq32(Vec4 a, Vec4 b)
+        { return Vec4::make(_mm_cmpeq_epi32(a.v, b.v)); }
+
+        template <int n> static inline Vec4 srli32(Vec4 a)
+        { return Vec4::make(_mm_srli_epi32(a.v, n)); }
+        template <int n> static inline Vec4 slli32(Vec4 a)
+        { return Vec4::make(_mm_slli_epi32(a.v, n)); }
+        template <int n> static inline Vec4 srli64(Vec4 a)
+        { return Vec4::make(_mm_srli_epi64(a.v, n)); }
+        template <int n> static inline Vec4 slli64(Vec4 a)
+        { return Vec4::make(_mm_slli_epi64(a.v, n)); }
+
+#if defined(__AVX2__)
+        struct Vec8
+        {
+            __m256i v;
+
+            static const unsigned size = 8;
+
+            static Vec8 make(__m256i v) { Vec8 r = { v }; return r; }
+
+            static Vec8 load(const ARGB * p)
+            { return make(_mm256_loadu_si256((const __m256i*) p)); }
+
+            void store(ARGB * p) const
+            { _mm256_storeu_si256((__m256i*) p, v); }
+
+            static Vec8 set1(uint32_t x)
+            { return make(_mm256_set1_epi32(int(x))); }
+
+            static Vec8 set1_64(uint64_t x)
+            { return make(_mm256_set1_epi64x(int64_t(x))); }
+
+            static Vec8 loadAlpha(const Alpha * a)
+            {
+                __m256i x = _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64((const __m128i*) a));
+                return make(_mm256_mullo_epi32(x,
+                    _mm256_set1_epi32(0x01010101)));
+            }
+
+            static Vec8 mulBytes(Vec8 c, Vec8 a)
+            {
+                const __m256i zero = _mm256_setzero_si256();
+                const __m256i round = _mm256_set1_epi16(0x80);
+
+                __m256i lo = _mm256_mullo_epi16(
+                    _mm256_unpacklo_epi8(c.v, zero),
+                    _mm256_unpacklo_epi8(a.v, zero));
+                __m256i hi = _mm256_mullo_epi16(
+                    _mm256_unpackhi_epi8(c.v, zero),
+                    _mm256_unpackhi_epi8(a.v, zero));
+
+                lo = _mm256_srli_epi16(_mm256_add_epi16(lo, round), 8);
+                hi = _mm256_srli_epi16(_mm256_add_epi16(hi, round), 8);
+                return make(_mm256_packus_epi16(lo, hi));
+            }
+
+            // the unpacks and packs are per 128-bit lane, so the
+            // pixels end up back in the same order
+            static Vec8 divBytes(Vec8 c, Vec8 d)
+            {
+                const __m256i zero = _mm256_setzero_si256();
+
+                __m256i c16[2] = { _mm256_unpacklo_epi8(c.v, zero),
+                    _mm256_unpackhi_epi8(c.v, zero) };
+                __m256i d16[2] = { _mm256_unpacklo_epi8(d.v, zero),
+                    _mm256_unpackhi_epi8(d.v, zero) };
+
+                __m256i q16[2];
+                for(int i = 0; i < 2; ++i)
+                {
+                    q16[i] = _mm256_packs_epi32(
+                        divWords(_mm256_unpacklo_epi16(c16[i], zero),
+                            _mm256_unpacklo_epi16(d16[i], zero)),
+                        divWords(_mm256_unpackhi_epi16(c16[i], zero),
+                            _mm256_unpackhi_epi16(d16[i], zero)));
+                }
+                return make(_mm256_packus_epi16(q16[0], q16[1]));
+            }
+
+        private:
+            static __m256i divWords(__m256i c, __m256i d)
+            {
+                __m256 n = _mm256_mul_ps(_mm256_cvtepi32_ps(c),
+                    _mm256_set1_ps(255));
+                __m256 q = _mm256_div_ps(n, _mm256_max_ps(
+                    _mm256_cvtepi32_ps(d), _mm256_set1_ps(1)));
+                return _mm256_cvttps_epi32(q);
+            }
+        };
+
+        static inline Vec8 operator&(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_and_si256(a.v, b.v)); }
+        static inline Vec8 operator|(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_or_si256(a.v, b.v)); }
+        static inline Vec8 operator^(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_xor_si256(a.v, b.v)); }
+        static inline Vec8 operator~(Vec8 a)
+        { return Vec8::make(_mm256_xor_si256(a.v, _mm256_set1_epi32(-1))); }
+
+        static inline Vec8 add32(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_add_epi32(a.v, b.v)); }
+        static inline Vec8 sub32(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_sub_epi32(a.v, b.v)); }
+        static inline Vec8 add64(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_add_epi64(a.v, b.v)); }
+        static inline Vec8 adds8(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_adds_epu8(a.v, b.v)); }
+        static inline Vec8 mulEpu32(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_mul_epu32(a.v, b.v)); }
+        static inline Vec8 cmpeq32(Vec8 a, Vec8 b)
+        { return Vec8::make(_mm256_cmpeq_epi32(a.v, b.v)); }
+
+        template <int n> static inline Vec8 srli32(Vec8 a)
+        { return Vec8::make(_mm256_srli_epi32(a.v, n)); }
+        template <int n> static inline Vec8 slli32(Vec8 a)
+        { return Vec8::make(_mm256_slli_epi32(a.v, n)); }
+        template <int n> static inline Vec8 srli64(Vec8 a)
+        { return Vec8::make(_mm256_srli_epi64(a.v, n)); }
+        template <int n> static inline Vec8 slli64(Vec8 a)
+        { return Vec8::make(_mm256_slli_epi64(a.v, n)); }
+
+        // the widest vector available
+        typedef Vec8 Pixels;
+#else
+        typedef Vec4 Pixels;
+#endif
+
+        // pick a where mask is set, otherwise b
+        template <typename V>
+        static inline V select(V mask, V a, V b)
+        {
+            return (mask & a) | (~mask & b);
+        }
+
+        // alpha of each pixel, repeated in all bytes
+        template <typename V>
+        static inline V alpha(V c)
+        {
+            V a = srli32<24>(c);
+            a = a | slli32<8>(a);
+            return a | slli32<16>(a);
+        }
+
+        // color::blend with alpha repeated in all bytes
+        template <typename V>
+        static inline V blend(V c, V a)
+        {
+            return select(cmpeq32(a, V::set1(~0u)), c, V::mulBytes(c, a));
+        }
+
+        // color::clipAdd
+        template <typename V>
+        static inline V clipAdd(V c1, V c2) { return adds8(c1, c2); }
+
+        // color::AoverB
+        template <typename V>
+        static inline V AoverB(V a, V b)
+        {
+            return adds8(a, blend(b, ~alpha(a)));
+        }
+
+        // color::alphaMask with alpha repeated in all bytes
+        template <typename V>
+        static inline V alphaMask(V c0, V c1, V a)
+        {
+            return add32(blend(c0, ~a), blend(c1, a));
+        }
+
+        // low 32 bits of 32x32 products (SSE2 doesn't have this)
+        template <typename V>
+        static inline V mullo32(V a, V b)
+        {
+            V even = mulEpu32(a, b) & V::set1_64(0xffffffffu);
+            V odd = mulEpu32(srli64<32>(a), srli64<32>(b));
+            return even | slli64<32>(odd);
+        }
+
+        // color::lerp with the fraction in the low byte of each pixel
+        // (the rest must be zero), wrapping exactly like the scalar one
+        template <typename V>
+        static inline V lerp(V c1, V c2, V frac)
+        {
+            V m = V::set1(0x00ff00ffu);
+            V rb1 = c1 & m, ag1 = srli32<8>(c1) & m;
+            V rb2 = c2 & m, ag2 = srli32<8>(c2) & m;
+
+            V drb = srli32<8>(mullo32(sub32(rb2, rb1), frac));
+            V dag = srli32<8>(mullo32(sub32(ag2, ag1), frac));
+
+            return (add32(drb, rb1) & m)
+                | (slli32<8>(add32(dag, ag1)) & V::set1(0xff00ff00u));
+        }
+
+        // color::multiply does the channels in pairs with 64-bit
+        // products, so do exactly the same for even and odd pixels
+        template <typename V>
+        static inline V multiplyPairs(V ag1, V ag2, V rb1, V rb2)
+        {
+            V ag = add64(mulEpu32(ag1, ag2), V::set1_64(0x0080000000800000u))
+                & V::set1_64(0xff000000ff000000u);
+            V rb = add64(mulEpu32(rb1, rb2), V::set1_64(0x0000008000000080u))
+                & V::set1_64(0x0000ff000000ff00u);
+
+            V c = srli64<16>(ag) | srli64<8>(rb);
+            return c | srli64<16>(c);
+        }
+
+        // color::multiply
+        template <typename V>
+        static inline V multiply(V c1, V c2)
+        {
+            V mAG = V::set1(0xff00ff00u), mRB = V::set1(0x00ff00ffu);
+            V ag1 = c1 & mAG, ag2 = c2 & mAG;
+            V rb1 = c1 & mRB, rb2 = c2 & mRB;
+
+            V even = multiplyPairs(ag1, ag2, rb1, rb2);
+            V odd = multiplyPairs(srli64<32>(ag1), srli64<32>(ag2),
+                srli64<32>(rb1), srli64<32>(rb2));
+
+            V c = (even & V::set1_64(0xffffffffu)) | slli64<32>(odd);
+
+            // opaque white is returned as-is, zero works out already
+            V ones = V::set1(~0u);
+            c = select(cmpeq32(c1, ones), c2, c);
+            return select(cmpeq32(c2, ones), c1, c);
+        }
+
+        // color::divide
+        template <typename V>
+        static inline V divide(V c1, V c2) { return V::divBytes(c1, c2); }
+
+        // store the color c into n pixels
+        static inline void fill(ARGB * dst, ARGB c, unsigned n)
+        {
+            Pixels v = Pixels::set1(c);
+
+            unsigned i = 0;
+            for(; i + Pixels::size <= n; i += Pixels::size) v.store(dst + i);
+            for(; i < n; ++i) dst[i] = c;
+        }
+
+        // classifies n (at most 16) mask values as MASK_ZERO if they
+        // are all zero, MASK_FULL if all 255, otherwise MASK_PARTIAL
+        enum MaskType { MASK_ZERO, MASK_FULL, MASK_PARTIAL };
+
+        static inline MaskType maskType(const Alpha * mask, unsigned n)
+        {
+            if(n < 16)
+            {
+                bool zero = true, full = true;
+                for(unsigned i = 0; i < n; ++i)
+                {
+                    zero = zero && !mask[i];
+                    full = full && mask[i] == 0xff;
+                }
+                return zero ? MASK_ZERO : full ? MASK_FULL : MASK_PARTIAL;
+            }
+
+            __m128i m = _mm_loadu_si128((const __m128i*) mask);
+            __m128i zero = _mm_setzero_si128();
+            if(0xffff == _mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)))
+                return MASK_ZERO;
+            if(0xffff == _mm_movemask_epi8(_mm_cmpeq_epi8(m,
+                _mm_cmpeq_epi8(zero, zero)))) return MASK_FULL;
+            return MASK_PARTIAL;
+        }
+
+        // detects if a blend:: type has a vector version of blend()
+        // custom blends without one just use the scalar version
+        template <typename Blend, typename V = Pixels>
+        struct hasVectorBlend
+        {
+            template <typename B>
+            static char test(decltype(B::blend(V(), V())) *);
+            template <typename B>
+            static long test(...);
+
+            static const bool value = sizeof(test<Blend>(0)) == 1;
+        };
+
+        // blend n pixels with src, one row at a time
+        // with vectors for the blend types that support them
+        template <typename Blend, bool vector = hasVectorBlend<Blend>::value>
+        struct SpanBlend
+        {
+            static void blend(ARGB * dst, const ARGB * src, unsigned n)
+            {
+                for(unsigned i = 0; i < n; ++i)
+                {
+                    dst[i] = Blend::blend(dst[i], src[i]);
+                }
+            }
+
+            static void blendMask(ARGB * dst, const ARGB * src,
+                const Alpha * mask, unsigned n)
+            {
+                for(unsigned i = 0; i < n; ++i)
+                {
+                    // fast path to reduce bandwidth
+                    if(!mask[i]) continue;
+
+                    dst[i] = color::alphaMask(dst[i],
+                        Blend::blend(dst[i], src[i]), mask[i]);
+                }
+            }
+        };
+
+        template <typename Blend>
+        struct SpanBlend<Blend, true>
+        {
+            typedef Pixels V;
+
+            static void blend(ARGB * dst, const ARGB * src, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    Blend::blend(V::load(dst + i), V::load(src + i))
+                        .store(dst + i);
+                }
+
+                SpanBlend<Blend, false>::blend(dst + i, src + i, n - i);
+            }
+
+            static void blendMask(ARGB * dst, const ARGB * src,
+                const Alpha * mask, unsigned n)
+            {
+                unsigned i = 0;
+                for(; i + V::size <= n; i += V::size)
+                {
+                    // skip empty groups of pixels
+                    uint64_t m = 0; memcpy(&m, mask + i, V::size);
+                    if(!m) continue;
+
+                    V d = V::load(dst + i);
+                    V c = Blend::blend(d, V::load(src + i));
+                    if(m != (~uint64_t(0) >> (64 - 8*V::size)))
+                    {
+                        c = alphaMask(d, c, V::loadAlpha(mask + i));
+                    }
+                    c.store(dst + i);
+                }
+
+                SpanBlend<Blend, false>::blendMask(
+                    dst + i, src + i, mask + i, n - i);
+            }
+        };
+    };  // inline namespace
+    };
+};
@@ -4,6 +4,10 @@
 
 #include "dust/core/defs.h"
 #include "render_paint.h"
+#include "render_path.h"
+#include "dust/thread/threadpool.h"
+
+#include <functional>
 
 using namespace dust;
 
@@ -49,281 +53,967 @@ using namespace dust;
 //  b1 = a/(1+a), b2 = b1*b1, b3 = (1+a*a)*b1*b2
 //
 
-static inline void blurLine(
-    unsigned *buf, unsigned count,
-    const __m128 & a, const __m128 & b1,
-    const __m128 & b2, const __m128 & b3)
+// we absolutely can't have denormals! the control word is per thread
+// so anything that runs blurs in the thread pool needs one of these
+struct BlurControlWord
+{
+#ifdef DUST_ARCH_X86
+    unsigned int sse_control_store;
+
+    BlurControlWord()
+    {
+        // get old control word, set desired bits
+        sse_control_store = _mm_getcsr();
+
+        // bits: bits: 15 = flush to zero
+        //  | 14:13 = round to zero | 6 = denormals are zero
+        _mm_setcsr(sse_control_store | 0xE040);
+    }
+
+    ~BlurControlWord() { _mm_setcsr(sse_control_store); }
+#endif
+};
+
+struct BlurCoeffs
 {
-    // clear states
-    __m128 s1 = _mm_setzero_ps();
-    __m128 s2 = _mm_setzero_ps();
-    __m128 zz = _mm_setzero_ps();
-    for(unsigned x = 0; x < count; ++x)
-    {
-        // load
-        //__m128 v = _mm_cvtsi32_si128(buf[x]);
-        __m128 v = _mm_load_ss((float*)&buf[x]);
-        v = _mm_unpacklo_epi8(v, zz);
-        v = _mm_unpacklo_epi16(v, zz);
-        v = _mm_cvtepi32_ps(v);
-
-        // state = v + coeff * (state - v);
-        s1 = _mm_add_ps(v,
-            _mm_mul_ps(a, _mm_sub_ps(s1, v)));
-
-        s2 = _mm_add_ps(s1,
-            _mm_mul_ps(a, _mm_sub_ps(s2, s1)));
-
-        // store
-        v = _mm_cvtps_epi32(s2);
-        v = _mm_packs_epi32(v,v);
-        v = _mm_packus_epi16(v,v);
-        //buf[x] = _mm_cvtsi128_si32(v);
-        _mm_store_ss((float*)&buf[x], v);
+    __m128  a, b1, b2, b3;
+
+    // these are also computed with round to zero
+    BlurCoeffs(float r)
+    {
+        BlurControlWord cw;
+
+        float fa = exp(-2.f/r);
+        float fb1 = fa / ( 1 + fa);
+        float fb2 = fb1 * fb1;
+        float fb3 = (1+fa*fa) * fb1 * fb2;
+
+        a = _mm_set1_ps(fa);
+        b1 = _mm_set1_ps(fb1);
+        b2 = _mm_set1_ps(fb2);
+        b3 = _mm_set1_ps(fb3);
     }
 
-    // boundary correction
-    __m128 tmp = s1;
-    s1 = _mm_add_ps( _mm_mul_ps(b2, tmp), _mm_mul_ps(b1, s2) );
-    s2 = _mm_add_ps( _mm_mul_ps(b3, tmp), _mm_mul_ps(b2, s2) );
-
-    for(unsigned x = count; x--;)
-    {
-        // load
-        //__m128 v = _mm_cvtsi32_si128(buf[x]);
-        __m128 v = _mm_load_ss((float*)&buf[x]);
-        v = _mm_unpacklo_epi8(v, zz);
-        v = _mm_unpacklo_epi16(v, zz);
-        v = _mm_cvtepi32_ps(v);
-
-        // state = v + coeff * (state - v);
-        s1 = _mm_add_ps(v,
-            _mm_mul_ps(a, _mm_sub_ps(s1, v)));
-
-        s2 = _mm_add_ps(s1,
-            _mm_mul_ps(a, _mm_sub_ps(s2, s1)));
-
-        // store
-        v = _mm_cvtps_epi32(s2);
-        v = _mm_packs_epi32(v,v);
-        v = _mm_packus_epi16(v,v);
-        //buf[x] = _mm_cvtsi128_si32(v);
-        _mm_store_ss((float*)&buf[x], v);
+    // state = v + coeff * (state - v);
+    void step(__m128 v, __m128 & s1, __m128 & s2) const
+    {
+        s1 = _mm_add_ps(v, _mm_mul_ps(a, _mm_sub_ps(s1, v)));
+        s2 = _mm_add_ps(s1, _mm_mul_ps(a, _mm_sub_ps(s2, s1)));
     }
-}
 
-// s = src, sp = src pitch, d = dst, dp = dst pitch
-static inline void imageTranspose(
-    unsigned *s, unsigned sp, unsigned *d, unsigned dp)
+    // boundary correction between the passes
+    void reflect(__m128 & s1, __m128 & s2) const
+    {
+        __m128 tmp = s1;
+        s1 = _mm_add_ps( _mm_mul_ps(b2, tmp), _mm_mul_ps(b1, s2) );
+        s2 = _mm_add_ps( _mm_mul_ps(b3, tmp), _mm_mul_ps(b2, s2) );
+    }
+};
+
+// Vertical pass over K (1, 4 or 8) adjacent columns from src to dst
+// (which can be the same), with the channels of each pixel in one
+// register. Rows are walked directly so no transpose is necessary and
+// with eight columns there are eight independent filters to hide the
+// latency of the recursion.
+//
+// Forward results are stored as 8-bit and read back for the backward
+// pass, with rounding toward zero (see BlurControlWord).
+template <unsigned K>
+static void blurColumns(const ARGB * src, unsigned srcPitch,
+    ARGB * dst, unsigned dstPitch, unsigned h, const BlurCoeffs & c)
 {
-    // these could be parameters if necessary later
-    unsigned & w = sp;
-    unsigned & h = dp;
+    const __m128i zz = _mm_setzero_si128();
 
-    // assume 64-byte cache lines; this means we should
-    // copy 16 lines in parallel to avoid trashing the
-    // write-back caches..
+    __m128 s1[K], s2[K], v[K];
+    for(unsigned k = 0; k < K; ++k) s1[k] = s2[k] = _mm_setzero_ps();
 
-    // mask out the low 4 bits to get the number of
-    // full 16-line blocks to run
-    unsigned h16 = h & ~0xf;
+    auto load = [&](const ARGB * p)
+    {
+        if(K == 1)
+        {
+            __m128i x = _mm_cvtsi32_si128(int(*p));
+            x = _mm_unpacklo_epi16(_mm_unpacklo_epi8(x, zz), zz);
+            v[0] = _mm_cvtepi32_ps(x);
+            return;
+        }
+        for(unsigned k = 0; k < K; k += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(p + k));
+            __m128i lo = _mm_unpacklo_epi8(x, zz);
+            __m128i hi = _mm_unpackhi_epi8(x, zz);
+            v[k] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zz));
+            v[(k+1) % K] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zz));
+            v[(k+2) % K] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zz));
+            v[(k+3) % K] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zz));
+        }
+    };
 
-    unsigned y = 0;
-    while(y < h16)
+    auto store = [&](ARGB * p)
     {
-        unsigned y16 = y + 16;
-        for(unsigned x = 0; x < w; ++x)
+        if(K == 1)
         {
-            for(unsigned yy = y; yy < y16; ++yy)
-            {
-                d[yy+dp*x] = s[x+sp*yy];
-            }
+            __m128i x = _mm_cvtps_epi32(s2[0]);
+            x = _mm_packs_epi32(x, x);
+            *p = ARGB(_mm_cvtsi128_si32(_mm_packus_epi16(x, x)));
+            return;
+        }
+        for(unsigned k = 0; k < K; k += 4)
+        {
+            __m128i lo = _mm_packs_epi32(_mm_cvtps_epi32(s2[k]),
+                _mm_cvtps_epi32(s2[(k+1) % K]));
+            __m128i hi = _mm_packs_epi32(_mm_cvtps_epi32(s2[(k+2) % K]),
+                _mm_cvtps_epi32(s2[(k+3) % K]));
+            _mm_storeu_si128((__m128i*)(p + k), _mm_packus_epi16(lo, hi));
         }
-        y = y16;
+    };
+
+    for(unsigned y = 0; y < h; ++y)
+    {
+        load(src + y*srcPitch);
+        for(unsigned k = 0; k < K; ++k) c.step(v[k], s1[k], s2[k]);
+        store(dst + y*dstPitch);
     }
 
-    // last pass
-    for(unsigned x = 0; x < w; ++x)
+    for(unsigned k = 0; k < K; ++k) c.reflect(s1[k], s2[k]);
+
+    for(unsigned y = h; y--;)
     {
-        for(unsigned yy = y; yy < h; ++yy)
+        load(dst + y*dstPitch);
+        for(unsigned k = 0; k < K; ++k) c.step(v[k], s1[k], s2[k]);
+        store(dst + y*dstPitch);
+    }
+}
+
+// Horizontal pass over four rows in place, with each channel in one
+// register (so lanes are rows) which again gives four independent
+// filters. Rows past nRows repeat the first row and are not stored.
+// Eight rows here would need more registers than SSE has.
+static void blurRows(ARGB * row, unsigned pitch, unsigned nRows,
+    unsigned w, const BlurCoeffs & c)
+{
+    ARGB * r[4];
+    for(unsigned k = 0; k < 4; ++k) r[k] = row + (k < nRows ? k : 0)*pitch;
+
+    const __m128i m = _mm_set1_epi32(0xff);
+
+    __m128 s1[4], s2[4], v[4];
+    for(unsigned k = 0; k < 4; ++k) s1[k] = s2[k] = _mm_setzero_ps();
+
+    auto load = [&](unsigned x)
+    {
+        __m128i p = _mm_setr_epi32(
+            int(r[0][x]), int(r[1][x]), int(r[2][x]), int(r[3][x]));
+        v[0] = _mm_cvtepi32_ps(_mm_and_si128(p, m));
+        v[1] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), m));
+        v[2] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), m));
+        v[3] = _mm_cvtepi32_ps(_mm_srli_epi32(p, 24));
+    };
+
+    auto store = [&](unsigned x)
+    {
+        // same saturation as the columns, then back to pixels:
+        // b0..b3 g0..g3 r0..r3 a0..a3 -> b0 g0 r0 a0 b1 g1 ...
+        __m128i bg = _mm_packs_epi32(
+            _mm_cvtps_epi32(s2[0]), _mm_cvtps_epi32(s2[1]));
+        __m128i ra = _mm_packs_epi32(
+            _mm_cvtps_epi32(s2[2]), _mm_cvtps_epi32(s2[3]));
+        __m128i p = _mm_packus_epi16(bg, ra);
+        p = _mm_unpacklo_epi8(p, _mm_srli_si128(p, 8));
+        p = _mm_unpacklo_epi8(p, _mm_srli_si128(p, 8));
+
+        for(unsigned k = 0; k < nRows; ++k)
         {
-            d[yy+dp*x] = s[x+sp*yy];
+            r[k][x] = ARGB(_mm_cvtsi128_si32(p));
+            p = _mm_srli_si128(p, 4);
         }
+    };
+
+    for(unsigned x = 0; x < w; ++x)
+    {
+        load(x);
+        for(unsigned k = 0; k < 4; ++k) c.step(v[k], s1[k], s2[k]);
+        store(x);
+    }
+
+    for(unsigned k = 0; k < 4; ++k) c.reflect(s1[k], s2[k]);
+
+    for(unsigned x = w; x--;)
+    {
+        load(x);
+        for(unsigned k = 0; k < 4; ++k) c.step(v[k], s1[k], s2[k]);
+        store(x);
     }
 }
 
-void Surface::blur(Surface & src, float r)
+namespace {
+
+// Runs fn(i) for i in [0, n) on the calling thread and the render
+// thread pool. Like the raster bands, the caller claims items too and
+// only waits for the ones that were actually started; helper tasks
+// that start late find nothing left, so they never call fn after we
+// have returned, which is why fn can refer to the caller's stack.
+struct ParallelJob : ThreadTask
 {
-    unsigned w = src.szX, h = src.szY;
+    std::function<void(unsigned)>  fn;
+    unsigned                nItems;
 
-    // need a temporary surface to hold transposed data
-    Surface tmp(h, w, 16);
+    std::atomic<unsigned>   next;
+    std::atomic<unsigned>   done;
+    std::atomic<unsigned>   refs;
 
-#ifdef DUST_ARCH_X86
-    // we absolutely can't have denormals!
-    // get old control word, set desired bits
-    unsigned int sse_control_store = _mm_getcsr();
+    Semaphore               finished;
 
-    // bits: bits: 15 = flush to zero
-    //  | 14:13 = round to zero | 6 = denormals are zero
-    _mm_setcsr(sse_control_store | 0xE040);
-#endif
+    void run()
+    {
+        while(true)
+        {
+            unsigned i = next++;
+            if(i >= nItems) break;
 
-    float a = exp(-2.f/r);
-    float b1 = a / ( 1 + a);
-    float b2 = b1 * b1;
-    float b3 = (1+a*a) * b1 * b2;
+            fn(i);
+            if(++done == nItems) finished.post();
+        }
+    }
 
-    __m128 va = _mm_set1_ps(a);
-    __m128 vb1 = _mm_set1_ps(b1);
-    __m128 vb2 = _mm_set1_ps(b2);
-    __m128 vb3 = _mm_set1_ps(b3);
+    void release() { if(!--refs) delete this; }
 
-    // first transpose from src to temp
-    imageTranspose(src.pixels, w, tmp.pixels, h);
-    // vertical blur pass
-    for(unsigned x = 0; x < w; ++x)
+    void threadpool_runtask() { run(); release(); }
+};
+
+}; // anonymous namespace
+
+static void parallelFor(ThreadPool * pool, unsigned n,
+    const std::function<void(unsigned)> & fn)
+{
+    unsigned nTasks = pool ? (std::min)(n - 1, pool->getThreadCount()) : 0;
+    if(n < 2 || !nTasks)
     {
-        blurLine(tmp.pixels+x*h, h, va, vb1, vb2, vb3);
+        for(unsigned i = 0; i < n; ++i) fn(i);
+        return;
     }
 
-    // resize the current surface
-    validate(w, h);
+    ParallelJob * job = new ParallelJob;
+    job->fn = fn;
+    job->nItems = n;
+    job->next = 0;
+    job->done = 0;
+    job->refs = nTasks + 1;
 
-    // transpose from temp to this surface
-    imageTranspose(tmp.pixels, h, pixels, w);
-    // horizontal blur pass
-    for(unsigned y = 0; y < h; ++y)
+    ThreadTask * tasks[threadPool_queueSize];
+    for(unsigned i = 0; i < nTasks; ++i) tasks[i] = job;
+
+    // we might be on a worker of the pool ourselves
+    pool->queue_tasks_reentrant(tasks, nTasks);
+
+    job->run();
+    job->finished.wait();
+    job->release();
+}
+
+// Row filters: everything except blur works on one row at a time, with
+// the rows above and below as they were before the pass for emboss.
+
+// replace color with "diffuse light" using alpha as the height, for the
+// interior pixels of a row (the first and last pixels are copied)
+static void embossRow(ARGB * out, const ARGB * above,
+    const ARGB * row, const ARGB * below, unsigned w, float scale)
+{
+    out[0] = row[0];
+    out[w-1] = row[w-1];
+
+    unsigned x = 1;
     {
-        blurLine(pixels+y*w, w, va, vb1, vb2, vb3);
+        auto alpha = [](const ARGB * p)
+        { return _mm_srli_epi32(_mm_loadu_si128((const __m128i*) p), 24); };
+
+        const __m128 vScale = _mm_set1_ps(scale);
+        const __m128 one = _mm_set1_ps(1.f), half = _mm_set1_ps(.5f);
+        const __m128 full = _mm_set1_ps(255.f);
+
+        for(; x + 5 <= w; x += 4)
+        {
+            __m128i a01 = alpha(above + x);
+            __m128i a10 = alpha(row + x - 1);
+            __m128i a11 = alpha(row + x);
+            __m128i a12 = alpha(row + x + 1);
+            __m128i a21 = alpha(below + x);
+
+            // sums of four around each corner, see the scalar version
+            __m128i c = _mm_add_epi32(a11, _mm_add_epi32(a01, a10));
+            __m128i a00 = _mm_add_epi32(c, alpha(above + x - 1));
+            c = _mm_add_epi32(a11, _mm_add_epi32(a01, a12));
+            __m128i a02 = _mm_add_epi32(c, alpha(above + x + 1));
+            c = _mm_add_epi32(a11, _mm_add_epi32(a21, a10));
+            __m128i a20 = _mm_add_epi32(c, alpha(below + x - 1));
+            c = _mm_add_epi32(a11, _mm_add_epi32(a21, a12));
+            __m128i a22 = _mm_add_epi32(c, alpha(below + x + 1));
+
+            __m128 dx = _mm_mul_ps(vScale, _mm_cvtepi32_ps(_mm_sub_epi32(
+                _mm_add_epi32(a00, a20), _mm_add_epi32(a02, a22))));
+            __m128 dy = _mm_mul_ps(vScale, _mm_cvtepi32_ps(_mm_sub_epi32(
+                _mm_add_epi32(a20, a22), _mm_add_epi32(a00, a02))));
+
+            __m128 z = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), one)));
+
+            __m128 d = _mm_add_ps(half, _mm_mul_ps(half, _mm_mul_ps(z, dy)));
+            __m128i v = _mm_cvttps_epi32(_mm_mul_ps(full, d));
+
+            v = _mm_or_si128(v, _mm_slli_epi32(v, 8));
+            v = _mm_or_si128(v, _mm_slli_epi32(v, 8));
+            v = _mm_or_si128(_mm_slli_epi32(a11, 24), v);
+            _mm_storeu_si128((__m128i*)(out + x), v);
+        }
     }
 
-#ifdef DUST_ARCH_X86
-    _mm_setcsr(sse_control_store);
-#endif
+    for(; x + 1 < w; ++x)
+    {
+        /////// aYX
+        // try to avoid register spills by fetching corners
+        // then adding rest of the points into them
+
+        int32_t a00 = above[x-1] >> 24;
+        int32_t a02 = above[x+1] >> 24;
+        int32_t a20 = below[x-1] >> 24;
+        int32_t a22 = below[x+1] >> 24;
+
+        int32_t a01 = above[x] >> 24;
+        a00 += a01; a02 += a01;
+
+        int32_t a10 = row[x-1] >> 24;
+        a00 += a10; a20 += a10;
+
+        int32_t a12 = row[x+1] >> 24;
+        a02 += a12; a22 += a12;
+
+        int32_t a21 = below[x] >> 24;
+        a20 += a21; a22 += a21;
+
+        int32_t a11 = row[x] >> 24;
+        a00 += a11; a02 += a11; a20 += a11; a22 += a11;
+
+        // now each of the corners has sum of 4 points
+        // so the kernel is
+        //  [ -1 -2 -1 ]
+        //  [  0  0  0 ]
+        //  [ +1,+2,+1 ]
+
+        float dx = scale * (a00 + a20 - a02 - a22);
+        float dy = scale * (a20 + a22 - a00 - a02);
+
+        // normal from the partial derivatives is
+        // [ -dx, -dy, 1 ]
+        //
+        // normalize it:
+
+        float z = 1.f / sqrtf(dx*dx + dy*dy + 1);
+
+        // calculate diffuse with .5 + .5*dot, using
+        // simple lighting vector [0, 1, 0]
+        float D = .5 + .5 * (z*dy);
+
+        // convert to grayscale color value
+        int32_t rgb = 0x10101 * (int) (255.f * D);
+
+        // store into the pixel
+        out[x] = (a11<<24) | rgb;
+    }
 }
 
+// color::blend all the pixels of a row with the same alpha
+static void blendRow(ARGB * row, unsigned w, Alpha a)
+{
+    typedef simd::Pixels V;
 
-// FIXME: add special case handling for borders?
-void Surface::emboss(float h)
+    V va = V::set1(0x01010101u * a);
+
+    unsigned x = 0;
+    for(; x + V::size <= w; x += V::size)
+    {
+        simd::blend(V::load(row + x), va).store(row + x);
+    }
+    for(; x < w; ++x) row[x] = color::blend(row[x], a);
+}
+
+namespace {
+
+// One of the row filters, with whatever can be computed in advance.
+struct RowFilter
 {
-    unsigned xmax = szX - 2;
-    unsigned ymax = szY - 2;
+    bool    isEmboss;
+    float   scale;              // emboss height scaling
 
-    float scale = h / 255.f;    // height scaling
+    // fadeEdges: the fade for each distance from an edge up to the
+    // radius; each pixel is blended with the fade for the nearer edge
+    // and then the further edge, first vertically then horizontally
+    std::vector<Alpha>  fade;
 
-    for(unsigned y = 0; y < ymax; ++y)
+    void fadeRow(ARGB * row, unsigned y, unsigned w, unsigned h) const
     {
-        for(unsigned x = 0; x < xmax; ++x)
+        unsigned n = fade.size();
+
+        unsigned d0 = (std::min)(y, h-1-y), d1 = (std::max)(y, h-1-y);
+        if(d0 < n) blendRow(row, w, fade[d0]);
+        if(d1 < n) blendRow(row, w, fade[d1]);
+
+        // columns near the left and right edges
+        unsigned xn = (std::min)(n, w);
+        for(unsigned x = 0; x < w; ++x)
         {
-            /////// aYX
-            // try to avoid register spills by fetching corners
-            // then adding rest of the points into them
+            // jump to the right edge
+            if(x == xn) x = (std::max)(xn, w - xn);
+            if(x == w) break;
 
-            int32_t a00 = pixels[(x+0)+szX*(y+0)] >> 24;
-            int32_t a02 = pixels[(x+2)+szX*(y+0)] >> 24;
-            int32_t a20 = pixels[(x+0)+szX*(y+2)] >> 24;
-            int32_t a22 = pixels[(x+2)+szX*(y+2)] >> 24;
+            d0 = (std::min)(x, w-1-x); d1 = (std::max)(x, w-1-x);
+            if(d0 < n) row[x] = color::blend(row[x], fade[d0]);
+            if(d1 < n) row[x] = color::blend(row[x], fade[d1]);
+        }
+    }
+};
 
-            int32_t a01 = pixels[(x+1)+szX*(y+0)] >> 24;
-            a00 += a01; a02 += a01;
+// The pass over rows of one segment of a filter chain: the horizontal
+// pass of a blur (if any) and then the row filters up to the next blur.
+//
+// Rows are done in bands, each processed top to bottom. Emboss needs
+// the rows above and below as they were before the pass, so these are
+// kept in a scratch surface as we go; rows just outside a band are
+// copied before any band starts (halo) as the bands next to it might
+// have already changed them otherwise.
+struct RowPass
+{
+    ARGB *      pixels;
+    unsigned    pitch, w, h;
+
+    const BlurCoeffs *  blur;   // horizontal blur first, unless null
+
+    const RowFilter *   filters;
+    unsigned            nFilters;
+
+    bool        needNeighbours; // there is an emboss
+    unsigned    lastEmboss;     // index of the last one, if any
+
+    // rows above and below each band, see prepareHalo()
+    PooledSurface   halo;
+
+    RowPass(ARGB * pixels, unsigned pitch, unsigned w, unsigned h,
+        const BlurCoeffs * blur, const RowFilter * filters,
+        unsigned nFilters, unsigned nBands)
+        : pixels(pixels), pitch(pitch), w(w), h(h), blur(blur)
+        , filters(filters), nFilters(nFilters), needNeighbours(false)
+        , lastEmboss(0), halo(0, 0)
+    {
+        for(unsigned i = 0; i < nFilters; ++i)
+        {
+            if(!filters[i].isEmboss) continue;
+            needNeighbours = true;
+            lastEmboss = i;
+        }
+        prepareHalo(nBands);
+    }
 
-            int32_t a10 = pixels[(x+0)+szX*(y+1)] >> 24;
-            a00 += a10; a20 += a10;
+    // blur n rows in place, four at a time
+    void blurGroups(ARGB * row, unsigned rowPitch, unsigned n) const
+    {
+        BlurControlWord cw;
+        for(unsigned i = 0; i < n; i += 4)
+        {
+            blurRows(row + i*rowPitch, rowPitch,
+                (std::min)(4u, n - i), w, *blur);
+        }
+    }
 
-            int32_t a12 = pixels[(x+2)+szX*(y+1)] >> 24;
-            a02 += a12; a22 += a12;
+    // band b of nBands covers groups of four rows
+    void bandRows(unsigned b, unsigned nBands,
+        unsigned & y0, unsigned & y1) const
+    {
+        unsigned nGroups = (h + 3) / 4;
+        y0 = (std::min)(h, 4 * (nGroups * b / nBands));
+        y1 = (std::min)(h, 4 * (nGroups * (b+1) / nBands));
+    }
 
-            int32_t a21 = pixels[(x+1)+szX*(y+2)] >> 24;
-            a20 += a21; a22 += a21;
+    void prepareHalo(unsigned nBands)
+    {
+        if(!needNeighbours) return;
 
-            int32_t a11 = pixels[(x+1)+szX*(y+1)] >> 24;
-            a00 += a11; a02 += a11; a20 += a11; a22 += a11;
+        SurfacePool::acquire(halo, w, 2*nBands, Surface::cacheLineAlign);
+        for(unsigned b = 0; b < nBands; ++b)
+        {
+            unsigned y0, y1;
+            bandRows(b, nBands, y0, y1);
 
-            // now each of the corners has sum of 4 points
-            // so the kernel is
-            //  [ -1 -2 -1 ]
-            //  [  0  0  0 ]
-            //  [ +1,+2,+1 ]
+            if(y0) memcpy(halo.getPixels() + 2*b*halo.getPitch(),
+                pixels + (y0-1)*pitch, w * sizeof(ARGB));
+            if(y1 < h) memcpy(halo.getPixels() + (2*b+1)*halo.getPitch(),
+                pixels + y1*pitch, w * sizeof(ARGB));
+        }
 
-            float dx = scale * (a00 + a20 - a02 - a22);
-            float dy = scale * (a20 + a22 - a00 - a02);
+        if(blur) blurGroups(halo.getPixels(), halo.getPitch(), 2*nBands);
+    }
 
-            // normal from the partial derivatives is
-            // [ -dx, -dy, 1 ]
-            //
-            // normalize it:
+    // Filter row y from src into dst, which can be the same if there
+    // is no emboss. Rows are only copied when necessary: an emboss
+    // writes straight into dst (or scratch if the row is already
+    // there) and the neighbours are only copied if they are faded.
+    void filterRow(ARGB * dst, const ARGB * src,
+        const ARGB * above, const ARGB * below, ARGB ** scratch,
+        unsigned y) const
+    {
+        size_t rowBytes = w * sizeof(ARGB);
 
-            float z = 1.f / sqrt(dx*dx + dy*dy + 1);
+        const ARGB * cur = src;
+        bool ownNeighbours = false;
 
-            // calculate diffuse with .5 + .5*dot, using
-            // simple lighting vector [0, 1, 0]
-            float D = .5 + .5 * (z*dy);
+        for(unsigned i = 0; i < nFilters; ++i)
+        {
+            const RowFilter & f = filters[i];
+            if(!f.isEmboss)
+            {
+                if(cur == src && src != dst)
+                {
+                    memcpy(dst, src, rowBytes);
+                    cur = dst;
+                }
+                f.fadeRow((ARGB*) cur, y, w, h);
 
-            // convert to grayscale color value
-            int32_t rgb = 0x10101 * (int) (255.f * D);
+                // only the alpha of these matters for a later emboss
+                if(i > lastEmboss || !above || !below) continue;
+                if(!ownNeighbours)
+                {
+                    memcpy(scratch[1], above, rowBytes);
+                    memcpy(scratch[2], below, rowBytes);
+                    above = scratch[1];
+                    below = scratch[2];
+                    ownNeighbours = true;
+                }
+                f.fadeRow(scratch[1], y-1, w, h);
+                f.fadeRow(scratch[2], y+1, w, h);
+                continue;
+            }
 
-            // store into the pixel
-            pixels[(x+1)+szX*(y+1)] = (a11<<24) | rgb;
+            // the first and last rows and columns are left as they are
+            if(!above || !below || w < 3) continue;
 
+            ARGB * out = cur == dst ? scratch[0] : dst;
+            embossRow(out, above, cur, below, w, f.scale);
+            cur = out;
         }
+
+        if(cur != dst) memcpy(dst, cur, rowBytes);
     }
+
+    void runBand(unsigned b, unsigned nBands)
+    {
+        unsigned y0, y1;
+        bandRows(b, nBands, y0, y1);
+        if(y0 == y1) return;
+
+        if(!needNeighbours)
+        {
+            // rows are independent, so just go in groups
+            for(unsigned y = y0; y < y1; y += 4)
+            {
+                unsigned n = (std::min)(4u, y1 - y);
+                if(blur) blurGroups(pixels + y*pitch, pitch, n);
+
+                for(unsigned i = 0; i < n; ++i)
+                {
+                    ARGB * row = pixels + (y+i)*pitch;
+                    filterRow(row, row, 0, 0, 0, y+i);
+                }
+            }
+            return;
+        }
+
+        // originals of the current and previous rows, then three rows
+        // of scratch for filterRow()
+        PooledSurface rows(w, 5, Surface::cacheLineAlign);
+        ARGB * orig[2], * scratch[3];
+        for(unsigned i = 0; i < 2; ++i)
+            orig[i] = rows.getPixels() + i*rows.getPitch();
+        for(unsigned i = 0; i < 3; ++i)
+            scratch[i] = rows.getPixels() + (i+2)*rows.getPitch();
+
+        const ARGB * haloAbove = halo.getPixels() + 2*b*halo.getPitch();
+        const ARGB * haloBelow = haloAbove + halo.getPitch();
+
+        // rows [y0, ready) have been blurred
+        unsigned ready = y0;
+        for(unsigned y = y0; y < y1; ++y)
+        {
+            ARGB * row = pixels + y*pitch;
+
+            if(blur && y + 1 >= ready && ready < y1)
+            {
+                unsigned n = (std::min)(4u, y1 - ready);
+                blurGroups(pixels + ready*pitch, pitch, n);
+                ready += n;
+            }
+
+            memcpy(orig[y&1], row, w * sizeof(ARGB));
+
+            const ARGB * above = !y ? 0
+                : y == y0 ? haloAbove : orig[(y-1)&1];
+            const ARGB * below = y + 1 == h ? 0
+                : y + 1 == y1 ? haloBelow : row + pitch;
+
+            filterRow(row, orig[y&1], above, below, scratch, y);
+        }
+    }
+};
+
+}; // anonymous namespace
+
+static RowFilter makeRowFilter(const FilterChain::Stage & stage,
+    unsigned w, unsigned h)
+{
+    RowFilter f;
+    f.isEmboss = stage.type == FilterChain::EMBOSS;
+    f.scale = stage.param / 255.f;    // height scaling
+
+    if(stage.type == FilterChain::FADE_EDGES)
+    {
+        float radius = stage.param;
+        unsigned n = radius > 0 ? unsigned(ceilf(radius)) : 0;
+
+        f.fade.resize((std::min)(n, (std::max)(w, h)));
+        for(unsigned d = 0; d < f.fade.size(); ++d)
+        {
+            // compute smooth step
+            float t = (d + .5f) / radius;
+            f.fade[d] = Alpha(int(0xff * ( t*t*(3-2*t) )));
+        }
+    }
+    return f;
+}
+
+// Blurs are separable two-pole recursive filters (see the notes above)
+// so the cost is the same for any radius. The vertical pass reads src
+// and writes dst directly, in bands of columns, then the horizontal
+// pass goes with the rest of the filters up to the next blur in bands
+// of rows (see RowPass). Large images split the bands across threads.
+void Surface::applyFilters(Surface & src,
+    const FilterChain::Stage * stages, unsigned nStages)
+{
+    unsigned w = src.szX, h = src.szY;
+    const ARGB * srcPixels = src.pixels;
+    unsigned srcPitch = src.pitch;
+
+    // resize the current surface (nothing changes if src is this)
+    // and drop the mips, as they won't match the result
+    validate(w, h);
+    invalidateMips();
+    if(!w || !h) return;
+
+    ARGB * dst = pixels;
+    unsigned dstPitch = pitch;
+
+    // unless the first filter is a blur, start with a copy
+    if(srcPixels != dst && (!nStages || stages[0].type != FilterChain::BLUR))
+    {
+        for(unsigned y = 0; y < h; ++y)
+        {
+            memcpy(dst + y*dstPitch, srcPixels + y*srcPitch,
+                w * sizeof(ARGB));
+        }
+        srcPixels = dst;
+        srcPitch = dstPitch;
+    }
+
+    // same rule as paths, small images are always filtered serially
+    ThreadPool * pool = w*h >= unsigned(renderParallelMinArea)
+        ? getRenderThreadPool() : 0;
+
+    // a few bands per thread, so claiming balances the load
+    unsigned nBands = pool ? 2*(pool->getThreadCount() + 1) : 1;
+
+    std::vector<RowFilter>  filters;
+
+    unsigned i = 0;
+    while(i < nStages)
+    {
+        bool isBlur = stages[i].type == FilterChain::BLUR;
+        BlurCoeffs c(isBlur ? stages[i].param : 1.f);
+
+        if(isBlur)
+        {
+            // vertical pass in bands of eight columns
+            unsigned nCols = (w + 7) / 8;
+            unsigned nColBands = (std::min)(nBands, nCols);
+            parallelFor(pool, nColBands, [&](unsigned b)
+            {
+                BlurControlWord cw;
+
+                unsigned x = 8 * (nCols * b / nColBands);
+                unsigned x1 = (std::min)(w, 8 * (nCols * (b+1) / nColBands));
+
+                for(; x + 8 <= x1; x += 8)
+                {
+                    blurColumns<8>(srcPixels + x, srcPitch,
+                        dst + x, dstPitch, h, c);
+                }
+                for(; x + 4 <= x1; x += 4)
+                {
+                    blurColumns<4>(srcPixels + x, srcPitch,
+                        dst + x, dstPitch, h, c);
+                }
+                for(; x < x1; ++x)
+                {
+                    blurColumns<1>(srcPixels + x, srcPitch,
+                        dst + x, dstPitch, h, c);
+                }
+            });
+
+            // the rest are in place
+            srcPixels = dst;
+            srcPitch = dstPitch;
+            ++i;
+        }
+
+        // then the horizontal pass and filters up to the next blur
+        filters.clear();
+        for(; i < nStages && stages[i].type != FilterChain::BLUR; ++i)
+        {
+            filters.push_back(makeRowFilter(stages[i], w, h));
+        }
+
+        unsigned nRowBands = (std::min)(nBands, (h + 3) / 4);
+        RowPass pass(dst, dstPitch, w, h, isBlur ? &c : 0,
+            filters.data(), filters.size(), nRowBands);
+
+        parallelFor(pool, nRowBands,
+            [&](unsigned b) { pass.runBand(b, nRowBands); });
+    }
+}
+
+void Surface::blur(Surface & src, float r)
+{
+    FilterChain::Stage stage = { FilterChain::BLUR, r };
+    applyFilters(src, &stage, 1);
+}
+
+void Surface::emboss(float h)
+{
+    FilterChain::Stage stage = { FilterChain::EMBOSS, h };
+    applyFilters(*this, &stage, 1);
 }
 
 void Surface::fadeEdges(float radius)
 {
-    int ymax = std::min(unsigned(ceilf(radius)), szY);
-    for(int y = 0; y < ymax; ++y)
+    FilterChain::Stage stage = { FilterChain::FADE_EDGES, radius };
+    applyFilters(*this, &stage, 1);
+}
+
+// average of four pixels per channel, rounded
+static inline ARGB average4(ARGB c0, ARGB c1, ARGB c2, ARGB c3)
+{
+    const ARGB m = 0x00ff00ff;
+    ARGB rb = (c0&m) + (c1&m) + (c2&m) + (c3&m) + 0x00020002;
+    ARGB ag = ((c0>>8)&m) + ((c1>>8)&m) + ((c2>>8)&m) + ((c3>>8)&m)
+        + 0x00020002;
+    return ((rb >> 2) & m) | ((ag << 6) & ~m);
+}
+
+Surface & Surface::getMip(unsigned level)
+{
+    if(!level || (szX <= 1 && szY <= 1)) return *this;
+
+    if(!mip)
     {
-        // compute smooth step
-        float t = (y + .5f) / radius;
-        int fade = int(0xff * ( t*t*(3-2*t) ));
+        // the last row or column of odd sizes averages with itself
+        unsigned w = (szX + 1) >> 1, h = (szY + 1) >> 1;
+
+        mip = new Surface(w, h);
+        ARGB * out = mip->getPixels();
+        unsigned outPitch = mip->getPitch();
 
-        for(int x = 0; x < szX; ++x)
+        for(unsigned y = 0; y < h; ++y)
         {
-            pixels[x+pitch*y] =
-                color::blend(pixels[x+pitch*y], fade);
-            pixels[x+pitch*(szY-y-1)] =
-                color::blend(pixels[x+pitch*(szY-y-1)], fade);
+            ARGB * r0 = pixels + pitch * (2*y);
+            ARGB * r1 = (2*y + 1 < szY) ? r0 + pitch : r0;
+
+            for(unsigned x = 0; x < w; ++x)
+            {
+                unsigned x0 = 2*x, x1 = (2*x + 1 < szX) ? x0 + 1 : x0;
+                out[x + y*outPitch]
+                    = average4(r0[x0], r0[x1], r1[x0], r1[x1]);
+            }
         }
     }
-    
-    int xmax = std::min(unsigned(ceilf(radius)), szX);
 
-    for(int x = 0; x < xmax; ++x)
+    return mip->getMip(level - 1);
+}
+
+// size classes have four steps per power of two, so a buffer from the
+// class of n pixels is less than 25% larger than n
+static unsigned poolClassSize(unsigned n)
+{
+    unsigned step = 1;
+    while((step << 2) <= n) step <<= 1;
+    return (n + step - 1) & ~(step - 1);
+}
+
+namespace {
+    struct SurfacePoolData
     {
-        // compute smooth step
-        float t = (x + .5f) / radius;
-        int fade = int(0xff * ( t*t*(3-2*t) ));
+        struct Buffer
+        {
+            ARGB        *buffer, *pixels;
+            unsigned    capacity;
+        };
+
+        Mutex   mutex;
+
+        // released buffers, least recently released first
+        std::vector<Buffer>     buffers;
 
-        for(int y = 0; y < szY; ++y)
+        SurfacePool::Stats      stats = {};
+
+        SurfacePoolData() { stats.bytesBudget = 64 << 20; }
+
+        ~SurfacePoolData() { freeBuffers(0); }
+
+        static size_t bytes(const Buffer & b)
         {
-            pixels[x+pitch*y] =
-                color::blend(pixels[x+pitch*y], fade);
-            pixels[(szX-x-1)+pitch*y] =
-                color::blend(pixels[(szX-x-1)+pitch*y], fade);
+            return size_t(b.capacity) * sizeof(ARGB);
         }
+
+        // free the oldest buffers until the pool fits in budget
+        // returns the number of buffers freed
+        unsigned freeBuffers(size_t budget)
+        {
+            unsigned n = 0;
+            while(n < buffers.size() && stats.bytesPooled > budget)
+            {
+                stats.bytesPooled -= bytes(buffers[n]);
+                delete [] buffers[n++].buffer;
+            }
+            buffers.erase(buffers.begin(), buffers.begin() + n);
+            stats.buffersPooled = buffers.size();
+            return n;
+        }
+
+        // find the smallest buffer of at least n pixels, but not from
+        // a class much larger than that of n, or return false
+        bool take(unsigned n, Buffer & out)
+        {
+            unsigned maxSize = 2 * poolClassSize(n);
+
+            int best = -1;
+            for(unsigned i = 0; i < buffers.size(); ++i)
+            {
+                unsigned c = buffers[i].capacity;
+                if(c < n || c > maxSize) continue;
+                if(best < 0 || c < buffers[best].capacity) best = i;
+            }
+            if(best < 0) return false;
+
+            out = buffers[best];
+            buffers.erase(buffers.begin() + best);
+            stats.bytesPooled -= bytes(out);
+            stats.buffersPooled = buffers.size();
+            return true;
+        }
+
+        void put(const Buffer & b)
+        {
+            if(!b.buffer) return;
+            buffers.push_back(b);
+            stats.bytesPooled += bytes(b);
+            stats.evictions += freeBuffers(stats.bytesBudget);
+        }
+    };
+
+    static SurfacePoolData & surfacePool()
+    {
+        static SurfacePoolData pool;
+        return pool;
+    }
+}
+
+void SurfacePool::acquire(Surface & s, unsigned w, unsigned h, unsigned pAlign)
+{
+    s.setSize(w, h, pAlign);
+    s.needUpdate = false;
+
+    unsigned size = s.pitch * s.szY;
+    if(size <= s.capacity) return;
+
+    SurfacePoolData & pool = surfacePool();
+
+    SurfacePoolData::Buffer b;
+    {
+        Mutex::Lock lock(pool.mutex);
+
+        SurfacePoolData::Buffer old = { s.buffer, s.pixels, s.capacity };
+        pool.put(old);
+
+        if(pool.take(size, b)) ++pool.stats.hits;
+        else { b.buffer = 0; ++pool.stats.misses; }
+    }
+
+    if(b.buffer)
+    {
+        s.buffer = b.buffer;
+        s.pixels = b.pixels;
+        s.capacity = b.capacity;
+    }
+    else
+    {
+        // reallocate() would delete the old buffer
+        s.buffer = 0;
+        s.reallocate(poolClassSize(size));
     }
 }
 
+void SurfacePool::release(Surface & s)
+{
+    SurfacePoolData & pool = surfacePool();
+    SurfacePoolData::Buffer b = { s.buffer, s.pixels, s.capacity };
+    {
+        Mutex::Lock lock(pool.mutex);
+        pool.put(b);
+    }
+
+    s.buffer = 0; s.pixels = 0; s.capacity = 0;
+    s.setSize(0, 0, 1);
+}
+
+void SurfacePool::setBudget(size_t bytes)
+{
+    SurfacePoolData & pool = surfacePool();
+    Mutex::Lock lock(pool.mutex);
+    pool.stats.bytesBudget = bytes;
+    pool.stats.evictions += pool.freeBuffers(bytes);
+}
+
+void SurfacePool::clear()
+{
+    SurfacePoolData & pool = surfacePool();
+    Mutex::Lock lock(pool.mutex);
+    pool.freeBuffers(0);
+}
+
+SurfacePool::Stats SurfacePool::getStats()
+{
+    SurfacePoolData & pool = surfacePool();
+    Mutex::Lock lock(pool.mutex);
+    return pool.stats;
+}
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "dust/libs/stb_image.h"
 
-Surface::Surface(const std::vector<char> & fileContents)
+Surface::Surface(const void * fileData, size_t fileSize)
 {
     int w,h,n;
     // let STBI convert to 4-channels (RGBA)
     auto image = stbi_load_from_memory(
-        (const unsigned char*) fileContents.data(),
-        fileContents.size(), &w, &h, &n, 4);
+        (const unsigned char*) fileData, int(fileSize), &w, &h, &n, 4);
 
     if(!image) return;  // failure
 
-    this->pitch = w;
-    this->szX = w;
-    this->szY = h;
-
-    this->pixels = new unsigned[w*h];
+    setSize(w, h, 1);
+    reallocate(w*h);
     for(int i = 0; i < w*h; ++i)
     {
         this->pixels[i] = (image[i*4] << 16) | (image[i*4+1] << 8)
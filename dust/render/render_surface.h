@@ -2,49 +2,179 @@
 #pragma once
 
 #include <vector>
+#include <cstring>
 
 #include "render_color.h"
 
 namespace dust
 {
+    // Sequence of filters (see FILTER FX in Surface) that is applied
+    // with Surface::filter() in as few passes over the pixels as
+    // possible, eg. for stacked effects like blur, emboss and fade.
+    //
+    // Each blur needs a vertical pass over the whole surface, but the
+    // rest of the chain runs in one pass over the rows together with
+    // the horizontal blur (if any) so the rows stay in cache between
+    // the filters. The results are identical to calling the filters
+    // one at a time.
+    struct FilterChain
+    {
+        enum Type { BLUR, EMBOSS, FADE_EDGES };
+
+        struct Stage
+        {
+            Type    type;
+            float   param;  // radius or height
+        };
+
+        FilterChain & blur(float radius) { return add(BLUR, radius); }
+        FilterChain & emboss(float h = 1) { return add(EMBOSS, h); }
+        FilterChain & fadeEdges(float radius)
+        { return add(FADE_EDGES, radius); }
+
+        void clear() { stages.clear(); }
+
+        const std::vector<Stage> & getStages() const { return stages; }
+
+    private:
+        std::vector<Stage>  stages;
+
+        FilterChain & add(Type type, float param)
+        {
+            Stage s = { type, param };
+            stages.push_back(s);
+            return *this;
+        }
+    };
+
     // Surface is a CPU-memory array of pixels
     //
+    // By default pitch == width, since a lot of code (eg. platform blits
+    // and icons) assumes as much. The buffer itself is always aligned to
+    // a cache line, so passing pAlign = cacheLineAlign also makes every
+    // row start at a 64-byte boundary, for surfaces that are only ever
+    // accessed through getPitch().
+    //
+    // The buffer is kept when the size changes if it's large enough,
+    // so eg. resizing a window doesn't reallocate the backing surface
+    // on every frame. See also SurfacePool below for temporaries.
+    //
+    // A surface can also be a view of memory it doesn't own (see wrap()
+    // and view() below) which is never freed by the surface.
+    //
     // NOTE: we might want to cache this in GPU eventually
     class Surface
     {
+        friend struct SurfacePool;
+
         ARGB    *pixels = 0;
+        ARGB    *buffer = 0;        // allocation that pixels is inside
+        unsigned capacity = 0;      // usable size of buffer in pixels
         unsigned szX = 0, szY = 0, pitch = 0;
+        unsigned slack = 0;         // percent extra to allocate
         bool    needUpdate = false;
 
+        // next mip level (half size) if one has been built
+        Surface *mip = 0;
+
+        static const uintptr_t alignBytes = 64;
+
+        // replace the buffer, keeping the current size
+        void reallocate(unsigned size)
+        {
+            delete [] buffer;
+            buffer = 0; pixels = 0; capacity = size;
+            if(!size) return;
+
+            buffer = new ARGB[size + alignBytes / sizeof(ARGB)];
+            pixels = (ARGB*) ((uintptr_t(buffer) + alignBytes - 1)
+                & ~(alignBytes - 1));
+        }
+
+        // set the size, the caller makes sure capacity is enough
+        void setSize(unsigned w, unsigned h, unsigned pAlign)
+        {
+            invalidateMips();
+            pitch = ((w + pAlign - 1) / pAlign) * pAlign;
+            szX = w; szY = h;
+        }
+
     public:
+        // row alignment in pixels: one pixel (pitch == width) by default
+        // or one cache line, which keeps SIMD loads of rows aligned
+        static const unsigned defaultAlign = 1;
+        static const unsigned cacheLineAlign = alignBytes / sizeof(ARGB);
+
         // create a new surface; defaults to zero area
-        Surface(unsigned w = 0, unsigned h = 0, unsigned pAlign = 1)
-        : pixels(0), szX(0), szY(0) { validate(w, h, pAlign); }
+        Surface(unsigned w = 0, unsigned h = 0,
+            unsigned pAlign = defaultAlign)
+        { validate(w, h, pAlign); }
 
         // create a new surface, loading an image file (using stb_image)
-        Surface(const std::vector<char> & fileContents);
+        Surface(const std::vector<char> & fileContents)
+            : Surface(fileContents.data(), fileContents.size()) {}
+
+        // same from an image file in memory (eg. a MappedFile)
+        Surface(const void * fileData, size_t fileSize);
 
         // allow move construction
-        Surface(Surface && other)
+        Surface(Surface && other) { swap(other); }
+
+        // allow move assignment
+        void operator=(Surface && other) { swap(other); }
+
+        void swap(Surface & other)
         {
             std::swap(pixels, other.pixels);
+            std::swap(buffer, other.buffer);
+            std::swap(capacity, other.capacity);
             std::swap(szX, other.szX);
             std::swap(szY, other.szY);
             std::swap(pitch, other.pitch);
+            std::swap(slack, other.slack);
             std::swap(needUpdate, other.needUpdate);
+            std::swap(mip, other.mip);
         }
 
-        // allow move assignment
-        void operator=(Surface && other)
+        ~Surface() { delete [] buffer; delete mip; }
+
+        // Returns a view of external memory, such as a buffer provided
+        // by a plugin host or a memory mapped frame buffer, which can
+        // then be drawn into with RenderContext without copies.
+        //
+        // The memory must remain valid for as long as the view is used
+        // (or any view of it) and the surface never frees it. Resizing
+        // a view with validate() to a different size (or alignment the
+        // pitch doesn't have) allocates a new buffer, after which it is
+        // a regular surface.
+        static Surface wrap(ARGB * pixels,
+            unsigned w, unsigned h, unsigned pitch)
         {
-            std::swap(pixels, other.pixels);
-            std::swap(szX, other.szX);
-            std::swap(szY, other.szY);
-            std::swap(pitch, other.pitch);
-            std::swap(needUpdate, other.needUpdate);
+            Surface s;
+            s.pixels = pixels;
+            s.szX = w; s.szY = h; s.pitch = pitch;
+            return s;
         }
-        
-        ~Surface() { if(pixels) { delete [] pixels; } }
+
+        // Returns a view of the rectangle (x,y,w,h) of this surface,
+        // clipped to the surface. Views of disjoint rectangles can be
+        // drawn into from different threads at the same time.
+        //
+        // The view shares the pixels of this surface, so this must
+        // not be resized or destroyed while the view is used.
+        Surface view(int x, int y, int w, int h)
+        {
+            int x0 = (std::max)(x, 0), y0 = (std::max)(y, 0);
+            int x1 = (std::min)(x + w, int(szX));
+            int y1 = (std::min)(y + h, int(szY));
+            if(x1 <= x0 || y1 <= y0) return wrap(0, 0, 0, 0);
+
+            return wrap(pixels + x0 + y0 * pitch,
+                unsigned(x1 - x0), unsigned(y1 - y0), pitch);
+        }
+
+        // true if this surface doesn't own its pixels
+        bool isView() { return pixels && !buffer; }
 
         // return current dimensions
         unsigned getSizeX() { return szX; }
@@ -62,34 +192,81 @@ namespace dust
         // returns true if the surface was resized (= content lost)
         // returns false if the contents were preserved
         //
+        // the pitch is kept if it's a multiple of pAlign, otherwise the
+        // surface is laid out again like a resize (even at the same size)
+        //
+        // the buffer is reallocated only if it is too small, or less
+        // than a quarter of it would be used
+        //
         // NOTE: for GPU backing, this should invalidate on resize
-        bool validate(unsigned w, unsigned h, unsigned pAlign = 1)
+        bool validate(unsigned w, unsigned h,
+            unsigned pAlign = defaultAlign)
         {
             bool defaultRet = needUpdate; needUpdate = false;
-            if(szX == w && szY == h) return defaultRet;
+            if(defaultRet) invalidateMips();
+            if(szX == w && szY == h && !(pitch % pAlign)) return defaultRet;
 
-            if(pixels) { delete [] pixels; }
+            setSize(w, h, pAlign);
 
-            pitch = ((w + pAlign - 1) / pAlign) * pAlign;
-            
-            szX = w; szY = h;
-            unsigned bufSize = pitch * szY;
-            pixels = bufSize ? new ARGB[bufSize] : 0;
+            unsigned size = pitch * szY;
+            if(size > capacity || size < capacity / 4)
+            {
+                reallocate(size + unsigned(uint64_t(size) * slack / 100));
+            }
             return true;
         }
 
+        // allocate this many percent extra when the buffer must grow,
+        // so that gradual growth (eg. window resizing) doesn't need to
+        // reallocate every time
+        void setSlack(unsigned percent) { slack = percent; }
+
+        // size of the buffer in pixels, at least pitch * sizeY
+        unsigned getCapacity() { return capacity; }
+
+        // release any memory not needed for the current size
+        // this does nothing for views, which don't own any memory
+        void shrinkToFit()
+        {
+            unsigned size = pitch * szY;
+            if(capacity == size || !buffer) return;
+
+            ARGB * old = buffer, * oldPixels = pixels;
+            buffer = 0; reallocate(size);
+            if(size) memcpy(pixels, oldPixels, size * sizeof(ARGB));
+            delete [] old;
+        }
+
         // force next validate to return true even if no resize is done
         void invalidate()
         {
             needUpdate = true;
         }
 
+        // returns this surface scaled down by 2^level with a box filter
+        // (rounding odd sizes up), or the smallest level if there are
+        // less than that; the levels are built on first use and kept
+        // until the contents might change: when the surface is resized,
+        // validate() returns true, a RenderContext is constructed for it
+        // or a filter writes into it
+        //
+        // NOTE: writing to getPixels() directly doesn't know about mips,
+        // so call invalidateMips() after doing that
+        Surface & getMip(unsigned level);
+
+        // release any mip levels built by getMip()
+        void invalidateMips() { delete mip; mip = 0; }
+
         ///////////////
         // FILTER FX //
         ///////////////
 
         // blur src and place the result into this surface
         // will resize the surface to match the dimensions of src
+        //
+        // large surfaces are split across the render thread pool
+        // (see setRenderThreadPool) with identical results, which
+        // goes for all the filters below
         void blur(Surface & src, float radius);
 
         // in-place wrapper
@@ -105,6 +282,70 @@ namespace dust
         // height should be a point-distance in pixels
         void emboss(float h = 1);
 
+        // apply a chain of the above to src and place the result into
+        // this surface, resizing it to match the dimensions of src
+        void filter(Surface & src, const FilterChain & chain)
+        {
+            auto & stages = chain.getStages();
+            applyFilters(src, stages.data(), stages.size());
+        }
+
+        // in-place wrapper
+        void filter(const FilterChain & chain) { filter(*this, chain); }
+
+    private:
+        void applyFilters(Surface & src,
+            const FilterChain::Stage * stages, unsigned nStages);
+    };
+
+    // Process-wide pool of pixel buffers for temporary surfaces, such
+    // as intermediate results of filters. Buffers are allocated in size
+    // classes (four per power of two), so released buffers can be used
+    // for other sizes close enough.
+    //
+    // The pool holds at most the budget worth of released buffers,
+    // freeing the least recently released ones as necessary.
+    //
+    // This is thread-safe; normally just use PooledSurface below.
+    struct SurfacePool
+    {
+        struct Stats
+        {
+            uint64_t    hits;       // acquire() reused a buffer
+            uint64_t    misses;     // acquire() allocated a buffer
+            uint64_t    evictions;  // buffers freed to keep in budget
+            size_t      bytesPooled;    // released buffers held now
+            size_t      bytesBudget;
+            unsigned    buffersPooled;
+        };
+
+        // resize s to (w, h), taking a buffer from the pool if the
+        // current one is too small (which is then returned to the pool)
+        static void acquire(Surface & s, unsigned w, unsigned h,
+            unsigned pAlign = Surface::defaultAlign);
+
+        // return the buffer of s to the pool, leaving s empty
+        static void release(Surface & s);
+
+        // set the maximum size of released buffers to keep
+        static void setBudget(size_t bytes);
+
+        // free all the buffers currently in the pool
+        static void clear();
+
+        static Stats getStats();
+    };
+
+    // temporary surface that takes and returns its buffer to the pool
+    struct PooledSurface : Surface
+    {
+        PooledSurface(unsigned w, unsigned h,
+            unsigned pAlign = Surface::defaultAlign)
+        {
+            SurfacePool::acquire(*this, w, h, pAlign);
+        }
+
+        ~PooledSurface() { SurfacePool::release(*this); }
     };
 
 };
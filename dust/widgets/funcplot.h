@@ -1,13 +1,105 @@
-
 #ifndef DUST_WIDGET_FUNCPLOT_H
 #define DUST_WIDGET_FUNCPLOT_H
 
 #include "panel.h"
 
 #include <vector>
+#include <cmath>
 
 namespace dust
 {
+    // Min/max pyramid over a buffer of uniformly spaced samples.
+    //
+    // Level 0 is the samples themselves, level 1 has the minimum and
+    // maximum of each pair of samples, level 2 each four and so on.
+    // The range of any span of samples can then be found by looking
+    // at O(log n) entries, which makes drawing the envelope of a large
+    // buffer cost O(pixels) regardless of how many samples each covers.
+    //
+    // Appending updates the pyramid incrementally, so this also works
+    // for streaming data (eg. scopes).
+    struct MinMaxPyramid
+    {
+        struct Range { float min, max; };
+
+        void clear()
+        {
+            samples.clear();
+            levels.clear();
+        }
+
+        void append(float v)
+        {
+            samples.push_back(v);
+
+            // propagate up for as long as this completes a pair
+            unsigned i = samples.size() - 1;
+            if(!(i & 1)) return;
+
+            Range r = { (std::min)(samples[i-1], v),
+                        (std::max)(samples[i-1], v) };
+
+            for(unsigned k = 0;; ++k)
+            {
+                if(levels.size() == k) levels.emplace_back();
+                levels[k].push_back(r);
+
+                i = levels[k].size() - 1;
+                if(!(i & 1)) break;
+
+                Range & p = levels[k][i-1];
+                r.min = (std::min)(r.min, p.min);
+                r.max = (std::max)(r.max, p.max);
+            }
+        }
+
+        void append(const float * v, unsigned n)
+        {
+            for(unsigned i = 0; i < n; ++i) append(v[i]);
+        }
+
+        unsigned size() const { return samples.size(); }
+
+        float operator[](unsigned i) const { return samples[i]; }
+
+        // range of samples [i0, i1) which must be a non-empty
+        // subrange of [0, size())
+        Range query(unsigned i0, unsigned i1) const
+        {
+            Range r = { HUGE_VALF, -HUGE_VALF };
+
+            // samples at odd ends don't belong to any pair with the
+            // rest of the range, so take those and go up a level
+            if(i0 & 1) add(r, samples[i0++]);
+            if(i1 & 1) add(r, samples[--i1]);
+            i0 >>= 1; i1 >>= 1;
+
+            for(unsigned k = 0; i0 < i1; ++k)
+            {
+                if(i0 & 1) add(r, levels[k][i0++]);
+                if(i1 & 1) add(r, levels[k][--i1]);
+                i0 >>= 1; i1 >>= 1;
+            }
+            return r;
+        }
+
+    private:
+        std::vector<float>                  samples;
+        std::vector<std::vector<Range>>     levels;
+
+        static void add(Range & r, float v)
+        {
+            r.min = (std::min)(r.min, v);
+            r.max = (std::max)(r.max, v);
+        }
+
+        static void add(Range & r, const Range & v)
+        {
+            r.min = (std::min)(r.min, v.min);
+            r.max = (std::max)(r.max, v.max);
+        }
+    };
+
     // This implements basic function plotting.
     //
     struct FuncPlot : Panel
@@ -21,6 +113,18 @@ namespace dust
         // function is a vector of points
         std::vector<Point>  data;
 
+        // Alternatively, uniformly spaced samples normalized like the
+        // y-coordinates of data; if there are any, data is ignored.
+        //
+        // Samples [viewStart, viewStart + viewLength) are mapped to the
+        // width of the panel, so zooming and panning is just a matter
+        // of changing these (viewLength = 0 shows all the samples).
+        // When there are more samples than pixels, each pixel column is
+        // drawn as the min/max envelope of the samples it covers.
+        MinMaxPyramid   samples;
+        double          viewStart = 0;
+        double          viewLength = 0;
+
         ARGB    color;
 
         FuncPlot()
@@ -32,21 +136,86 @@ namespace dust
         // such that we can put many of these on top of each other
         void render(RenderContext & rc)
         {
-            if(!data.size()) return;
-
             float w = layout.w;
             float h = layout.h;
 
             Path path;
 
-            for(auto & point : data)
+            if(samples.size())
+            {
+                plotSamples(path, w, h);
+            }
+            else
             {
-                path.plot(point.x*w, point.y*h);
+                if(!data.size()) return;
+
+                for(auto & point : data)
+                {
+                    path.plot(point.x*w, point.y*h);
+                }
             }
 
             rc.strokePath(path, 1.5f * getWindow()->pt(),
                 paint::Color(color), 2, true);
         }
+
+    private:
+        void plotSamples(Path & path, float w, float h)
+        {
+            double n = samples.size();
+
+            double v0 = viewStart;
+            double vLen = viewLength > 0 ? viewLength : n;
+
+            // samples per pixel
+            double spp = vLen / w;
+
+            if(spp <= 2)
+            {
+                // plot samples directly, including one past each edge
+                int i0 = int((std::max)(0., floor(v0) - 1));
+                int i1 = int((std::min)(n, ceil(v0 + vLen) + 1));
+
+                double scale = w / vLen;
+                for(int i = i0; i < i1; ++i)
+                {
+                    path.plot(float((i - v0) * scale), samples[i] * h);
+                }
+                return;
+            }
+
+            // envelope for each pixel column: connect each column from
+            // whichever end is closer to where the previous one ended
+            float yPrev = 0;
+            bool first = true;
+
+            int columns = int(ceilf(w));
+            for(int x = 0; x < columns; ++x)
+            {
+                double s0 = floor(v0 + x * spp);
+                double s1 = floor(v0 + (x + 1) * spp);
+
+                s0 = (std::max)(s0, 0.);
+                s1 = (std::min)(s1, n);
+                if(s1 <= s0) continue;
+
+                MinMaxPyramid::Range r
+                    = samples.query(unsigned(s0), unsigned(s1));
+
+                float px = x + .5f;
+                float y0 = r.min * h, y1 = r.max * h;
+                if(!first && fabsf(y1 - yPrev) < fabsf(y0 - yPrev))
+                {
+                    std::swap(y0, y1);
+                }
+
+                path.plot(px, y0);
+                if(y1 != y0) path.plot(px, y1);
+
+                yPrev = y1;
+                first = false;
+            }
+        }
     };
 };
 
@@ -28,7 +28,8 @@ namespace dust
             if(!font.valid(dpi)) return;
 
             // calculate label size
-            sizeX = (int) ceil(font->getTextWidth(txt));
+            txt.update(font);
+            sizeX = (int) ceil(txt.getWidth());
             sizeY = (int) ceil(font->getLineHeight());
 
             reflow();
@@ -36,7 +37,7 @@ namespace dust
 
         void setText(const char * txt)
         {
-            this->txt = txt;
+            this->txt.setText(txt);
             
             auto * win = getWindow();
             recalculateSize(win ? win->getDPI() : 96.f);
@@ -74,7 +75,7 @@ namespace dust
         }
 
     private:
-        std::string txt;
+        TextRun txt;
 
         int sizeX, sizeY;
     };
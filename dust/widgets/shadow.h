@@ -0,0 +1,163 @@
+#pragma once
+
+#include "dust/gui/panel.h"
+
+#include <cmath>
+
+namespace dust
+{
+    // Style of a shadow or glow around (or inside) a rounded rectangle.
+    struct ShadowStyle
+    {
+        float   blur = 6;           // blur radius in points
+        float   corner = 0;         // corner radius in points
+        ARGB    color = 0xff000000; // premultiplied
+        bool    inner = false;      // inside the rectangle instead
+
+        bool operator==(const ShadowStyle & s) const
+        {
+            return blur == s.blur && corner == s.corner
+                && color == s.color && inner == s.inner;
+        }
+    };
+
+    // Drop shadows and glows with the blurred mask cached per panel.
+    //
+    // The straightforward way to draw a shadow is to fill the shape into
+    // a surface, blur it and composite the result, but doing this on every
+    // repaint gets slow when moving or resizing windows with shadowed
+    // popups. Instead the blurred mask is kept as a component of a panel
+    // (or any other ComponentHost) and only rebuilt when the style, the
+    // DPI or the size of the mask changes.
+    //
+    // Along each axis where the rectangle is larger than the corners and
+    // the blur on both sides, the mask is built with a single pixel of
+    // the middle, which is stretched with nine-slice drawing. This means
+    // that for most shapes the mask doesn't depend on the size at all.
+    //
+    // Outer shadows extend past the rectangle by getMargin() pixels, so
+    // draw them from a parent (or into a panel with enough padding) and
+    // offset the rectangle for drop shadows. Inner shadows are clipped
+    // to the rounded rectangle.
+    struct ShadowCache
+    {
+        // draw the shadow for the rectangle (x, y, w, h) in rc coordinates
+        // building the mask for host at the given DPI if necessary
+        template <typename Blend = blend::Over>
+        static void draw(RenderContext & rc, ComponentHost * host,
+            const ShadowStyle & style, int x, int y, int w, int h,
+            unsigned dpi)
+        {
+            if(w <= 0 || h <= 0) return;
+
+            ShadowCache & c = manager().getReference(host);
+            c.update(style, w, h, dpi);
+
+            int m = c.margin;
+            rc.nineSlice<Blend>(c.visible, x - m, y - m, w + 2*m, h + 2*m,
+                c.inset, c.inset, c.inset, c.inset);
+        }
+
+        // pixels that an outer shadow extends past the rectangle
+        static int getMargin(const ShadowStyle & style, unsigned dpi)
+        {
+            return style.inner ? 0 : spread(style.blur * dpi / 72.f);
+        }
+
+        // free the mask of host, if there is one
+        static void release(ComponentHost * host)
+        {
+            manager().destroyComponent(host);
+        }
+
+    private:
+        ShadowStyle     style;
+        unsigned        dpi = 0;
+
+        Surface         mask;
+        Surface         visible;    // view of the mask that is drawn
+
+        int             margin = 0; // see getMargin()
+        int             inset = 0;  // nine-slice borders
+
+        static ComponentManager<ShadowCache> & manager()
+        {
+            static ComponentManager<ShadowCache> cm;
+            return cm;
+        }
+
+        // how far the blur spreads before it rounds to zero
+        static int spread(float blurPx)
+        {
+            return blurPx > 0 ? int(ceilf(2.5f * blurPx)) + 1 : 0;
+        }
+
+        void update(const ShadowStyle & s, int w, int h, unsigned newDpi)
+        {
+            float scale = newDpi / 72.f;
+            float blurPx = s.blur * scale;
+            float cornerPx = (std::max)(0.f, s.corner * scale);
+
+            int e = spread(blurPx);
+
+            // distance from the edges of the drawn rectangle to where
+            // the mask stops changing along the other axis
+            int m = s.inner ? 0 : e;
+            int in = m + int(ceilf(cornerPx)) + e;
+
+            // along each axis, either just the borders and one pixel to
+            // stretch, or the exact size if there's no room for that
+            int dw = w + 2*m, dh = h + 2*m;
+            int mw = (std::min)(dw, 2*in + 1);
+            int mh = (std::min)(dh, 2*in + 1);
+
+            if(s == style && newDpi == dpi && int(visible.getSizeX()) == mw
+            && int(visible.getSizeY()) == mh) return;
+
+            style = s;
+            dpi = newDpi;
+            margin = m;
+            inset = in;
+
+            // the shape in mask coordinates, corners can't overlap
+            float x0 = float(m), y0 = float(m);
+            float x1 = float(mw - m), y1 = float(mh - m);
+            cornerPx = (std::min)(cornerPx, .5f * (std::min)(x1-x0, y1-y0));
+
+            if(!s.inner)
+            {
+                mask.validate(mw, mh);
+
+                RenderContext rc(mask);
+                rc.clear(0);
+
+                Path p;
+                p.rect(x0, y0, x1, y1, cornerPx);
+                rc.fillPath(p, paint::Color(s.color));
+
+                mask.blur(blurPx);
+                visible = mask.view(0, 0, mw, mh);
+                return;
+            }
+
+            // inner: blur the outside of the shape from far enough out
+            // that the blur doesn't see the edges of the mask, then clip
+            // to the shape and only draw the part inside
+            mask.validate(mw + 2*e, mh + 2*e);
+
+            RenderContext rc(mask);
+            rc.clear(s.color);
+
+            Path p;
+            p.rect(x0 + e, y0 + e, x1 + e, y1 + e, cornerPx);
+            rc.fillPath<blend::None>(p, paint::Color(0));
+
+            mask.blur(blurPx);
+
+            p.rect(0, 0, float(mw + 2*e), float(mh + 2*e));
+            rc.fillPath<blend::None>(p, paint::Color(0), FILL_EVENODD);
+
+            visible = mask.view(e, e, mw, mh);
+        }
+    };
+};
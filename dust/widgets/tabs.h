@@ -30,6 +30,9 @@ namespace dust
             std::string label;
             Content content;
 
+            // label prepared for drawing, updated from the string
+            TextRun labelRun;
+
             bool    modified;   // draw a marker?
         };
 
@@ -266,7 +269,11 @@ namespace dust
                             tx + tOff, f->getVertOffset() + .5f * layout.h);
                     }
 
-                    rcText.drawText(f, panel->tabs[i]->label,
+                    // only does anything if the label has changed
+                    auto & labelRun = panel->tabs[i]->labelRun;
+                    labelRun.setText(panel->tabs[i]->label);
+
+                    rcText.drawText(f, labelRun,
                         paint::Color(fgColor),
                         tx + tOff, f->getVertOffset() + .5f * layout.h);
 
@@ -0,0 +1,27 @@
+#include "bench.h"
+
+#include <cstring>
+
+// Usage: bench [name]
+//
+// Runs all the benchmarks, or just the named one.
+int main(int argc, char ** argv)
+{
+    struct { const char * name; void (*fn)(); } benches[] =
+    {
+        { "raster", bench::raster },
+        { "paint", bench::paint },
+        { "text", bench::text },
+    };
+
+    for(auto & b : benches)
+    {
+        if(argc > 1 && strcmp(argv[1], b.name)) continue;
+
+        printf("== %s\n", b.name);
+        b.fn();
+        printf("\n");
+    }
+
+    return 0;
+}
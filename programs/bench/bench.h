@@ -0,0 +1,44 @@
+#pragma once
+
+#include "dust/core/defs.h"
+
+#include <cstdio>
+
+// Minimal benchmark harness for the toolkit.
+//
+// This is a plain console program: each bench_*.cpp defines a function
+// that is called from main() in bench.cpp and prints a small table.
+//
+namespace bench
+{
+    // run fn() repeatedly for at least minMs, return microseconds per call
+    template <typename Fn>
+    static double timeUs(Fn && fn, unsigned minMs = 200)
+    {
+        // one warm-up round, so first-touch allocation is not counted
+        fn();
+
+        unsigned count = 0;
+        unsigned t0 = dust::getTimeUs();
+        unsigned t1 = t0;
+        do
+        {
+            fn(); ++count;
+            t1 = dust::getTimeUs();
+        } while(t1 - t0 < minMs * 1000);
+
+        return (t1 - t0) / double(count);
+    }
+
+    // prevent the compiler from throwing away results
+    static inline void keep(const void * p)
+    {
+#if defined(__clang__) || defined(__GNUC__)
+        __asm__ volatile("" : : "g"(p) : "memory");
+#endif
+    }
+
+    void raster();
+    void paint();
+    void text();
+};
@@ -0,0 +1,474 @@
+#include "bench.h"
+
+#include "dust/render/render.h"
+#include "dust/render/render_batch.h"
+#include "dust/thread/threadpool.h"
+#include "dust/widgets/shadow.h"
+
+#include <vector>
+#include <functional>
+
+using namespace dust;
+
+// blend a full frame of source pixels into the destination, with
+// the scalar loop and the SIMD kernel, with and without a mask
+template <typename Blend>
+static void benchBlend(const char * name, unsigned w, unsigned h)
+{
+    std::vector<ARGB>   dst(w * h), src(w);
+    std::vector<Alpha>  mask(w);
+
+    // translucent premultiplied colors, mask with some of everything
+    for(unsigned x = 0; x < w; ++x)
+    {
+        ARGB a = (x * 7) & 0xff;
+        src[x] = color::blend(0xff000000 | (x * 0x010203), a);
+        mask[x] = (x & 64) ? 0xff : (x & 32) ? 0 : Alpha(x * 5);
+    }
+    for(unsigned i = 0; i < w * h; ++i) dst[i] = 0xff203040 + i;
+
+    double t[4];
+    for(int i = 0; i < 4; ++i)
+    {
+        bool masked = i & 1, vector = i & 2;
+        t[i] = bench::timeUs([&](){
+            for(unsigned y = 0; y < h; ++y)
+            {
+                ARGB * row = dst.data() + y * w;
+                if(vector && masked)
+                    simd::SpanBlend<Blend>::blendMask(
+                        row, src.data(), mask.data(), w);
+                else if(vector)
+                    simd::SpanBlend<Blend>::blend(row, src.data(), w);
+                else if(masked)
+                    simd::SpanBlend<Blend, false>::blendMask(
+                        row, src.data(), mask.data(), w);
+                else
+                    simd::SpanBlend<Blend, false>::blend(
+                        row, src.data(), w);
+            }
+            bench::keep(dst.data());
+        });
+    }
+
+    printf("  %-12s %8.1f %8.1f %5.2fx   %8.1f %8.1f %5.2fx\n", name,
+        t[0], t[2], t[0] / t[2], t[1], t[3], t[1] / t[3]);
+}
+
+// the whole thing through RenderContext, including source colors
+static void benchFill(unsigned w, unsigned h)
+{
+    Surface s(w, h), img(w, h);
+    RenderContext rc(s);
+
+    double tColor = bench::timeUs([&](){
+        rc.fill(paint::Color(0x80336699));
+        bench::keep(s.getPixels());
+    });
+    double tImage = bench::timeUs([&](){
+        rc.fill(paint::Image(img));
+        bench::keep(s.getPixels());
+    });
+
+    printf("\n  RenderContext::fill %dx%d (us per frame)\n", w, h);
+    printf("  color over %8.1f\n  image over %8.1f\n", tColor, tImage);
+}
+
+// filled shapes are mostly fully covered pixels, which can skip the mask
+// and for opaque colors (under blend::Over) just store the color
+static void benchShapes(unsigned w, unsigned h)
+{
+    Surface s(w, h);
+    RenderContext rc(s);
+
+    Path p;
+    p.rect(8, 8, w - 8.f, h - 8.f, .25f * h);
+
+    printf("\n  rounded rect %dx%d (us per path)\n", w, h);
+    printf("                  mask    spans\n");
+
+    ARGB colors[] = { 0xff336699, 0x80336699 };
+    for(ARGB c : colors)
+    {
+        double t[2];
+        for(int spans = 0; spans < 2; ++spans)
+        {
+            t[spans] = bench::timeUs([&](){
+                rc.fillPath(p, paint::Color(c), FILL_NONZERO, 2, !spans);
+                bench::keep(s.getPixels());
+            });
+        }
+        printf("  %08x %10.1f %8.1f\n", c, t[0], t[1]);
+    }
+}
+
+// hides the spanColors overload of a paint source, so that paint
+// falls back to calling color() for every pixel
+template <typename Source>
+struct PerPixel
+{
+    const Source & src;
+
+    PerPixel(const Source & src) : src(src) {}
+
+    ARGB color(int x, int y) const { return src.color(x, y); }
+    const Rect *getClipRect() const { return src.getClipRect(); }
+};
+
+template <typename Source>
+static void benchSource(const char * name,
+    Surface & s, RenderContext & rc, const Source & src)
+{
+    double tPixel = bench::timeUs([&](){
+        rc.fill(PerPixel<Source>(src));
+        bench::keep(s.getPixels());
+    });
+    double tSpan = bench::timeUs([&](){
+        rc.fill(src);
+        bench::keep(s.getPixels());
+    });
+    printf("  %-12s %8.1f %8.1f %5.2fx\n",
+        name, tPixel, tSpan, tPixel / tSpan);
+}
+
+static void benchGradients(unsigned w, unsigned h)
+{
+    Surface s(w, h);
+    RenderContext rc(s);
+
+    paint::GradientStop stops[] = {
+        { 0.f, 0xff336699 }, { .3f, 0xc0996633 },
+        { .7f, 0x80202020 }, { 1.f, 0xff336699 } };
+
+    printf("\n  gradient fill %dx%d (us per frame)\n", w, h);
+    printf("                  pixel     span  speedup\n");
+
+    benchSource("Gradient2", s, rc, paint::Gradient2(
+        0xff336699, 0, 0, 0x80202020, w * .3f, h * 1.f));
+    benchSource("Linear", s, rc, paint::LinearGradient(
+        0, 0, w * .3f, h * 1.f, stops, 4));
+    benchSource("Radial", s, rc, paint::RadialGradient(
+        w * .5f, h * .5f, h * .5f, stops, 4));
+    benchSource("Conic", s, rc, paint::ConicGradient(
+        w * .5f, h * .5f, 0, stops, 4));
+}
+
+// drawing a pre-rendered asset at different scales
+static void benchScaled(unsigned w, unsigned h)
+{
+    Surface s(w, h), img(512, 512);
+    RenderContext rc(s);
+
+    for(unsigned y = 0; y < 512; ++y)
+    for(unsigned x = 0; x < 512; ++x)
+    {
+        img.getPixels()[x + y*img.getPitch()]
+            = color::blend(0xff000000 | (x * 0x010307), Alpha(x^y));
+    }
+
+    printf("\n  scaled 512x512 image (us per draw)\n");
+    printf("                  pixel     span  speedup\n");
+
+    float scales[] = { 3.5f, 1.5f, .7f, .3f };
+    for(float scale : scales)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "scale %.1f", scale);
+        benchSource(name, s, rc, paint::ScaledImage(img, scale, 10.5f, 10.5f));
+    }
+}
+
+// widget chrome: rounded rectangle path vs. nine-slice of a surface
+// where the same shape was rendered once
+static void benchNineSlice()
+{
+    Surface s(1024, 1024), chrome(32, 32);
+
+    const float r = 8;
+    {
+        RenderContext rc(chrome);
+        rc.clear();
+        Path p; p.rect(1, 1, 31, 31, r);
+        rc.fillPath(p, paint::Gradient2(
+            0xff5070a0, 0, 0, 0xff304060, 0, 32));
+    }
+
+    RenderContext rc(s);
+
+    printf("\n  widget chrome (us per draw)\n");
+    printf("                   path    slice  speedup\n");
+
+    int sizes[][2] = { { 120, 24 }, { 400, 200 }, { 1000, 1000 } };
+    for(auto & sz : sizes)
+    {
+        int w = sz[0], h = sz[1];
+
+        Path p; p.rect(1, 1, w - 1.f, h - 1.f, r);
+
+        double tPath = bench::timeUs([&](){
+            rc.fillPath(p, paint::Gradient2(
+                0xff5070a0, 0, 0, 0xff304060, 0, float(h)));
+            bench::keep(s.getPixels());
+        });
+        double tSlice = bench::timeUs([&](){
+            rc.nineSlice(chrome, 0, 0, w, h, 12, 12, 12, 12);
+            bench::keep(s.getPixels());
+        });
+
+        printf("  %4dx%-4d    %8.1f %8.1f %5.2fx\n",
+            w, h, tPath, tSlice, tPath / tSlice);
+    }
+}
+
+// drop shadow for a popup being resized, blurring the shape on every
+// frame versus the cached mask (see dust/widgets/shadow.h)
+static void benchShadow()
+{
+    Surface s(1024, 1024), tmp;
+    RenderContext rc(s);
+
+    ShadowStyle style;
+    style.blur = 6;
+    style.corner = 4;
+
+    ComponentHost host;
+    const unsigned dpi = 96;
+
+    printf("\n  drop shadow, resized every frame (us per draw)\n");
+    printf("                   blur   cached  speedup\n");
+
+    int sizes[][2] = { { 120, 24 }, { 400, 200 }, { 800, 600 } };
+    for(auto & sz : sizes)
+    {
+        int w = sz[0], h = sz[1];
+        int m = ShadowCache::getMargin(style, dpi);
+        float pt = dpi / 72.f;
+
+        unsigned frame = 0;
+        double tBlur = bench::timeUs([&](){
+            int d = frame++ & 15;
+            tmp.validate(w + d + 2*m, h + d + 2*m);
+            {
+                RenderContext rt(tmp);
+                rt.clear(0);
+                Path p; p.rect(float(m), float(m), float(m + w + d),
+                    float(m + h + d), style.corner * pt);
+                rt.fillPath(p, paint::Color(style.color));
+            }
+            tmp.blur(style.blur * pt);
+            rc.copy<blend::Shadow>(tmp, 32 - m, 32 - m);
+            bench::keep(s.getPixels());
+        });
+        double tCached = bench::timeUs([&](){
+            int d = frame++ & 15;
+            ShadowCache::draw<blend::Shadow>(rc, &host, style,
+                32, 32, w + d, h + d, dpi);
+            bench::keep(s.getPixels());
+        });
+
+        printf("  %4dx%-4d    %8.1f %8.1f %5.2fx\n",
+            w, h, tBlur, tCached, tBlur / tCached);
+    }
+}
+
+// interactive resizing of a window backing store
+static void benchSurfaces()
+{
+    printf("\n  resize (us per frame)\n");
+    for(unsigned slack = 0; slack <= 25; slack += 25)
+    {
+        Surface s;
+        s.setSlack(slack);
+
+        unsigned frame = 0;
+        double t = bench::timeUs([&](){
+            unsigned d = frame++ % 200;
+            s.validate(1600 + 2*d, 900 + d);
+            RenderContext rc(s);
+            rc.clear(0xff203040);
+            bench::keep(s.getPixels());
+        });
+        printf("  slack %2d%%    %8.1f\n", slack, t);
+    }
+
+}
+
+// blur of a noisy image, serially and with a render thread pool
+static void benchBlur()
+{
+    ThreadPool pool;
+
+    printf("\n  blur (us per frame)\n");
+    printf("                 radius     serial   %2d threads\n",
+        int(pool.getThreadCount() + 1));
+
+    const unsigned sizes[][2] = { { 400, 300 }, { 1920, 1080 } };
+    for(auto & sz : sizes)
+    {
+        Surface src(sz[0], sz[1]), dst;
+        ARGB * px = src.getPixels();
+        for(unsigned y = 0; y < sz[1]; ++y)
+        for(unsigned x = 0; x < sz[0]; ++x)
+        {
+            px[x + y*src.getPitch()] = 0xff000000 | (x*y*0x9e3779b1u >> 8);
+        }
+
+        for(float r = 2; r <= 32; r *= 4)
+        {
+            double t[2];
+            for(int i = 0; i < 2; ++i)
+            {
+                setRenderThreadPool(i ? &pool : 0);
+                t[i] = bench::timeUs([&](){
+                    dst.blur(src, r);
+                    bench::keep(dst.getPixels());
+                });
+            }
+            setRenderThreadPool(0);
+
+            printf("  %4dx%-4d      %6.0f   %8.1f     %8.1f\n",
+                sz[0], sz[1], r, t[0], t[1]);
+        }
+    }
+}
+
+// stacked effects with separate calls and with a filter chain
+static void benchFilters()
+{
+    ThreadPool pool;
+
+    const unsigned w = 1920, h = 1080;
+
+    printf("\n  filters %dx%d (us per frame)\n", w, h);
+    printf("                            serial   %2d threads\n",
+        int(pool.getThreadCount() + 1));
+
+    // shapes with soft edges in alpha
+    Surface src(w, h), dst;
+    ARGB * px = src.getPixels();
+    for(unsigned y = 0; y < h; ++y)
+    for(unsigned x = 0; x < w; ++x)
+    {
+        ARGB a = ((x ^ y) & 0x40) ? 0xff : (x * 5 + y * 3) & 0xff;
+        px[x + y*src.getPitch()] = color::blend(0xff808080, Alpha(a));
+    }
+
+    FilterChain chain;
+    chain.blur(8).emboss(2).fadeEdges(16);
+
+    auto row = [&](const char * name, std::function<void()> fn)
+    {
+        double t[2];
+        for(int i = 0; i < 2; ++i)
+        {
+            setRenderThreadPool(i ? &pool : 0);
+            t[i] = bench::timeUs([&](){
+                fn();
+                bench::keep(dst.getPixels());
+            });
+        }
+        setRenderThreadPool(0);
+
+        printf("  %-22s %8.1f     %8.1f\n", name, t[0], t[1]);
+    };
+
+    row("emboss", [&](){ dst.filter(src, FilterChain().emboss(2)); });
+    row("fadeEdges", [&](){ dst.filter(src, FilterChain().fadeEdges(16)); });
+    row("blur+emboss+fade", [&](){
+        dst.blur(src, 8);
+        dst.emboss(2);
+        dst.fadeEdges(16);
+    });
+    row("  chained", [&](){ dst.filter(src, chain); });
+}
+
+// the array versions of the color functions against scalar loops
+static void benchBatch()
+{
+    const unsigned n = 1 << 20;
+
+    std::vector<ARGB>   c1(n), c2(n), out(n);
+    std::vector<Alpha>  a(n);
+    for(unsigned i = 0; i < n; ++i)
+    {
+        c1[i] = color::blend(0xff000000 | (i * 0x030507), Alpha(i * 7));
+        c2[i] = 0xff203040 + i * 0x010101;
+        a[i] = Alpha(i * 13);
+    }
+
+    printf("\n  color::batch (%s) %d pixels (us)\n",
+        color::batch::getImplementation(), n);
+    printf("                 scalar    batch  speedup\n");
+
+    auto row = [&](const char * name,
+        std::function<void()> scalar, std::function<void()> batch)
+    {
+        double ts = bench::timeUs([&](){
+            scalar(); bench::keep(out.data());
+        });
+        double tb = bench::timeUs([&](){
+            batch(); bench::keep(out.data());
+        });
+        printf("  %-12s %8.1f %8.1f %7.2fx\n", name, ts, tb, ts / tb);
+    };
+
+    row("blend", [&](){
+        for(unsigned i = 0; i < n; ++i) out[i] = color::blend(c1[i], a[i]);
+    }, [&](){
+        color::batch::blend(out.data(), c1.data(), a.data(), n);
+    });
+    row("multiply", [&](){
+        for(unsigned i = 0; i < n; ++i)
+            out[i] = color::multiply(c1[i], c2[i]);
+    }, [&](){
+        color::batch::multiply(out.data(), c1.data(), c2.data(), n);
+    });
+    row("AoverB", [&](){
+        for(unsigned i = 0; i < n; ++i) out[i] = color::AoverB(c1[i], c2[i]);
+    }, [&](){
+        color::batch::AoverB(out.data(), c1.data(), c2.data(), n);
+    });
+    row("alphaMask", [&](){
+        for(unsigned i = 0; i < n; ++i)
+            out[i] = color::alphaMask(c1[i], c2[i], a[i]);
+    }, [&](){
+        color::batch::alphaMask(out.data(),
+            c1.data(), c2.data(), a.data(), n);
+    });
+    row("divide", [&](){
+        for(unsigned i = 0; i < n; ++i) out[i] = color::divide(c1[i], c2[i]);
+    }, [&](){
+        color::batch::divide(out.data(), c1.data(), c2.data(), n);
+    });
+}
+
+void bench::paint()
+{
+    const unsigned w = 3840, h = 2160;
+
+    printf("  blend %dx%d (us per frame)\n", w, h);
+    printf("                 scalar     simd  speedup"
+        "     masked     simd  speedup\n");
+
+    benchBlend<blend::None>("None", w, h);
+    benchBlend<blend::Add>("Add", w, h);
+    benchBlend<blend::Over>("Over", w, h);
+    benchBlend<blend::Under>("Under", w, h);
+    benchBlend<blend::Multiply>("Multiply", w, h);
+    benchBlend<blend::Screen>("Screen", w, h);
+    benchBlend<blend::MaskIn>("MaskIn", w, h);
+    benchBlend<blend::MaskOut>("MaskOut", w, h);
+    benchBlend<blend::Shadow>("Shadow", w, h);
+    benchBlend<blend::InnerGlow>("InnerGlow", w, h);
+
+    benchFill(w, h);
+    benchShapes(w, h);
+    benchGradients(w, h);
+    benchScaled(w, h);
+    benchNineSlice();
+    benchShadow();
+    benchSurfaces();
+    benchBlur();
+    benchFilters();
+    benchBatch();
+}
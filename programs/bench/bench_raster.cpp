@@ -0,0 +1,317 @@
+#include "bench.h"
+
+#include "dust/render/render.h"
+#include "dust/render/raster_resolve.h"
+
+#include <cstring>
+#include <vector>
+
+using namespace dust;
+
+// coverage resolve: scalar reference vs. SIMD kernel for one quality level
+template <unsigned sampleBits>
+static void benchResolve(unsigned w, unsigned h)
+{
+    typedef raster::Resolve<sampleBits> R;
+
+    const int maxCoverage = 1 << (2*sampleBits);
+
+    // build coverage deltas that sum to a valid ramp-like pattern
+    // resolving clears the coverage, so we copy these back every row
+    std::vector<short>  deltas(w);
+    int prev = 0;
+    for(unsigned x = 0; x < w; ++x)
+    {
+        int c = ((x * 37) >> 3) % (maxCoverage + 1);
+        deltas[x] = short(c - prev);
+        prev = c;
+    }
+
+    std::vector<short>      coverage(w);
+    std::vector<uint8_t>    mask(w * h);
+
+    // check that the kernel is exact before timing anything
+    std::vector<uint8_t>    check(w);
+    memcpy(coverage.data(), deltas.data(), w * sizeof(short));
+    R::scalar(coverage.data(), check.data(), w, 1);
+    memcpy(coverage.data(), deltas.data(), w * sizeof(short));
+    R::simd(coverage.data(), mask.data(), w, 1);
+    bool exact = !memcmp(check.data(), mask.data(), w);
+
+    double tScalar = bench::timeUs([&](){
+        for(unsigned y = 0; y < h; ++y)
+        {
+            memcpy(coverage.data(), deltas.data(), w * sizeof(short));
+            R::scalar(coverage.data(), mask.data() + y*w, w, 1);
+        }
+        bench::keep(mask.data());
+    });
+
+    double tSimd = bench::timeUs([&](){
+        for(unsigned y = 0; y < h; ++y)
+        {
+            memcpy(coverage.data(), deltas.data(), w * sizeof(short));
+            R::simd(coverage.data(), mask.data() + y*w, w, 1);
+        }
+        bench::keep(mask.data());
+    });
+
+    // vertical scan writes columns, so pitch is the image width
+    double tScalarV = bench::timeUs([&](){
+        for(unsigned y = 0; y < h; ++y)
+        {
+            memcpy(coverage.data(), deltas.data(), h * sizeof(short));
+            R::scalar(coverage.data(), mask.data() + y, h, w);
+        }
+        bench::keep(mask.data());
+    });
+
+    double tSimdV = bench::timeUs([&](){
+        for(unsigned y = 0; y < h; ++y)
+        {
+            memcpy(coverage.data(), deltas.data(), h * sizeof(short));
+            R::simd(coverage.data(), mask.data() + y, h, w);
+        }
+        bench::keep(mask.data());
+    });
+
+    printf("  q%d   %8.1f %8.1f %5.2fx   %8.1f %8.1f %5.2fx   %s\n",
+        sampleBits, tScalar, tSimd, tScalar / tSimd,
+        tScalarV, tSimdV, tScalarV / tSimdV, exact ? "exact" : "MISMATCH");
+}
+
+// full path fill of a window-sized shape at each quality
+static void benchFill(unsigned w, unsigned h)
+{
+    std::vector<uint8_t>    mask(w * h);
+
+    Path p;
+    p.rect(8, 8, w - 8.f, h - 8.f, .25f * h);
+
+    // thin strokes are mostly edges, so they show the sampling cost
+    Path wave;
+    for(unsigned x = 0; x < w; x += 4)
+    {
+        wave.plot(float(x), .5f * h * (1 + sinf(x * .01f)));
+    }
+
+    printf("\n  fill %dx%d (us per path)\n", w, h);
+    printf("           fill   stroke\n");
+    for(int q = -1; q <= 4; ++q)
+    {
+        double t = bench::timeUs([&](){
+            Rect clip(0, 0, w, h);
+            renderPathRef(p, clip, FILL_NONZERO,
+                mask.data(), w, q, false);
+            bench::keep(mask.data());
+        });
+        double tStroke = bench::timeUs([&](){
+            Rect clip(0, 0, w, h);
+            strokePathRef(wave, 1.5f, clip, mask.data(), w, q, false);
+            bench::keep(mask.data());
+        });
+        if(q == QUALITY_ANALYTIC) printf("  area");
+        else printf("  q%d  ", q);
+        printf(" %8.1f %8.1f\n", t, tStroke);
+    }
+}
+
+// edge count sweep: random polygons and waveform plots with N edges
+// this is mostly about sorting and active edge list maintenance
+static void benchEdges()
+{
+    const unsigned w = 1024, h = 1024;
+    std::vector<uint8_t>    mask(w * h);
+
+    printf("\n  edge sweep %dx%d q2 (us per path)\n", w, h);
+    printf("    edges    polygon   waveform\n");
+    for(unsigned n = 16; n <= 65536; n *= 4)
+    {
+        // random polygon: lots of crossings and long edges
+        Path poly;
+        unsigned seed = 1;
+        for(unsigned i = 0; i < n; ++i)
+        {
+            seed = seed * 1103515245u + 12345u;
+            float x = float((seed >> 8) % (w * 16)) / 16;
+            seed = seed * 1103515245u + 12345u;
+            float y = float((seed >> 8) % (h * 16)) / 16;
+            poly.plot(x, y);
+        }
+        poly.close();
+
+        // waveform: short edges, few active at a time
+        Path wave;
+        for(unsigned i = 0; i <= n; ++i)
+        {
+            float x = float(i) * w / n;
+            wave.plot(x, .5f * h * (1 + .9f * sinf(x * .05f)
+                * cosf(x * .0031f)));
+        }
+        wave.plot(float(w), float(h));
+        wave.plot(0, float(h));
+        wave.close();
+
+        double tPoly = bench::timeUs([&](){
+            Rect clip(0, 0, w, h);
+            renderPathRef(poly, clip, FILL_EVENODD,
+                mask.data(), w, 2, false);
+            bench::keep(mask.data());
+        });
+        double tWave = bench::timeUs([&](){
+            Rect clip(0, 0, w, h);
+            renderPathRef(wave, clip, FILL_NONZERO,
+                mask.data(), w, 2, false);
+            bench::keep(mask.data());
+        });
+        printf("  %7d %10.1f %10.1f\n", n, tPoly, tWave);
+    }
+}
+
+// dense plot like FuncPlot draws: outline stroke vs. hairline
+static void benchHairline(unsigned w, unsigned h)
+{
+    std::vector<uint8_t>    mask(w * h);
+
+    const unsigned n = 10000;
+
+    Path plot;
+    for(unsigned i = 0; i <= n; ++i)
+    {
+        float x = float(i) * w / n;
+        plot.plot(x, .5f * h * (1 + .8f * sinf(x * .013f) * cosf(x * .2f)));
+    }
+
+    printf("\n  plot %d points %dx%d (us per path)\n", n, w, h);
+    printf("   width   stroke q2  hairline  speedup\n");
+    for(float width = 1.f; width <= hairlineMaxWidth; width += .5f)
+    {
+        double tStroke = bench::timeUs([&](){
+            Rect clip(0, 0, w, h);
+            strokePathRef(plot, width, clip, mask.data(), w, 2, false);
+            bench::keep(mask.data());
+        });
+        double tHair = bench::timeUs([&](){
+            Rect clip(0, 0, w, h);
+            strokeHairlineRef(plot, width, clip, mask.data(), w);
+            bench::keep(mask.data());
+        });
+        printf("  %6.1f %11.1f %9.1f %7.2fx\n",
+            width, tStroke, tHair, tStroke / tHair);
+    }
+}
+
+// the same paint through RenderContext, with a mask (vScan = true)
+// or with spans (vScan = false) which skip everything outside the path
+//
+// vScan only changes how the path is scanned, not the result, so this
+// compares the cost of painting the whole clip rect with the mask
+//
+// the strokes are wider than hairlineMaxWidth, since hairlines are
+// drawn the same way in both cases
+static void benchSpans(unsigned w, unsigned h)
+{
+    Surface s(w, h);
+    RenderContext rc(s);
+
+    Path diag;
+    diag.move(16, 16);
+    diag.line(w - 16.f, h - 16.f);
+
+    Path wave;
+    for(unsigned x = 0; x < w; x += 4)
+    {
+        wave.plot(float(x), .5f * h * (1 + sinf(x * .01f)));
+    }
+
+    Path round;
+    round.rect(8, 8, w - 8.f, h - 8.f, .25f * h);
+
+    struct { const char * name; Path & p; float width; } tests[] =
+    {
+        { "diagonal", diag, 3.f },
+        { "wave", wave, 3.f },
+        { "rounded", round, 0.f },
+    };
+
+    printf("\n  mask vs. spans %dx%d (us per path)\n", w, h);
+    printf("                 mask    spans  speedup\n");
+    for(auto & t : tests)
+    {
+        double tMask[2];
+        for(int spans = 0; spans < 2; ++spans)
+        {
+            tMask[spans] = bench::timeUs([&](){
+                if(t.width > 0)
+                {
+                    rc.strokePath(t.p, t.width,
+                        paint::Color(0xff336699), 2, !spans);
+                }
+                else
+                {
+                    rc.fillPath(t.p, paint::Color(0xff336699),
+                        FILL_NONZERO, 2, !spans);
+                }
+                bench::keep(s.getPixels());
+            });
+        }
+        printf("  %-10s %8.1f %8.1f %7.2fx\n", t.name,
+            tMask[0], tMask[1], tMask[0] / tMask[1]);
+    }
+}
+
+// lots of small paths, like widgets draw: with the scratch kept
+// between frames (like Window does) there should be no allocations
+static void benchSmallPaths(unsigned w, unsigned h)
+{
+    Surface s(w, h);
+    RasterScratch scratch;
+
+    const unsigned nPaths = 500;
+
+    unsigned allocs = 0;
+    double t = bench::timeUs([&](){
+        unsigned a0 = getRasterAllocCount();
+
+        RenderContext rc(s);
+        MaskDataBorrow borrow(scratch, rc);
+        for(unsigned i = 0; i < nPaths; ++i)
+        {
+            float x = float((i * 37) % (w - 40));
+            float y = float((i * 53) % (h - 20));
+
+            Path p;
+            p.rect(x, y, x + 32, y + 16, 4);
+            rc.fillPath(p, paint::Color(0xff336699));
+            rc.strokePath(p, 1.f, paint::Color(0xff000000));
+        }
+        bench::keep(s.getPixels());
+
+        allocs = getRasterAllocCount() - a0;
+    });
+
+    printf("\n  %d small paths (fill + stroke)\n", nPaths);
+    printf("  %8.1f us per frame, %d allocations in the last frame\n",
+        t, allocs);
+}
+
+void bench::raster()
+{
+    const unsigned w = 3840, h = 2160;
+
+    printf("  resolve %dx%d (us per frame)\n", w, h);
+    printf("       scalar     simd  speedup   "
+        "scalarV    simdV  speedup\n");
+
+    benchResolve<0>(w, h);
+    benchResolve<1>(w, h);
+    benchResolve<2>(w, h);
+    benchResolve<3>(w, h);
+    benchResolve<4>(w, h);
+
+    benchFill(w, h);
+    benchEdges();
+    benchHairline(1000, 300);
+    benchSpans(w, h);
+    benchSmallPaths(w, h);
+}
@@ -0,0 +1,185 @@
+#include "bench.h"
+
+#include "dust/core/utf8.h"
+#include "dust/render/render.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace dust;
+
+// read a whole file, returns an empty string on failure
+static std::string readFile(const char * path)
+{
+    std::string out;
+
+    FILE * f = fopen(path, "rb");
+    if(!f) return out;
+
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f))) out.append(buf, n);
+    fclose(f);
+
+    return out;
+}
+
+// a large source file to measure: the rasterizer repeated a few times
+// to get to a few megabytes, or just this file if we're not running
+// from the root of the repository
+static std::string loadSource()
+{
+    std::string src = readFile("dust/render/raster_ref.cpp");
+    if(!src.size()) src = readFile(__FILE__);
+    if(!src.size()) src = "int main() { return 0; }\n";
+
+    std::string out;
+    while(out.size() < (4 << 20)) out += src;
+    return out;
+}
+
+// append a character as UTF-8
+static void appendChar(std::string & out, unsigned ch)
+{
+    if(ch < 0x80) { out += char(ch); return; }
+
+    unsigned n = ch < 0x800 ? 1 : ch < 0x10000 ? 2 : 3;
+    out += char(((0xff80 >> n) & 0xff) | (ch >> (6 * n)));
+    while(n--) out += char(0x80 | ((ch >> (6 * n)) & 0x3f));
+}
+
+// split text into lines, without the newlines
+static void splitText(const std::string & txt,
+    std::vector<std::string> & lines)
+{
+    size_t pos = 0;
+    while(pos < txt.size())
+    {
+        size_t end = txt.find('\n', pos);
+        if(end == std::string::npos) end = txt.size();
+        lines.push_back(txt.substr(pos, end - pos));
+        pos = end + 1;
+    }
+}
+
+// measure the text the ways the widgets do
+static void benchMeasure(const char * name, Font & font,
+    const std::string & txt, const std::vector<std::string> & lines)
+{
+    double mb = txt.size() / double(1 << 20);
+
+    // like TextArea::recalculateSize and LogView: one char at a time
+    double tChars = bench::timeUs([&](){
+        utf8::Decoder decoder;
+        float w = 0;
+        for(char c : txt)
+        {
+            if(decoder.next(c)) w += font->getCharAdvanceW(decoder.ch);
+        }
+        bench::keep(&w);
+    });
+
+    // like labels, once for each line
+    double tLines = bench::timeUs([&](){
+        float w = 0;
+        for(auto & line : lines) w += font->getTextWidth(line);
+        bench::keep(&w);
+    });
+
+    // word wrapping
+    std::vector<unsigned> breaks;
+    double tSplit = bench::timeUs([&](){
+        font->splitLines(breaks, txt.c_str(), txt.size(), 600, 600);
+        bench::keep(breaks.data());
+    });
+
+    printf("  %-10s %8.0f %6.0f %8.0f %6.0f %8.0f %6.0f\n", name,
+        tChars, mb / tChars * 1e6, tLines, mb / tLines * 1e6,
+        tSplit, mb / tSplit * 1e6);
+}
+
+// a toolbar worth of labels, drawn from strings and prepared runs
+static void benchLabels()
+{
+    const char * names[] = { "File", "Edit", "View", "Search", "Build",
+        "Debug", "Tools", "Window", "Help", "Undo", "Redo", "Cut", "Copy",
+        "Paste", "Find", "Replace", "Go to line", "Preferences" };
+    const unsigned n = sizeof(names) / sizeof(*names);
+
+    Font font;
+    font.loadDefaultFont(8);
+
+    std::vector<TextRun> runs(n);
+    for(unsigned i = 0; i < n; ++i) runs[i].setText(names[i]);
+
+    Surface s(1600, 40);
+    RenderContext rc(s);
+
+    double tText = bench::timeUs([&](){
+        for(unsigned i = 0; i < n; ++i)
+        {
+            rc.drawCenteredText(font, names[i], strlen(names[i]),
+                paint::Color(0xff000000), 40.f + 85 * i, 25);
+        }
+        bench::keep(s.getPixels());
+    });
+    double tRuns = bench::timeUs([&](){
+        for(unsigned i = 0; i < n; ++i)
+        {
+            rc.drawCenteredText(font, runs[i],
+                paint::Color(0xff000000), 40.f + 85 * i, 25);
+        }
+        bench::keep(s.getPixels());
+    });
+
+    printf("\n  %d centered labels (us per frame)\n", n);
+    printf("                   text     runs  speedup\n");
+    printf("  %-10s   %8.2f %8.2f %7.2fx\n", "toolbar",
+        tText, tRuns, tText / tRuns);
+}
+
+void bench::text()
+{
+    std::string txt = loadSource();
+
+    std::vector<std::string> lines;
+    splitText(txt, lines);
+
+    printf("  measure %.1f MB of source, %d lines (us per pass, MB/s)\n",
+        txt.size() / double(1 << 20), unsigned(lines.size()));
+    printf("               chars   MB/s    lines   MB/s    split   MB/s\n");
+
+    Font mono, sans;
+    mono.loadDefaultMono(10);
+    sans.loadDefaultFont(10);
+
+    benchMeasure("mono", mono, txt, lines);
+    benchMeasure("sans", sans, txt, lines);
+
+    // the same amount of text, but across the planes: ASCII, Latin-1,
+    // Cyrillic, CJK and emoji, so every kind of lookup gets used
+    std::string mixed;
+    {
+        const unsigned chars[] = { 'a', 'Z', ' ', 0xe9, 0x416, 0x3b1,
+            0x4e2d, 0x6587, 0x2192, 0x1f600, 0x1f680, '(', ';' };
+
+        const unsigned nChars = sizeof(chars) / sizeof(*chars);
+
+        std::string pattern;
+        for(unsigned i = 0; i < 64; ++i)
+        {
+            appendChar(pattern, chars[(i * 7) % nChars]);
+        }
+        pattern += '\n';
+
+        while(mixed.size() < txt.size()) mixed += pattern;
+    }
+
+    lines.clear();
+    splitText(mixed, lines);
+
+    benchMeasure("mixed", sans, mixed, lines);
+
+    benchLabels();
+}
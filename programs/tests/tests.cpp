@@ -0,0 +1,28 @@
+#include "tests.h"
+
+#include <cstring>
+
+unsigned tests::failures = 0;
+
+// Usage: tests [name]
+//
+// Runs all the tests, or just the named one.
+int main(int argc, char ** argv)
+{
+    struct { const char * name; void (*fn)(); } groups[] =
+    {
+        { "render", tests::render },
+        { "parallel", tests::parallel },
+    };
+
+    for(auto & g : groups)
+    {
+        if(argc > 1 && strcmp(argv[1], g.name)) continue;
+
+        printf("== %s\n", g.name);
+        g.fn();
+    }
+
+    printf("%d failures\n", tests::failures);
+    return tests::failures;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "dust/core/defs.h"
+
+#include <cstdio>
+
+// Minimal regression tests for the toolkit.
+//
+// This is a plain console program like programs/bench: each tests_*.cpp
+// defines a function that is called from main() in tests.cpp and uses
+// check() to report failures. The exit code is the number of failures.
+//
+namespace tests
+{
+    extern unsigned failures;
+
+    // report a failure if ok is false
+    static inline void check(bool ok, const char * what)
+    {
+        if(ok) return;
+
+        printf("  FAIL: %s\n", what);
+        ++failures;
+    }
+
+    void render();
+    void parallel();
+};
@@ -0,0 +1,185 @@
+#include "tests.h"
+
+#include "dust/render/render.h"
+#include "dust/thread/threadpool.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+using namespace dust;
+
+// Rendering with setRenderThreadPool() splits large paths and filters
+// into bands and promises the same output as rendering serially, bit
+// for bit. Everything here is drawn both ways and compared.
+
+static const unsigned sizeX = 600, sizeY = 480;
+
+// like Application, the pool is kept for the rest of the process, as
+// helper tasks can still be in the queue when rendering returns
+static ThreadPool * testPool()
+{
+    static ThreadPool * pool = new ThreadPool(false, 4);
+    return pool;
+}
+
+// true if the surfaces have the same size and pixels
+static bool samePixels(Surface & a, Surface & b)
+{
+    if(a.getSizeX() != b.getSizeX() || a.getSizeY() != b.getSizeY())
+        return false;
+
+    for(unsigned y = 0; y < a.getSizeY(); ++y)
+    {
+        if(memcmp(a.getPixels() + y * a.getPitch(),
+            b.getPixels() + y * b.getPitch(), a.getSizeX() * sizeof(ARGB)))
+            return false;
+    }
+    return true;
+}
+
+// a large shape with curves, a hole and self-intersections, so that
+// edges cross the band boundaries in every direction
+static void makePath(Path & p)
+{
+    p.rect(20, 20, sizeX - 20, sizeY - 20, 60);
+
+    p.move(sizeX / 2.f, 40);
+    for(unsigned i = 1; i < 11; ++i)
+    {
+        float a = i * 3.1415927f * 4 / 11;
+        p.line(sizeX / 2.f + 250 * sinf(a), sizeY / 2.f - 200 * cosf(a));
+    }
+    p.close();
+
+    p.move(100, 240);
+    p.cubic(100, 0, 500, 480, 500, 240);
+    p.quad(300, 470, 100, 240);
+    p.close();
+}
+
+// fill and stroke into a surface, through spans or a vScan mask
+static void drawPaths(Surface & s, int quality, bool vScan)
+{
+    Path p;
+    makePath(p);
+
+    s.validate(sizeX, sizeY);
+    RenderContext rc(s);
+    rc.clear(0xff000000);
+
+    rc.fillPath(p, paint::Gradient2(0xff2040c0, 0, 0,
+        0xffe0a020, float(sizeX), float(sizeY)),
+        FILL_EVENODD, quality, vScan);
+    rc.strokePath(p, 7.5f, paint::Color(0x80ffffff), quality, vScan);
+}
+
+// fill and stroke straight into alpha masks
+static void maskPaths(std::vector<Alpha> & mask, int quality, bool vScan)
+{
+    Path p;
+    makePath(p);
+
+    mask.assign(2 * sizeX * sizeY, 0);
+
+    // these shrink the clip, so each gets its own
+    Rect fillClip(0, 0, sizeX, sizeY), strokeClip(0, 0, sizeX, sizeY);
+    renderPathRef(p, fillClip, FILL_NONZERO,
+        mask.data(), sizeX, quality, vScan);
+    strokePathRef(p, 7.5f, strokeClip,
+        mask.data() + sizeX * sizeY, sizeX, quality, vScan);
+}
+
+static void testParallelPaths()
+{
+    const int qualities[] = { 0, 2, QUALITY_ANALYTIC };
+
+    for(int quality : qualities)
+    {
+        for(int vScan = 0; vScan < 2; ++vScan)
+        {
+            Surface s0, s1;
+            std::vector<Alpha> m0, m1;
+
+            setRenderThreadPool(0);
+            drawPaths(s0, quality, vScan);
+            maskPaths(m0, quality, vScan);
+
+            setRenderThreadPool(testPool());
+            drawPaths(s1, quality, vScan);
+            maskPaths(m1, quality, vScan);
+
+            setRenderThreadPool(0);
+
+            char what[64];
+            snprintf(what, sizeof(what), "parallel %s, quality %d",
+                vScan ? "vScan" : "spans", quality);
+            tests::check(samePixels(s0, s1), what);
+
+            snprintf(what, sizeof(what), "parallel %s mask, quality %d",
+                vScan ? "vScan" : "row", quality);
+            tests::check(m0 == m1, what);
+        }
+    }
+}
+
+// a FilterChain is applied in one pass, with the same result as the
+// filters one at a time (see Surface::filter)
+static FilterChain testChain()
+{
+    FilterChain chain;
+    chain.blur(4.5f).emboss(1.5f).blur(2).fadeEdges(12);
+    return chain;
+}
+
+static void applyChain(Surface & dst, Surface & src, bool chain)
+{
+    if(chain) { dst.filter(src, testChain()); return; }
+
+    dst.blur(src, 4.5f);
+    dst.emboss(1.5f);
+    dst.blur(2);
+    dst.fadeEdges(12);
+}
+
+static void testParallelFilters()
+{
+    // transparent around the shape, so emboss has some height to use
+    Path p;
+    makePath(p);
+
+    Surface src(sizeX, sizeY);
+    {
+        RenderContext rc(src);
+        rc.clear();
+        rc.fillPath(p, paint::Color(0xff4080c0), FILL_EVENODD);
+    }
+
+    Surface out[4];
+
+    setRenderThreadPool(0);
+    applyChain(out[0], src, false);
+    applyChain(out[1], src, true);
+
+    setRenderThreadPool(testPool());
+    applyChain(out[2], src, false);
+    applyChain(out[3], src, true);
+
+    setRenderThreadPool(0);
+
+    tests::check(samePixels(out[0], out[1]), "chain vs separate filters");
+    tests::check(samePixels(out[0], out[2]), "parallel separate filters");
+    tests::check(samePixels(out[0], out[3]), "parallel filter chain");
+
+    // and in place
+    Surface copy;
+    copy.filter(src, FilterChain());
+    copy.filter(testChain());
+    tests::check(samePixels(out[0], copy), "filter chain in place");
+}
+
+void tests::parallel()
+{
+    testParallelPaths();
+    testParallelFilters();
+}
@@ -0,0 +1,178 @@
+#include "tests.h"
+
+#include "dust/render/render.h"
+
+#include <cstring>
+
+using namespace dust;
+
+// true if every pixel of s has the color c
+static bool allPixels(Surface & s, ARGB c)
+{
+    for(unsigned y = 0; y < s.getSizeY(); ++y)
+    {
+        ARGB * row = s.getPixels() + y * s.getPitch();
+        for(unsigned x = 0; x < s.getSizeX(); ++x)
+        {
+            if(row[x] != c) return false;
+        }
+    }
+    return true;
+}
+
+// rects that clip to nothing must not paint anything, in particular
+// the opaque fill path must not see a negative width
+static void testClippedFill()
+{
+    Surface s(100, 100);
+    RenderContext rc(s);
+    rc.clear(0xff000000);
+
+    rc.fillRect(paint::Color(0xff112233), 200, 10, 20, 20);
+    rc.fillRect(paint::Color(0xff112233), -50, 10, 20, 20);
+    rc.fillRect(paint::Color(0xff112233), 10, 200, 20, 20);
+    rc.fillRect(paint::Color(0x80112233), 200, 10, 20, 20);
+
+    tests::check(allPixels(s, 0xff000000), "fillRect outside the clip");
+
+    rc.fillRect(paint::Color(0xff112233), 0, 0, 100, 100);
+    tests::check(allPixels(s, 0xff112233), "fillRect inside the clip");
+}
+
+// platform code (icons, blits) relies on pitch == width by default
+static void testSurfacePitch()
+{
+    Surface s(24, 24);
+    tests::check(s.getPitch() == 24, "default pitch is the width");
+
+    s.validate(13, 7);
+    tests::check(s.getPitch() == 13, "validate() keeps pitch == width");
+
+    Surface a(24, 24, Surface::cacheLineAlign);
+    tests::check(a.getPitch() % Surface::cacheLineAlign == 0
+        && !(uintptr_t(a.getPixels()) & 63), "cache line aligned rows");
+
+    // asking for alignment at the same size lays the surface out again,
+    // while the default alignment keeps whatever pitch there is
+    bool lost = s.validate(13, 7, Surface::cacheLineAlign);
+    tests::check(lost && s.getPitch() % Surface::cacheLineAlign == 0,
+        "validate() aligns a same-size surface");
+    tests::check(!s.validate(13, 7) && s.getPitch() != 13,
+        "validate() keeps an aligned pitch");
+}
+
+// an IPaint written before paintSpans() existed, which only
+// records the coverage it's given into a row of alpha
+struct RecordPaint : IPaint
+{
+    Alpha   row[64] = {};
+
+    void paintRect(const Rect & r)
+    {
+        for(int x = r.x0; x < r.x1; ++x) row[x] = 0xff;
+    }
+
+    void paintRectMask(const Rect & r, Alpha * mask, unsigned maskPitch)
+    {
+        for(int x = r.x0; x < r.x1; ++x)
+            row[x] = mask[x + maskPitch * r.y0];
+    }
+};
+
+// the default paintSpans() in terms of paintRect() and paintRectMask()
+static void testDefaultSpans()
+{
+    Alpha mask[4] = { 10, 20, 30, 40 };
+    Span spans[3] = { { 2, 5, 0 }, { 8, 12, mask }, { 20, 18, 0 } };
+
+    RecordPaint paint;
+    IPaint & ip = paint;
+    ip.paintSpans(7, spans, 3);
+
+    bool ok = true;
+    for(int x = 0; x < 64; ++x)
+    {
+        Alpha want = 0;
+        if(x >= 2 && x < 5) want = 0xff;
+        if(x >= 8 && x < 12) want = mask[x - 8];
+        if(paint.row[x] != want) ok = false;
+    }
+    tests::check(ok, "default IPaint::paintSpans()");
+}
+
+// the gradient parameters can still be read and adjusted, and the
+// colors follow them without any extra calls, even after painting
+static void testGradient2()
+{
+    paint::Gradient2 g(0xff000000, 0, 0, 0xffffffff, 10, 0);
+    tests::check(g.c0 == 0xff000000 && g.c1 == 0xffffffff
+        && g.x0 == 0 && g.dx == 10 && g.dy == 0, "Gradient2 parameters");
+
+    Surface s(32, 4), want(32, 4);
+    RenderContext(s).fill(g);
+
+    paint::Gradient2 moved(0xff000000, 5, 0, 0xff0000ff, 15, 0);
+    g.x0 = 5;
+    g.c1 = 0xff0000ff;
+
+    bool same = true;
+    for(int x = -5; x < 25; ++x)
+    {
+        if(g.color(x, 3) != moved.color(x, 3)) same = false;
+    }
+    tests::check(same, "Gradient2 color() after changes");
+
+    // the colors aren't quite opaque, so start from the same background
+    RenderContext(s).clear();
+    RenderContext(want).clear();
+    RenderContext(s).fill(g);
+    RenderContext(want).fill(moved);
+    tests::check(!memcmp(s.getPixels(), want.getPixels(),
+        32 * 4 * sizeof(ARGB)), "Gradient2 paint after changes");
+}
+
+// nine-slicing an empty surface draws nothing, rather than crashing
+static void testEmptyNineSlice()
+{
+    Surface s(64, 64), empty;
+    RenderContext rc(s);
+    rc.clear(0xff000000);
+
+    rc.nineSlice(empty, 0, 0, 64, 64, 4, 4, 4, 4);
+    rc.nineSlice(empty, 0, 0, 64, 64, 4, 4, 4, 4, true);
+
+    tests::check(allPixels(s, 0xff000000), "nineSlice() from empty surface");
+}
+
+// mips must follow the contents of the surface, whether they change
+// by drawing into it or with a filter
+static void testMipInvalidation()
+{
+    Surface src(64, 64), dst(16, 16), green(64, 64);
+
+    RenderContext(src).clear(0xffff0000);
+    RenderContext(dst).fill(paint::ScaledImage(src, .25f));
+    bool ok = allPixels(dst, 0xffff0000);
+
+    RenderContext(src).clear(0xff0000ff);
+    RenderContext(dst).fill(paint::ScaledImage(src, .25f));
+    ok = ok && allPixels(dst, 0xff0000ff);
+
+    tests::check(ok, "RenderContext invalidates mips");
+
+    // an empty chain just copies
+    RenderContext(green).clear(0xff00ff00);
+    src.filter(green, FilterChain());
+    tests::check(allPixels(src.getMip(2), 0xff00ff00),
+        "filters invalidate mips");
+}
+
+void tests::render()
+{
+    testClippedFill();
+    testSurfacePitch();
+    testDefaultSpans();
+    testGradient2();
+    testEmptyNineSlice();
+    testMipInvalidation();
+}